@@ -1,5 +1,8 @@
 #include "assimp_loading.h"
+#include "culling.h"
 #include "resource_management.h"
+#include "geometry_heap.h"
+#include "staging_ring.h"
 
 void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
 {
@@ -161,7 +164,8 @@ void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 bas
 	}
 }
 
-u32 LoadModel(App* app, const char* filename, GLint texParam)
+//Fills the mesh and the materials of the model, and stages the geometry in the heap
+static bool ImportModel(App* app, const char* filename, GLint texParam, u32 modelIdx)
 {
 	const aiScene* scene = aiImportFile(filename,
 		aiProcess_Triangulate |
@@ -176,17 +180,11 @@ u32 LoadModel(App* app, const char* filename, GLint texParam)
 	if (!scene)
 	{
 		ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
-		return UINT32_MAX;
+		return false;
 	}
 
-	app->meshes.push_back(Mesh{});
-	Mesh& mesh = app->meshes.back();
-	u32 meshIdx = (u32)app->meshes.size() - 1u;
-
-	app->models.push_back(Model{});
-	Model& model = app->models.back();
-	model.meshIdx = meshIdx;
-	u32 modelIdx = (u32)app->models.size() - 1u;
+	Model& model = app->models[modelIdx];
+	Mesh& mesh = app->meshes[model.meshIdx];
 
 	String directory = GetDirectoryPart(MakeString(filename));
 
@@ -203,46 +201,71 @@ u32 LoadModel(App* app, const char* filename, GLint texParam)
 
 	aiReleaseImport(scene);
 
-	u32 vertexBufferSize = 0;
-	u32 indexBufferSize = 0;
+	//Every submesh gets its own range in the shared geometry heap
+	GeometryHeap& heap = app->geometryHeap;
 
 	for (u32 i = 0; i < mesh.submeshes.size(); ++i)
 	{
-		vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-		indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
+		Submesh& submesh = mesh.submeshes[i];
+
+		const u32 verticesSize = submesh.vertices.size() * sizeof(float);
+		const u32 indicesSize = submesh.indices.size() * sizeof(u32);
+
+		submesh.vertexAllocation = AllocateVertices(heap, verticesSize, submesh.vertexBufferLayout.stride);
+		submesh.indexAllocation = AllocateIndices(heap, indicesSize);
+		submesh.vertexCount = verticesSize / submesh.vertexBufferLayout.stride;
+		submesh.indexCount = submesh.indices.size();
+		UpdateSubmeshRanges(heap, submesh);
+
+		//Goes through the staging ring, the copies to the heap are issued a few at a time every frame
+		u64 vertexTicket = StageUpload(app->stagingRing, &heap.vertices.buffer, submesh.vertexAllocation.offset, submesh.vertices.data(), verticesSize);
+		u64 indexTicket = StageUpload(app->stagingRing, &heap.indices.buffer, submesh.indexAllocation.offset, submesh.indices.data(), indicesSize);
+		submesh.uploadTicket = vertexTicket > indexTicket ? vertexTicket : indexTicket;
+
+		ComputeSubmeshBounds(submesh);
 	}
 
-	//VBO?
-	glGenBuffers(1, &mesh.vertexBufferHandle);
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-	glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+	ComputeMeshBounds(mesh);
 
-	//EBO?
-	glGenBuffers(1, &mesh.indexBufferHandle);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+	return true;
+}
 
-	u32 indicesOffset = 0;
-	u32 verticesOffset = 0;
+u32 LoadModel(App* app, const char* filename, GLint texParam)
+{
+	app->meshes.push_back(Mesh{});
+	app->models.push_back(Model{});
 
-	//This does not look like VAO, so it probably isn't
-	for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+	u32 modelIdx = (u32)app->models.size() - 1u;
+	app->models[modelIdx].meshIdx = (u32)app->meshes.size() - 1u;
+
+	if (!ImportModel(app, filename, texParam, modelIdx))
 	{
-		const void* verticesData = mesh.submeshes[i].vertices.data();
-		const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-		glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-		mesh.submeshes[i].vertexOffset = verticesOffset;
-		verticesOffset += verticesSize;
+		app->models.pop_back();
+		app->meshes.pop_back();
+		return UINT32_MAX;
+	}
+
+	return modelIdx;
+}
+
+void UnloadModel(App* app, u32 modelIdx)
+{
+	Model& model = app->models[modelIdx];
+	Mesh& mesh = app->meshes[model.meshIdx];
 
-		const void* indicesData = mesh.submeshes[i].indices.data();
-		const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-		mesh.submeshes[i].indexOffset = indicesOffset;
-		indicesOffset += indicesSize;
+	for (Submesh& submesh : mesh.submeshes)
+	{
+		//A copy still in the ring would land in space the heap may have given to another mesh
+		WaitForStagingTicket(app->stagingRing, submesh.uploadTicket);
+		FreeSubmeshGeometry(app->geometryHeap, submesh);
 	}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	mesh.submeshes.clear();
+	model.materialIdx.clear();
+}
 
-	return modelIdx;
+void ReloadModel(App* app, u32 modelIdx, const char* filename, GLint texParam)
+{
+	UnloadModel(app, modelIdx);
+	ImportModel(app, filename, texParam, modelIdx);
 }
\ No newline at end of file
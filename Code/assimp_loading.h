@@ -13,4 +13,10 @@ void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial,
 void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices);
 
 //Use GL_NEAREST as texParam to disable texture linear blending for low-res textures
-u32 LoadModel(App* app, const char* filename, GLint texParam = GL_LINEAR);
\ No newline at end of file
+u32 LoadModel(App* app, const char* filename, GLint texParam = GL_LINEAR);
+
+//Gives the model geometry back to the geometry heap, the model index stays valid but draws nothing
+void UnloadModel(App* app, u32 modelIdx);
+
+//Unloads the model and imports the file again in the same model index, the entities using it keep it
+void ReloadModel(App* app, u32 modelIdx, const char* filename, GLint texParam = GL_LINEAR);
\ No newline at end of file
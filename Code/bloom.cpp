@@ -0,0 +1,203 @@
+#include "bloom.h"
+#include "compute_blur.h"
+#include "gl_state.h"
+#include "resource_management.h"
+
+void InitBloom(App* app)
+{
+	Bloom& bloom = app->bloom;
+
+	bloom.downsampleProgramIdx = LoadProgram(app, "bloom_pass.glsl", "BLOOM_DOWNSAMPLE");
+	Program& downsampleProgram = app->programs[bloom.downsampleProgramIdx];
+
+	bloom.downsampleSourceLocation = glGetUniformLocation(downsampleProgram.handle, "uSource");
+	bloom.downsampleTexelSizeLocation = glGetUniformLocation(downsampleProgram.handle, "uTexelSize");
+	bloom.downsampleUvScaleLocation = glGetUniformLocation(downsampleProgram.handle, "uUvScale");
+	bloom.downsamplePrefilterLocation = glGetUniformLocation(downsampleProgram.handle, "uPrefilter");
+	bloom.downsampleThresholdLocation = glGetUniformLocation(downsampleProgram.handle, "uThreshold");
+
+	bloom.upsampleProgramIdx = LoadProgram(app, "bloom_pass.glsl", "BLOOM_UPSAMPLE");
+	Program& upsampleProgram = app->programs[bloom.upsampleProgramIdx];
+
+	bloom.upsampleSourceLocation = glGetUniformLocation(upsampleProgram.handle, "uSource");
+	bloom.upsampleTexelSizeLocation = glGetUniformLocation(upsampleProgram.handle, "uTexelSize");
+	bloom.upsampleUvScaleLocation = glGetUniformLocation(upsampleProgram.handle, "uUvScale");
+	bloom.upsampleRadiusLocation = glGetUniformLocation(upsampleProgram.handle, "uRadius");
+
+	glGenFramebuffers(BLOOM_MAX_LEVELS, bloom.framebuffers);
+
+	bloom.threshold = 1.0f;
+	bloom.softKnee = 0.5f;
+	bloom.intensity = 1.0f;
+	bloom.radius = 1.0f;
+	bloom.levelCount = 6;
+	bloom.computeBlur = false;
+	bloom.computeBlurSigma = 2.0f;
+}
+
+#pragma region Chain
+
+//Recreated when the render targets are resized, like the Hi-Z pyramid
+static void ResizeBloomChain(Bloom& bloom, ivec2 topSize)
+{
+	const ivec2 size = glm::max(topSize / 2, ivec2(1));
+	if (bloom.chainTexture != 0 && size == bloom.chainSize)
+		return;
+
+	if (bloom.chainTexture != 0)
+		StateDeleteTexture(bloom.chainTexture);
+
+	bloom.chainSize = size;
+	bloom.chainMipCount = 1;
+	while (bloom.chainMipCount < BLOOM_MAX_LEVELS - 1 && (1 << bloom.chainMipCount) <= glm::max(size.x, size.y))
+		bloom.chainMipCount++;
+
+	//Sampled one mip at a time through the base level, so the filter has no mipmaps
+	glGenTextures(1, &bloom.chainTexture);
+	StateBindTexture(GL_TEXTURE_2D, bloom.chainTexture);
+	glTexStorage2D(GL_TEXTURE_2D, bloom.chainMipCount, GL_R11F_G11F_B10F, size.x, size.y);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	for (u32 mip = 0; mip < bloom.chainMipCount; ++mip)
+	{
+		StateBindFramebuffer(GL_FRAMEBUFFER, bloom.framebuffers[mip + 1]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bloom.chainTexture, mip);
+		CheckFramebufferStatus("bloom chain");
+	}
+}
+
+//Texture size and drawn part of a level, level 0 is the render graph target
+static void GetBloomLevelSize(const App* app, u32 level, ivec2& size, ivec2& viewport)
+{
+	const ivec2 topViewport = GetRenderViewportSize(app, BLOOM_TARGET_SCALE);
+
+	if (level == 0)
+	{
+		size = GetRenderTargetSize(app, BLOOM_TARGET_SCALE);
+		viewport = topViewport;
+		return;
+	}
+
+	const ivec2& chainSize = app->bloom.chainSize;
+	size = glm::max(ivec2(chainSize.x >> (level - 1), chainSize.y >> (level - 1)), ivec2(1));
+	viewport = glm::max(ivec2(topViewport.x >> level, topViewport.y >> level), ivec2(1));
+}
+
+static void BindBloomTarget(App* app, u32 level)
+{
+	ivec2 size, viewport;
+	GetBloomLevelSize(app, level, size, viewport);
+
+	StateBindFramebuffer(GL_FRAMEBUFFER, app->bloom.framebuffers[level]);
+	StateViewport(0, 0, viewport.x, viewport.y);
+}
+
+//Binds a level to the unit 0, only its mip is visible so the next one can be drawn while it is sampled
+static void BindBloomSource(App* app, u32 level, GLint texelSizeLocation, GLint uvScaleLocation)
+{
+	Bloom& bloom = app->bloom;
+
+	ivec2 size, viewport;
+	GetBloomLevelSize(app, level, size, viewport);
+
+	StateActiveTexture(GL_TEXTURE0);
+	if (level == 0)
+	{
+		StateBindTexture(GL_TEXTURE_2D, app->bloomAttachmentHandle);
+	}
+	else
+	{
+		StateBindTexture(GL_TEXTURE_2D, bloom.chainTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+	}
+
+	vec2 texelSize = vec2(1.0f) / vec2(size);
+	vec2 uvScale = vec2(viewport) / vec2(size);
+	glUniform2fv(texelSizeLocation, 1, &texelSize[0]);
+	glUniform2fv(uvScaleLocation, 1, &uvScale[0]);
+}
+
+#pragma endregion
+
+#pragma region Pass
+
+void BloomPass(App* app)
+{
+	Bloom& bloom = app->bloom;
+
+	ResizeBloomChain(bloom, GetRenderTargetSize(app, BLOOM_TARGET_SCALE));
+
+	//The Bloom target comes from the pool, it is attached for the pass only
+	StateBindFramebuffer(GL_FRAMEBUFFER, bloom.framebuffers[0]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, app->bloomAttachmentHandle, 0);
+
+	const u32 levelCount = (u32)glm::clamp(bloom.levelCount, 1, (i32)bloom.chainMipCount + 1);
+	bloom.usedLevels = levelCount;
+
+	StateBindVertexArray(app->targetQuad_vao);
+
+	// Downsample, level 0 from the lit image with the threshold ------------------------------------------------------
+	Program& downsampleProgram = app->programs[bloom.downsampleProgramIdx];
+	StateUseProgram(downsampleProgram.handle);
+	glUniform1i(bloom.downsampleSourceLocation, 0);
+
+	//Quadratic curve from threshold - knee to threshold + knee, linear past it
+	f32 knee = glm::max(bloom.threshold * bloom.softKnee, 0.0001f);
+	glUniform4f(bloom.downsampleThresholdLocation, bloom.threshold, bloom.threshold - knee, 2.0f * knee, 0.25f / knee);
+
+	BindBloomTarget(app, 0);
+
+	vec2 litTexelSize = vec2(1.0f) / vec2(GetRenderTargetSize(app, 1.0f));
+	vec2 litUvScale = GetRenderTargetUvScale(app);
+	glUniform2fv(bloom.downsampleTexelSizeLocation, 1, &litTexelSize[0]);
+	glUniform2fv(bloom.downsampleUvScaleLocation, 1, &litUvScale[0]);
+	glUniform1i(bloom.downsamplePrefilterLocation, 1);
+
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->deferredAttachmentHandle);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+	glUniform1i(bloom.downsamplePrefilterLocation, 0);
+	for (u32 level = 1; level < levelCount; ++level)
+	{
+		BindBloomSource(app, level - 1, bloom.downsampleTexelSizeLocation, bloom.downsampleUvScaleLocation);
+		BindBloomTarget(app, level);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+	}
+
+	// Upsample, each level added to the one above it -----------------------------------------------------------------
+	Program& upsampleProgram = app->programs[bloom.upsampleProgramIdx];
+	StateUseProgram(upsampleProgram.handle);
+	glUniform1i(bloom.upsampleSourceLocation, 0);
+	glUniform1f(bloom.upsampleRadiusLocation, bloom.radius);
+
+	StateEnable(GL_BLEND);
+	StateBlendFunc(GL_ONE, GL_ONE);
+
+	for (u32 level = levelCount - 1; level > 0; --level)
+	{
+		BindBloomSource(app, level, bloom.upsampleTexelSizeLocation, bloom.upsampleUvScaleLocation);
+		BindBloomTarget(app, level - 1);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+	}
+
+	StateDisable(GL_BLEND);
+
+	//Detached so the pool can delete or recycle the texture
+	StateBindFramebuffer(GL_FRAMEBUFFER, bloom.framebuffers[0]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+
+	//In place, only the drawn part of the target
+	if (bloom.computeBlur)
+		ComputeGaussianBlur(app, app->bloomAttachmentHandle, app->bloomAttachmentHandle, GL_R11F_G11F_B10F, GetRenderViewportSize(app, BLOOM_TARGET_SCALE), bloom.computeBlurSigma);
+
+	//Everything is in level 0 now
+	for (u32 mip = 0; mip + 1 < levelCount; ++mip)
+		glInvalidateTexImage(bloom.chainTexture, mip);
+}
+
+#pragma endregion
\ No newline at end of file
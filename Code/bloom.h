@@ -0,0 +1,10 @@
+#pragma once
+
+#include "engine.h"
+
+//Loads the downsample and upsample programs, the chain itself is created by the first BloomPass
+void InitBloom(App* app);
+
+//Reads the lit colors and writes the bloom to the Bloom target, at BLOOM_TARGET_SCALE. The first downsample keeps
+//only what is past the threshold, the others halve the size down the chain and the upsamples add it all back up.
+void BloomPass(App* app);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "buffer_management.h"
+#include "gl_state.h"
 
 bool IsPowerOf2(u32 value)
 {
@@ -16,22 +17,26 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
 	buffer.size = size;
 	buffer.type = type;
 
+	//Binding an index buffer would attach it to whatever vao is bound
+	if (type == GL_ELEMENT_ARRAY_BUFFER)
+		StateBindVertexArray(0);
+
 	glGenBuffers(1, &buffer.handle);
-	glBindBuffer(type, buffer.handle);
+	StateBindBuffer(type, buffer.handle);
 	glBufferData(type, buffer.size, NULL, usage);
-	glBindBuffer(type, 0);
+	StateBindBuffer(type, 0);
 
 	return buffer;
 }
 
 void BindBuffer(const Buffer& buffer)
 {
-	glBindBuffer(buffer.type, buffer.handle);
+	StateBindBuffer(buffer.type, buffer.handle);
 }
 
 void MapBuffer(Buffer& buffer, GLenum access)
 {
-	glBindBuffer(buffer.type, buffer.handle);
+	StateBindBuffer(buffer.type, buffer.handle);
 	buffer.data = (u8*)glMapBuffer(buffer.type, access);
 	buffer.head = 0;
 }
@@ -39,7 +44,7 @@ void MapBuffer(Buffer& buffer, GLenum access)
 void UnmapBuffer(Buffer& buffer)
 {
 	glUnmapBuffer(buffer.type);
-	glBindBuffer(buffer.type, 0);
+	StateBindBuffer(buffer.type, 0);
 }
 
 void AlignHead(Buffer& buffer, u32 alignment)
@@ -0,0 +1,671 @@
+#include "bvh.h"
+#include <chrono>
+
+#pragma region Box helpers
+
+static f32 SurfaceArea(const vec3& boundsMin, const vec3& boundsMax)
+{
+	vec3 size = boundsMax - boundsMin;
+	return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static bool Contains(const BvhNode& node, const vec3& boundsMin, const vec3& boundsMax)
+{
+	return glm::all(glm::lessThanEqual(node.boundsMin, boundsMin)) && glm::all(glm::greaterThanEqual(node.boundsMax, boundsMax));
+}
+
+static bool Overlaps(const BvhNode& node, const vec3& boundsMin, const vec3& boundsMax)
+{
+	return glm::all(glm::lessThanEqual(node.boundsMin, boundsMax)) && glm::all(glm::greaterThanEqual(node.boundsMax, boundsMin));
+}
+
+static void Refit(Bvh& bvh, u32 index)
+{
+	BvhNode& node = bvh.nodes[index];
+	const BvhNode& left = bvh.nodes[node.left];
+	const BvhNode& right = bvh.nodes[node.right];
+
+	node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+	node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+	node.height = 1 + glm::max(left.height, right.height);
+}
+
+#pragma endregion
+
+#pragma region Nodes
+
+static u32 AllocateNode(Bvh& bvh)
+{
+	if (bvh.freeList == BVH_NULL_NODE)
+	{
+		bvh.nodes.push_back(BvhNode{});
+		bvh.nodes.back().height = -1;
+		bvh.freeList = (u32)bvh.nodes.size() - 1;
+		bvh.nodes.back().parent = BVH_NULL_NODE;
+	}
+
+	u32 index = bvh.freeList;
+	BvhNode& node = bvh.nodes[index];
+	bvh.freeList = node.parent;
+
+	node.parent = BVH_NULL_NODE;
+	node.left = BVH_NULL_NODE;
+	node.right = BVH_NULL_NODE;
+	node.height = 0;
+	node.entityIdx = BVH_NULL_NODE;
+	return index;
+}
+
+static void FreeNode(Bvh& bvh, u32 index)
+{
+	bvh.nodes[index].parent = bvh.freeList;
+	bvh.nodes[index].height = -1;
+	bvh.freeList = index;
+}
+
+static bool IsLeaf(const BvhNode& node)
+{
+	return node.left == BVH_NULL_NODE;
+}
+
+//Swaps a grandchild with the shorter child when the subtree heights differ by more than one, returns the new root of the subtree
+static u32 Balance(Bvh& bvh, u32 indexA)
+{
+	BvhNode& a = bvh.nodes[indexA];
+	if (IsLeaf(a) || a.height < 2)
+		return indexA;
+
+	u32 indexB = a.left;
+	u32 indexC = a.right;
+	BvhNode& b = bvh.nodes[indexB];
+	BvhNode& c = bvh.nodes[indexC];
+
+	i32 balance = c.height - b.height;
+
+	//Rotate C up
+	if (balance > 1)
+	{
+		u32 indexF = c.left;
+		u32 indexG = c.right;
+		BvhNode& f = bvh.nodes[indexF];
+		BvhNode& g = bvh.nodes[indexG];
+
+		c.left = indexA;
+		c.parent = a.parent;
+		a.parent = indexC;
+
+		if (c.parent == BVH_NULL_NODE)
+			bvh.root = indexC;
+		else if (bvh.nodes[c.parent].left == indexA)
+			bvh.nodes[c.parent].left = indexC;
+		else
+			bvh.nodes[c.parent].right = indexC;
+
+		if (f.height > g.height)
+		{
+			c.right = indexF;
+			a.right = indexG;
+			g.parent = indexA;
+		}
+		else
+		{
+			c.right = indexG;
+			a.right = indexF;
+			f.parent = indexA;
+		}
+
+		Refit(bvh, indexA);
+		Refit(bvh, indexC);
+		return indexC;
+	}
+
+	//Rotate B up
+	if (balance < -1)
+	{
+		u32 indexD = b.left;
+		u32 indexE = b.right;
+		BvhNode& d = bvh.nodes[indexD];
+		BvhNode& e = bvh.nodes[indexE];
+
+		b.left = indexA;
+		b.parent = a.parent;
+		a.parent = indexB;
+
+		if (b.parent == BVH_NULL_NODE)
+			bvh.root = indexB;
+		else if (bvh.nodes[b.parent].left == indexA)
+			bvh.nodes[b.parent].left = indexB;
+		else
+			bvh.nodes[b.parent].right = indexB;
+
+		if (d.height > e.height)
+		{
+			b.right = indexD;
+			a.left = indexE;
+			e.parent = indexA;
+		}
+		else
+		{
+			b.right = indexE;
+			a.left = indexD;
+			d.parent = indexA;
+		}
+
+		Refit(bvh, indexA);
+		Refit(bvh, indexB);
+		return indexB;
+	}
+
+	return indexA;
+}
+
+static void RefitAncestors(Bvh& bvh, u32 index)
+{
+	while (index != BVH_NULL_NODE)
+	{
+		index = Balance(bvh, index);
+		Refit(bvh, index);
+		index = bvh.nodes[index].parent;
+	}
+}
+
+static void InsertLeaf(Bvh& bvh, u32 leaf)
+{
+	if (bvh.root == BVH_NULL_NODE)
+	{
+		bvh.root = leaf;
+		bvh.nodes[leaf].parent = BVH_NULL_NODE;
+		return;
+	}
+
+	const vec3 leafMin = bvh.nodes[leaf].boundsMin;
+	const vec3 leafMax = bvh.nodes[leaf].boundsMax;
+
+	//Walk down to the sibling with the lowest surface area cost
+	u32 index = bvh.root;
+	while (!IsLeaf(bvh.nodes[index]))
+	{
+		const BvhNode& node = bvh.nodes[index];
+
+		f32 area = SurfaceArea(node.boundsMin, node.boundsMax);
+		f32 combinedArea = SurfaceArea(glm::min(node.boundsMin, leafMin), glm::max(node.boundsMax, leafMax));
+
+		//Cost of making a new parent for this node and the leaf, and the cost pushed down to the children
+		f32 cost = 2.0f * combinedArea;
+		f32 inheritanceCost = 2.0f * (combinedArea - area);
+
+		f32 childCost[2];
+		u32 children[2] = { node.left, node.right };
+		for (u32 i = 0; i < 2; ++i)
+		{
+			const BvhNode& child = bvh.nodes[children[i]];
+			f32 enlargedArea = SurfaceArea(glm::min(child.boundsMin, leafMin), glm::max(child.boundsMax, leafMax));
+			childCost[i] = (IsLeaf(child) ? enlargedArea : enlargedArea - SurfaceArea(child.boundsMin, child.boundsMax)) + inheritanceCost;
+		}
+
+		if (cost < childCost[0] && cost < childCost[1])
+			break;
+
+		index = childCost[0] < childCost[1] ? children[0] : children[1];
+	}
+
+	const u32 sibling = index;
+	const u32 oldParent = bvh.nodes[sibling].parent;
+	const u32 newParent = AllocateNode(bvh);
+
+	bvh.nodes[newParent].parent = oldParent;
+	bvh.nodes[newParent].left = sibling;
+	bvh.nodes[newParent].right = leaf;
+	bvh.nodes[sibling].parent = newParent;
+	bvh.nodes[leaf].parent = newParent;
+
+	if (oldParent == BVH_NULL_NODE)
+		bvh.root = newParent;
+	else if (bvh.nodes[oldParent].left == sibling)
+		bvh.nodes[oldParent].left = newParent;
+	else
+		bvh.nodes[oldParent].right = newParent;
+
+	RefitAncestors(bvh, newParent);
+}
+
+static void RemoveLeaf(Bvh& bvh, u32 leaf)
+{
+	if (leaf == bvh.root)
+	{
+		bvh.root = BVH_NULL_NODE;
+		return;
+	}
+
+	const u32 parent = bvh.nodes[leaf].parent;
+	const u32 grandParent = bvh.nodes[parent].parent;
+	const u32 sibling = bvh.nodes[parent].left == leaf ? bvh.nodes[parent].right : bvh.nodes[parent].left;
+
+	//The sibling takes the place of the parent
+	bvh.nodes[sibling].parent = grandParent;
+
+	if (grandParent == BVH_NULL_NODE)
+	{
+		bvh.root = sibling;
+	}
+	else
+	{
+		if (bvh.nodes[grandParent].left == parent)
+			bvh.nodes[grandParent].left = sibling;
+		else
+			bvh.nodes[grandParent].right = sibling;
+
+		RefitAncestors(bvh, grandParent);
+	}
+
+	FreeNode(bvh, parent);
+}
+
+#pragma endregion
+
+#pragma region Tree
+
+void InitBvh(Bvh& bvh, f32 margin)
+{
+	bvh.nodes.clear();
+	bvh.root = BVH_NULL_NODE;
+	bvh.freeList = BVH_NULL_NODE;
+	bvh.leafCount = 0;
+	bvh.margin = margin;
+}
+
+u32 BvhInsert(Bvh& bvh, const vec3& boundsMin, const vec3& boundsMax, u32 entityIdx)
+{
+	u32 leaf = AllocateNode(bvh);
+	bvh.nodes[leaf].boundsMin = boundsMin - vec3(bvh.margin);
+	bvh.nodes[leaf].boundsMax = boundsMax + vec3(bvh.margin);
+	bvh.nodes[leaf].entityIdx = entityIdx;
+
+	InsertLeaf(bvh, leaf);
+	bvh.leafCount++;
+
+	return leaf;
+}
+
+void BvhRemove(Bvh& bvh, u32 leaf)
+{
+	ASSERT(IsLeaf(bvh.nodes[leaf]) && bvh.nodes[leaf].height == 0, "Only leaves can be removed");
+
+	RemoveLeaf(bvh, leaf);
+	FreeNode(bvh, leaf);
+	bvh.leafCount--;
+}
+
+bool BvhMove(Bvh& bvh, u32 leaf, const vec3& boundsMin, const vec3& boundsMax)
+{
+	if (Contains(bvh.nodes[leaf], boundsMin, boundsMax))
+		return false;
+
+	//Incremental reinsertion, the leaf keeps its index
+	RemoveLeaf(bvh, leaf);
+	bvh.nodes[leaf].boundsMin = boundsMin - vec3(bvh.margin);
+	bvh.nodes[leaf].boundsMax = boundsMax + vec3(bvh.margin);
+	InsertLeaf(bvh, leaf);
+
+	return true;
+}
+
+u32 GetBvhHeight(const Bvh& bvh)
+{
+	return bvh.root == BVH_NULL_NODE ? 0 : (u32)bvh.nodes[bvh.root].height;
+}
+
+#pragma endregion
+
+#pragma region Queries
+
+//Adds every leaf below index without testing them
+static void CollectLeaves(Bvh& bvh, u32 index, std::vector<u32>& result)
+{
+	const size_t stackBase = bvh.stack.size();
+	bvh.stack.push_back(index);
+
+	while (bvh.stack.size() > stackBase)
+	{
+		const BvhNode& node = bvh.nodes[bvh.stack.back()];
+		bvh.stack.pop_back();
+
+		if (IsLeaf(node))
+		{
+			result.push_back(node.entityIdx);
+		}
+		else
+		{
+			bvh.stack.push_back(node.left);
+			bvh.stack.push_back(node.right);
+		}
+	}
+}
+
+void BvhQueryFrustum(Bvh& bvh, const vec4 planes[6], std::vector<u32>& result)
+{
+	if (bvh.root == BVH_NULL_NODE)
+		return;
+
+	bvh.stack.clear();
+	bvh.stack.push_back(bvh.root);
+
+	while (!bvh.stack.empty())
+	{
+		const u32 index = bvh.stack.back();
+		bvh.stack.pop_back();
+		const BvhNode& node = bvh.nodes[index];
+
+		const vec3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+		const vec3 extents = (node.boundsMax - node.boundsMin) * 0.5f;
+
+		bool outside = false;
+		bool fullyInside = true;
+		for (u32 p = 0; p < 6; ++p)
+		{
+			const vec3 normal = vec3(planes[p]);
+			const f32 distance = glm::dot(normal, center) + planes[p].w;
+			const f32 radius = glm::dot(glm::abs(normal), extents);
+
+			if (distance + radius < 0.0f)
+			{
+				outside = true;
+				break;
+			}
+
+			if (distance - radius < 0.0f)
+				fullyInside = false;
+		}
+
+		if (outside)
+			continue;
+
+		//Nothing below can be outside, skip the plane tests for the whole subtree
+		if (fullyInside || IsLeaf(node))
+		{
+			CollectLeaves(bvh, index, result);
+			continue;
+		}
+
+		bvh.stack.push_back(node.left);
+		bvh.stack.push_back(node.right);
+	}
+}
+
+void BvhQuerySphere(Bvh& bvh, const vec3& center, f32 radius, std::vector<u32>& result)
+{
+	if (bvh.root == BVH_NULL_NODE)
+		return;
+
+	const f32 radiusSquared = radius * radius;
+
+	bvh.stack.clear();
+	bvh.stack.push_back(bvh.root);
+
+	while (!bvh.stack.empty())
+	{
+		const BvhNode& node = bvh.nodes[bvh.stack.back()];
+		bvh.stack.pop_back();
+
+		//Distance from the center to the closest point of the box
+		const vec3 closest = glm::clamp(center, node.boundsMin, node.boundsMax);
+		const vec3 offset = closest - center;
+		if (glm::dot(offset, offset) > radiusSquared)
+			continue;
+
+		if (IsLeaf(node))
+		{
+			result.push_back(node.entityIdx);
+		}
+		else
+		{
+			bvh.stack.push_back(node.left);
+			bvh.stack.push_back(node.right);
+		}
+	}
+}
+
+void BvhQueryRay(Bvh& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, std::vector<u32>& result)
+{
+	if (bvh.root == BVH_NULL_NODE)
+		return;
+
+	//Divisions by 0 give infinities, which the slab test handles
+	const vec3 inverseDirection = 1.0f / direction;
+
+	bvh.stack.clear();
+	bvh.stack.push_back(bvh.root);
+
+	while (!bvh.stack.empty())
+	{
+		const BvhNode& node = bvh.nodes[bvh.stack.back()];
+		bvh.stack.pop_back();
+
+		const vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+		const vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+		const vec3 tNear = glm::min(t0, t1);
+		const vec3 tFar = glm::max(t0, t1);
+
+		const f32 enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+		const f32 exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+		if (enter > exit)
+			continue;
+
+		if (IsLeaf(node))
+		{
+			result.push_back(node.entityIdx);
+		}
+		else
+		{
+			bvh.stack.push_back(node.left);
+			bvh.stack.push_back(node.right);
+		}
+	}
+}
+
+#pragma endregion
+
+#pragma region Scene
+
+void GetEntityBounds(App* app, const Entity& entity, vec3& boundsMin, vec3& boundsMax)
+{
+	const Mesh& mesh = app->meshes[app->models[entity.model].meshIdx];
+	const mat4& world = entity.transformationMatrix;
+
+	const vec3 center = vec3(world * vec4((mesh.boundsMin + mesh.boundsMax) * 0.5f, 1.0f));
+	const vec3 localExtents = (mesh.boundsMax - mesh.boundsMin) * 0.5f;
+	const vec3 extents = glm::mat3(glm::abs(vec3(world[0])), glm::abs(vec3(world[1])), glm::abs(vec3(world[2]))) * localExtents;
+
+	boundsMin = center - extents;
+	boundsMax = center + extents;
+}
+
+void UpdateSceneBvh(App* app)
+{
+	const u32 entityCount = (u32)app->entityList.size();
+
+	//Entities removed from the end of the list
+	for (u32 i = entityCount; i < (u32)app->entityBvhLeaves.size(); ++i)
+	{
+		if (app->entityBvhLeaves[i] != BVH_NULL_NODE)
+			BvhRemove(app->sceneBvh, app->entityBvhLeaves[i]);
+	}
+	app->entityBvhLeaves.resize(entityCount, BVH_NULL_NODE);
+
+	for (u32 i = 0; i < entityCount; ++i)
+	{
+		vec3 boundsMin, boundsMax;
+		GetEntityBounds(app, app->entityList[i], boundsMin, boundsMax);
+
+		u32& leaf = app->entityBvhLeaves[i];
+		if (leaf == BVH_NULL_NODE)
+			leaf = BvhInsert(app->sceneBvh, boundsMin, boundsMax, i);
+		else
+			BvhMove(app->sceneBvh, leaf, boundsMin, boundsMax);
+	}
+}
+
+#pragma endregion
+
+#pragma region Benchmark
+
+static vec3 RandomPosition(f32 extent)
+{
+	return vec3((rand() / (f32)RAND_MAX - 0.5f) * extent, (rand() / (f32)RAND_MAX) * 20.0f, (rand() / (f32)RAND_MAX - 0.5f) * extent);
+}
+
+void RunBvhBenchmark(BvhBenchmark& benchmark, const vec4 planes[6])
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const u32 scales[BVH_BENCHMARK_SCALES] = { 1000, 10000, 100000 };
+	const u32 queryCount = 100;
+
+	srand(1234);
+
+	for (u32 scale = 0; scale < BVH_BENCHMARK_SCALES; ++scale)
+	{
+		const u32 count = scales[scale];
+
+		//Same density at every scale, the world grows with the entity count
+		const f32 extent = sqrtf((f32)count) * 4.0f;
+
+		std::vector<vec3> boundsMin(count), boundsMax(count);
+		for (u32 i = 0; i < count; ++i)
+		{
+			vec3 position = RandomPosition(extent);
+			boundsMin[i] = position - vec3(0.5f);
+			boundsMax[i] = position + vec3(0.5f);
+		}
+
+		Bvh bvh = {};
+		InitBvh(bvh, 0.2f);
+		std::vector<u32> leaves(count);
+
+		// Build and update ---------------------------------------------------------------------------------------------
+		Clock::time_point start = Clock::now();
+		for (u32 i = 0; i < count; ++i)
+		{
+			leaves[i] = BvhInsert(bvh, boundsMin[i], boundsMax[i], i);
+		}
+		benchmark.buildMs[scale] = std::chrono::duration<f32, std::milli>(Clock::now() - start).count();
+
+		start = Clock::now();
+		for (u32 i = 0; i < count; i += 10)
+		{
+			vec3 offset = vec3(1.0f, 0.0f, 0.5f);
+			boundsMin[i] += offset;
+			boundsMax[i] += offset;
+			BvhMove(bvh, leaves[i], boundsMin[i], boundsMax[i]);
+		}
+		benchmark.updateMs[scale] = std::chrono::duration<f32, std::milli>(Clock::now() - start).count();
+		benchmark.treeHeight[scale] = GetBvhHeight(bvh);
+
+		// Queries ------------------------------------------------------------------------------------------------------
+		std::vector<u32> result;
+		result.reserve(count);
+		size_t checksum = 0;
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			BvhQueryFrustum(bvh, planes, result);
+			checksum += result.size();
+		}
+		benchmark.frustumUs[scale][0] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			for (u32 i = 0; i < count; ++i)
+			{
+				const vec3 center = (boundsMin[i] + boundsMax[i]) * 0.5f;
+				const vec3 extents = (boundsMax[i] - boundsMin[i]) * 0.5f;
+
+				bool inside = true;
+				for (u32 p = 0; p < 6 && inside; ++p)
+					inside = glm::dot(vec3(planes[p]), center) + planes[p].w + glm::dot(glm::abs(vec3(planes[p])), extents) >= 0.0f;
+
+				if (inside)
+					result.push_back(i);
+			}
+			checksum += result.size();
+		}
+		benchmark.frustumUs[scale][1] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		std::vector<vec3> sphereCenters(queryCount);
+		std::vector<vec3> rayDirections(queryCount);
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			sphereCenters[q] = RandomPosition(extent);
+			rayDirections[q] = glm::normalize(RandomPosition(2.0f) - vec3(0.0f, 10.0f, 0.0f));
+		}
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			BvhQuerySphere(bvh, sphereCenters[q], 5.0f, result);
+			checksum += result.size();
+		}
+		benchmark.sphereUs[scale][0] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			for (u32 i = 0; i < count; ++i)
+			{
+				const vec3 offset = glm::clamp(sphereCenters[q], boundsMin[i], boundsMax[i]) - sphereCenters[q];
+				if (glm::dot(offset, offset) <= 25.0f)
+					result.push_back(i);
+			}
+			checksum += result.size();
+		}
+		benchmark.sphereUs[scale][1] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		const vec3 rayOrigin = vec3(0.0f, 10.0f, 0.0f);
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			BvhQueryRay(bvh, rayOrigin, rayDirections[q], extent, result);
+			checksum += result.size();
+		}
+		benchmark.rayUs[scale][0] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		start = Clock::now();
+		for (u32 q = 0; q < queryCount; ++q)
+		{
+			result.clear();
+			const vec3 inverseDirection = 1.0f / rayDirections[q];
+			for (u32 i = 0; i < count; ++i)
+			{
+				const vec3 t0 = (boundsMin[i] - rayOrigin) * inverseDirection;
+				const vec3 t1 = (boundsMax[i] - rayOrigin) * inverseDirection;
+				const vec3 tNear = glm::min(t0, t1);
+				const vec3 tFar = glm::max(t0, t1);
+
+				const f32 enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+				const f32 exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, extent));
+				if (enter <= exit)
+					result.push_back(i);
+			}
+			checksum += result.size();
+		}
+		benchmark.rayUs[scale][1] = std::chrono::duration<f32, std::micro>(Clock::now() - start).count() / queryCount;
+
+		benchmark.entityCount[scale] = count;
+
+		//Keep the results alive so the compiler can't drop the queries
+		if (checksum == 0)
+			ELOG("BVH benchmark found nothing");
+	}
+
+	benchmark.hasResults = true;
+}
+
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "engine.h"
+
+// Tree -----------------------------------------------------------------------------------------------------------------
+
+void InitBvh(Bvh& bvh, f32 margin);
+
+u32 BvhInsert(Bvh& bvh, const vec3& boundsMin, const vec3& boundsMax, u32 entityIdx);
+void BvhRemove(Bvh& bvh, u32 leaf);
+
+//Reinserts the leaf only if the new box left its fattened box, returns true if it did
+bool BvhMove(Bvh& bvh, u32 leaf, const vec3& boundsMin, const vec3& boundsMax);
+
+u32 GetBvhHeight(const Bvh& bvh);
+
+// Queries, they append the entity of every leaf found to result -------------------------------------------------------
+
+void BvhQueryFrustum(Bvh& bvh, const vec4 planes[6], std::vector<u32>& result);
+void BvhQuerySphere(Bvh& bvh, const vec3& center, f32 radius, std::vector<u32>& result);
+void BvhQueryRay(Bvh& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, std::vector<u32>& result);
+
+// Scene ----------------------------------------------------------------------------------------------------------------
+
+//World box of the entity from the bounds of its mesh
+void GetEntityBounds(App* app, const Entity& entity, vec3& boundsMin, vec3& boundsMax);
+
+//Inserts new entities and moves the ones whose transform changed
+void UpdateSceneBvh(App* app);
+
+//Builds scenes of growing size and times the tree against linear scans
+void RunBvhBenchmark(BvhBenchmark& benchmark, const vec4 planes[6]);
\ No newline at end of file
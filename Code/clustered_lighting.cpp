@@ -0,0 +1,198 @@
+#include "clustered_lighting.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+#include "resource_management.h"
+
+#define LIGHT_CLUSTER_GROUP_SIZE 64
+
+//Half the size of the floor plane, the stress lights are spread over all of it
+#define STRESS_LIGHT_EXTENT 12.5f
+
+static f32 RandomUnit()
+{
+	return rand() / (f32)RAND_MAX;
+}
+
+void InitClusteredLighting(App* app)
+{
+	ClusteredLighting& clustered = app->clusteredLighting;
+
+	clustered.buildProgramIdx = LoadComputeProgram(app, "clustered_lighting.glsl", "BUILD_LIGHT_CLUSTERS");
+	Program& buildProgram = app->programs[clustered.buildProgramIdx];
+
+	clustered.buildViewLocation = glGetUniformLocation(buildProgram.handle, "uView");
+	clustered.buildInverseProjectionLocation = glGetUniformLocation(buildProgram.handle, "uInverseProjection");
+	clustered.buildDepthRangeLocation = glGetUniformLocation(buildProgram.handle, "uDepthRange");
+	clustered.buildGridLocation = glGetUniformLocation(buildProgram.handle, "uClusterGrid");
+	clustered.buildMaxLightsLocation = glGetUniformLocation(buildProgram.handle, "uClusterMaxLights");
+
+	clustered.shadingProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "CLUSTERED_LIGHTING_PASS");
+	Program& shadingProgram = app->programs[clustered.shadingProgramIdx];
+
+	clustered.shadingDepthTextureLocation = glGetUniformLocation(shadingProgram.handle, "depthTexture");
+	clustered.shadingNormalTextureLocation = glGetUniformLocation(shadingProgram.handle, "normalTexture");
+	clustered.shadingAlbedoTextureLocation = glGetUniformLocation(shadingProgram.handle, "albedoTexture");
+	clustered.shadingInverseViewProjectionLocation = glGetUniformLocation(shadingProgram.handle, "uInverseViewProjection");
+	clustered.shadingViewLocation = glGetUniformLocation(shadingProgram.handle, "uView");
+	clustered.shadingUvScaleLocation = glGetUniformLocation(shadingProgram.handle, "uUvScale");
+	clustered.shadingDepthRangeLocation = glGetUniformLocation(shadingProgram.handle, "uDepthRange");
+	clustered.shadingGridLocation = glGetUniformLocation(shadingProgram.handle, "uClusterGrid");
+	clustered.shadingMaxLightsLocation = glGetUniformLocation(shadingProgram.handle, "uClusterMaxLights");
+
+	//Only ever touched by the GPU
+	clustered.clustersBuffer = CreateBuffer(LIGHT_CLUSTER_COUNT * (1 + LIGHT_CLUSTER_MAX_LIGHTS) * sizeof(u32), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+
+	glGenQueries(LIGHTING_TIMER_FRAMES, clustered.timerQueries);
+}
+
+void UpdateStressLights(App* app)
+{
+	ClusteredLighting& clustered = app->clusteredLighting;
+
+	const u32 requested = (u32)glm::max(clustered.stressLightCount, 0);
+	if (requested == clustered.spawnedStressLights)
+		return;
+
+	app->lightList.resize(app->sceneLightCount);
+
+	//Same density whatever the count, each point of the floor ends up in a few tens of lights
+	const f32 spacing = 2.0f * STRESS_LIGHT_EXTENT / sqrtf((f32)glm::max(requested, 1u));
+	const f32 radius = glm::clamp(2.5f * spacing, 0.5f, 4.0f);
+
+	//Same lights for the same count, so the timings can be compared
+	srand(4321);
+	for (u32 i = 0; i < requested; ++i)
+	{
+		Light light = {};
+		light.type = LightType_Point;
+		light.strength = 1;
+		light.color = vec3(RandomUnit(), RandomUnit(), RandomUnit()) * 0.5f;
+		light.position = vec3((RandomUnit() * 2.0f - 1.0f) * STRESS_LIGHT_EXTENT, 0.1f + RandomUnit() * 2.0f, (RandomUnit() * 2.0f - 1.0f) * STRESS_LIGHT_EXTENT);
+		light.radius = radius * (0.75f + 0.5f * RandomUnit());
+
+		app->lightList.push_back(light);
+	}
+
+	clustered.spawnedStressLights = requested;
+
+	if (app->selectedLightsIndex >= (int)app->lightList.size())
+	{
+		app->selectedObjType = false;
+		app->selectedEntityIndex = 0;
+		app->selectedLightsIndex = -1;
+	}
+}
+
+#pragma region Timers
+
+//Results of the last frame that used the query of this frame, kept as they are until the GPU is done with it
+static void ReadLightingTimer(ClusteredLighting& clustered)
+{
+	const u32 frame = clustered.timerFrame;
+	if (!clustered.timerIssued[frame])
+		return;
+
+	GLint available = 0;
+	glGetQueryObjectiv(clustered.timerQueries[frame], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint64 lightingNs = 0;
+	glGetQueryObjectui64v(clustered.timerQueries[frame], GL_QUERY_RESULT, &lightingNs);
+	clustered.timerIssued[frame] = false;
+
+	f32& lightingMs = clustered.lightingMs[clustered.timerMode[frame]];
+	f32 frameMs = lightingNs / 1000000.0f;
+	lightingMs = lightingMs > 0.0f ? glm::mix(lightingMs, frameMs, 0.05f) : frameMs;
+}
+
+void BeginLightingTimer(App* app)
+{
+	ClusteredLighting& clustered = app->clusteredLighting;
+	ReadLightingTimer(clustered);
+
+	glBeginQuery(GL_TIME_ELAPSED, clustered.timerQueries[clustered.timerFrame]);
+}
+
+void EndLightingTimer(App* app)
+{
+	ClusteredLighting& clustered = app->clusteredLighting;
+	glEndQuery(GL_TIME_ELAPSED);
+
+	clustered.timerIssued[clustered.timerFrame] = true;
+	clustered.timerMode[clustered.timerFrame] = app->lightingMode;
+	clustered.timerFrame = (clustered.timerFrame + 1) % LIGHTING_TIMER_FRAMES;
+}
+
+#pragma endregion
+
+#pragma region Clustered pass
+
+void ClusteredLightingPass(App* app)
+{
+	ClusteredLighting& clustered = app->clusteredLighting;
+	const Camera& cam = app->camera;
+
+	BeginLightingTimer(app);
+
+	//The view projection is projection * inverse(camera), so the camera transformation gives the projection back
+	mat4 view = glm::inverse(cam.transformation);
+	mat4 inverseProjection = glm::inverse(app->viewProjection * cam.transformation);
+	mat4 inverseViewProjection = glm::inverse(app->viewProjection);
+	vec2 depthRange = vec2(cam.znear, cam.zfar);
+
+	// Bin the point lights, one invocation per cluster ---------------------------------------------------------------
+	Program& buildProgram = app->programs[clustered.buildProgramIdx];
+	StateUseProgram(buildProgram.handle);
+
+	glUniformMatrix4fv(clustered.buildViewLocation, 1, GL_FALSE, &view[0][0]);
+	glUniformMatrix4fv(clustered.buildInverseProjectionLocation, 1, GL_FALSE, &inverseProjection[0][0]);
+	glUniform2fv(clustered.buildDepthRangeLocation, 1, &depthRange[0]);
+	glUniform3ui(clustered.buildGridLocation, LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y, LIGHT_CLUSTER_GRID_Z);
+	glUniform1ui(clustered.buildMaxLightsLocation, LIGHT_CLUSTER_MAX_LIGHTS);
+
+	//The lights themselves are already bound by UploadLights
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, clustered.clustersBuffer.handle);
+
+	glDispatchCompute((LIGHT_CLUSTER_COUNT + LIGHT_CLUSTER_GROUP_SIZE - 1) / LIGHT_CLUSTER_GROUP_SIZE, 1, 1);
+
+	//The fragment shader reads the light lists
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Shade, same targets as the full screen pass ---------------------------------------------------------------------
+	ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+	StateViewport(0, 0, viewportSize.x, viewportSize.y);
+
+	Program& shadingProgram = app->programs[clustered.shadingProgramIdx];
+	StateUseProgram(shadingProgram.handle);
+	StateBindVertexArray(app->targetQuad_vao);
+
+	StateBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize);
+
+	glUniformMatrix4fv(clustered.shadingInverseViewProjectionLocation, 1, GL_FALSE, &inverseViewProjection[0][0]);
+	glUniformMatrix4fv(clustered.shadingViewLocation, 1, GL_FALSE, &view[0][0]);
+	glUniform2fv(clustered.shadingDepthRangeLocation, 1, &depthRange[0]);
+	glUniform3ui(clustered.shadingGridLocation, LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y, LIGHT_CLUSTER_GRID_Z);
+	glUniform1ui(clustered.shadingMaxLightsLocation, LIGHT_CLUSTER_MAX_LIGHTS);
+
+	vec2 uvScale = GetRenderTargetUvScale(app);
+	glUniform2fv(clustered.shadingUvScaleLocation, 1, &uvScale[0]);
+
+	glUniform1i(clustered.shadingDepthTextureLocation, 0);
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+
+	glUniform1i(clustered.shadingNormalTextureLocation, 1);
+	StateActiveTexture(GL_TEXTURE1);
+	StateBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+
+	glUniform1i(clustered.shadingAlbedoTextureLocation, 2);
+	StateActiveTexture(GL_TEXTURE2);
+	StateBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+	EndLightingTimer(app);
+}
+
+#pragma endregion
\ No newline at end of file
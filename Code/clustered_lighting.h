@@ -0,0 +1,17 @@
+#pragma once
+
+#include "engine.h"
+
+//Loads the light binning compute shader and the clustered shading program, creates the cluster buffer
+void InitClusteredLighting(App* app);
+
+//Adds or removes random point lights until the scene has the requested amount of stress lights
+void UpdateStressLights(App* app);
+
+//Bins the point lights of the lights buffer in the clusters of the current view and shades the G-buffer,
+//reading only the lights of the cluster of each pixel. Same inputs and outputs as DeferredLightingPass.
+void ClusteredLightingPass(App* app);
+
+//GPU time of the lighting pass, whichever mode draws it
+void BeginLightingTimer(App* app);
+void EndLightingTimer(App* app);
\ No newline at end of file
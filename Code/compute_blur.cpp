@@ -0,0 +1,92 @@
+#include "compute_blur.h"
+#include "gl_state.h"
+#include "render_target_pool.h"
+#include "resource_management.h"
+
+static void LoadComputeBlurProgram(App* app, ComputeBlurProgram& blurProgram, const char* programName)
+{
+	blurProgram.programIdx = LoadComputeProgram(app, "compute_blur.glsl", programName);
+	Program& program = app->programs[blurProgram.programIdx];
+
+	blurProgram.sourceLocation = glGetUniformLocation(program.handle, "uSource");
+	blurProgram.directionLocation = glGetUniformLocation(program.handle, "uDirection");
+	blurProgram.sizeLocation = glGetUniformLocation(program.handle, "uSize");
+	blurProgram.radiusLocation = glGetUniformLocation(program.handle, "uRadius");
+	blurProgram.weightsLocation = glGetUniformLocation(program.handle, "uWeights");
+}
+
+void InitComputeBlur(App* app)
+{
+	ComputeBlur& blur = app->computeBlur;
+
+	LoadComputeBlurProgram(app, blur.colorProgram, "SEPARABLE_BLUR_COLOR");
+	LoadComputeBlurProgram(app, blur.redProgram, "SEPARABLE_BLUR_RED");
+
+	blur.sigma = -1.0f;
+}
+
+//Normalized, so the blur keeps the brightness whatever the radius is cut at
+static void UpdateGaussianWeights(ComputeBlur& blur, f32 sigma)
+{
+	if (sigma == blur.sigma)
+		return;
+
+	blur.sigma = sigma;
+	blur.radius = glm::clamp((i32)ceilf(3.0f * sigma), 0, COMPUTE_BLUR_MAX_RADIUS);
+
+	f32 sum = 0.0f;
+	for (i32 i = 0; i <= blur.radius; ++i)
+	{
+		blur.weights[i] = sigma > 0.0f ? expf(-(f32)(i * i) / (2.0f * sigma * sigma)) : 1.0f;
+		sum += i == 0 ? blur.weights[i] : 2.0f * blur.weights[i];
+	}
+
+	for (i32 i = 0; i <= blur.radius; ++i)
+		blur.weights[i] /= sum;
+}
+
+//One direction, a group per COMPUTE_BLUR_TILE texels of a line
+static void DispatchBlur(const ComputeBlurProgram& blurProgram, GLuint source, GLuint destination, GLint internalFormat, ivec2 size, ivec2 direction)
+{
+	glUniform2i(blurProgram.directionLocation, direction.x, direction.y);
+
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, source);
+	glBindImageTexture(0, destination, 0, GL_FALSE, 0, GL_WRITE_ONLY, internalFormat);
+
+	const i32 length = direction.x != 0 ? size.x : size.y;
+	const i32 lines = direction.x != 0 ? size.y : size.x;
+	glDispatchCompute((length + COMPUTE_BLUR_TILE - 1) / COMPUTE_BLUR_TILE, lines, 1);
+}
+
+void ComputeGaussianBlur(App* app, GLuint source, GLuint destination, GLint internalFormat, ivec2 size, f32 sigma)
+{
+	ASSERT(internalFormat == GL_R11F_G11F_B10F || internalFormat == GL_R16F, "The compute blur has no kernel for this format");
+
+	ComputeBlur& blur = app->computeBlur;
+	UpdateGaussianWeights(blur, sigma);
+
+	const ComputeBlurProgram& blurProgram = internalFormat == GL_R16F ? blur.redProgram : blur.colorProgram;
+	Program& program = app->programs[blurProgram.programIdx];
+	StateUseProgram(program.handle);
+
+	glUniform1i(blurProgram.sourceLocation, 0);
+	glUniform2i(blurProgram.sizeLocation, size.x, size.y);
+	glUniform1i(blurProgram.radiusLocation, blur.radius);
+	glUniform1fv(blurProgram.weightsLocation, blur.radius + 1, blur.weights);
+
+	GLuint horizontal = AcquireRenderTarget(app->renderTargetPool, internalFormat, size, GL_NEAREST);
+
+	DispatchBlur(blurProgram, source, horizontal, internalFormat, size, ivec2(1, 0));
+
+	//The vertical pass fetches what the horizontal one stored
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	DispatchBlur(blurProgram, horizontal, destination, internalFormat, size, ivec2(0, 1));
+
+	//Whoever called it samples or draws to the result next
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+
+	glInvalidateTexImage(horizontal, 0);
+	ReleaseRenderTarget(app->renderTargetPool, horizontal);
+}
\ No newline at end of file
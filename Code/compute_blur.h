@@ -0,0 +1,11 @@
+#pragma once
+
+#include "engine.h"
+
+//Loads the blur kernels, one per supported target format
+void InitComputeBlur(App* app);
+
+//Gaussian blur of the size.x x size.y bottom left texels of source into destination, which can be the same texture.
+//Both have to be GL_R11F_G11F_B10F or GL_R16F. The horizontal pass goes through a pooled texture of the same format.
+//The radius is 3 sigma, capped at COMPUTE_BLUR_MAX_RADIUS texels.
+void ComputeGaussianBlur(App* app, GLuint source, GLuint destination, GLint internalFormat, ivec2 size, f32 sigma);
\ No newline at end of file
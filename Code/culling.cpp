@@ -0,0 +1,299 @@
+#include "culling.h"
+#include "bvh.h"
+#include <glm/gtc/matrix_access.hpp>
+#include <algorithm>
+#include <float.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <emmintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+#pragma region Bounds
+
+void ComputeSubmeshBounds(Submesh& submesh)
+{
+	//Positions are always the first attribute
+	const u32 stride = submesh.vertexBufferLayout.stride / sizeof(f32);
+	const u32 vertexCount = stride > 0 ? (u32)submesh.vertices.size() / stride : 0;
+
+	if (vertexCount == 0)
+	{
+		submesh.boundsMin = submesh.boundsMax = vec3(0.0f);
+		submesh.boundingSphere = vec4(0.0f);
+		return;
+	}
+
+	vec3 boundsMin = vec3(FLT_MAX);
+	vec3 boundsMax = vec3(-FLT_MAX);
+
+	for (u32 i = 0; i < vertexCount; ++i)
+	{
+		const f32* position = &submesh.vertices[i * stride];
+		boundsMin = glm::min(boundsMin, vec3(position[0], position[1], position[2]));
+		boundsMax = glm::max(boundsMax, vec3(position[0], position[1], position[2]));
+	}
+
+	//Centered on the box, the radius is the farthest vertex and not the half diagonal
+	vec3 center = (boundsMin + boundsMax) * 0.5f;
+	f32 radiusSquared = 0.0f;
+
+	for (u32 i = 0; i < vertexCount; ++i)
+	{
+		const f32* position = &submesh.vertices[i * stride];
+		vec3 offset = vec3(position[0], position[1], position[2]) - center;
+		radiusSquared = glm::max(radiusSquared, glm::dot(offset, offset));
+	}
+
+	submesh.boundsMin = boundsMin;
+	submesh.boundsMax = boundsMax;
+	submesh.boundingSphere = vec4(center, sqrtf(radiusSquared));
+}
+
+void ComputeMeshBounds(Mesh& mesh)
+{
+	if (mesh.submeshes.empty())
+	{
+		mesh.boundsMin = mesh.boundsMax = vec3(0.0f);
+		mesh.boundingSphere = vec4(0.0f);
+		return;
+	}
+
+	vec3 boundsMin = vec3(FLT_MAX);
+	vec3 boundsMax = vec3(-FLT_MAX);
+
+	for (const Submesh& submesh : mesh.submeshes)
+	{
+		boundsMin = glm::min(boundsMin, submesh.boundsMin);
+		boundsMax = glm::max(boundsMax, submesh.boundsMax);
+	}
+
+	//Smallest sphere around the box that also contains every submesh sphere
+	vec3 center = (boundsMin + boundsMax) * 0.5f;
+	f32 radius = 0.0f;
+
+	for (const Submesh& submesh : mesh.submeshes)
+	{
+		radius = glm::max(radius, glm::length(vec3(submesh.boundingSphere) - center) + submesh.boundingSphere.w);
+	}
+
+	mesh.boundsMin = boundsMin;
+	mesh.boundsMax = boundsMax;
+	mesh.boundingSphere = vec4(center, glm::min(radius, glm::length(boundsMax - center)));
+}
+
+#pragma endregion
+
+#pragma region Frustum tests
+
+void ExtractFrustumPlanes(const mat4& viewProjection, vec4 planes[6])
+{
+	//Rows of the matrix, glm is column major
+	vec4 row0 = glm::row(viewProjection, 0);
+	vec4 row1 = glm::row(viewProjection, 1);
+	vec4 row2 = glm::row(viewProjection, 2);
+	vec4 row3 = glm::row(viewProjection, 3);
+
+	planes[0] = row3 + row0; //Left
+	planes[1] = row3 - row0; //Right
+	planes[2] = row3 + row1; //Bottom
+	planes[3] = row3 - row1; //Top
+	planes[4] = row3 + row2; //Near
+	planes[5] = row3 - row2; //Far
+
+	for (u32 i = 0; i < 6; ++i)
+	{
+		planes[i] /= glm::length(vec3(planes[i]));
+	}
+}
+
+static void CullSpheresScalar(const vec4 planes[6], const f32* x, const f32* y, const f32* z, const f32* radius, u32 first, u32 count, u8* visible)
+{
+	for (u32 i = first; i < count; ++i)
+	{
+		bool inside = true;
+		for (u32 p = 0; p < 6 && inside; ++p)
+		{
+			inside = planes[p].x * x[i] + planes[p].y * y[i] + planes[p].z * z[i] + planes[p].w > -radius[i];
+		}
+		visible[i] = inside ? 1 : 0;
+	}
+}
+
+void CullSpheres(const vec4 planes[6], const f32* x, const f32* y, const f32* z, const f32* radius, u32 count, u8* visible)
+{
+	u32 i = 0;
+
+#if SIMD_X86
+	__m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+	for (u32 p = 0; p < 6; ++p)
+	{
+		planeX[p] = _mm_set1_ps(planes[p].x);
+		planeY[p] = _mm_set1_ps(planes[p].y);
+		planeZ[p] = _mm_set1_ps(planes[p].z);
+		planeW[p] = _mm_set1_ps(planes[p].w);
+	}
+
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128 sx = _mm_loadu_ps(x + i);
+		const __m128 sy = _mm_loadu_ps(y + i);
+		const __m128 sz = _mm_loadu_ps(z + i);
+		const __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (u32 p = 0; p < 6; ++p)
+		{
+			__m128 distance = _mm_add_ps(_mm_mul_ps(planeX[p], sx), planeW[p]);
+			distance = _mm_add_ps(distance, _mm_mul_ps(planeY[p], sy));
+			distance = _mm_add_ps(distance, _mm_mul_ps(planeZ[p], sz));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, negativeRadius));
+		}
+
+		const int mask = _mm_movemask_ps(inside);
+		visible[i + 0] = (mask >> 0) & 1;
+		visible[i + 1] = (mask >> 1) & 1;
+		visible[i + 2] = (mask >> 2) & 1;
+		visible[i + 3] = (mask >> 3) & 1;
+	}
+#endif
+
+	CullSpheresScalar(planes, x, y, z, radius, i, count, visible);
+}
+
+bool IsBoxVisible(const vec4 planes[6], const mat4& world, const vec3& boundsMin, const vec3& boundsMax)
+{
+	//World space box around the transformed one: center moves with the matrix, extents with its absolute value
+	const vec3 center = vec3(world * vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+	const vec3 localExtents = (boundsMax - boundsMin) * 0.5f;
+	const glm::mat3 absolute = glm::mat3(glm::abs(vec3(world[0])), glm::abs(vec3(world[1])), glm::abs(vec3(world[2])));
+	const vec3 extents = absolute * localExtents;
+
+	for (u32 p = 0; p < 6; ++p)
+	{
+		const vec3 normal = vec3(planes[p]);
+		if (glm::dot(normal, center) + planes[p].w + glm::dot(glm::abs(normal), extents) < 0.0f)
+			return false;
+	}
+
+	return true;
+}
+
+#pragma endregion
+
+void CullScene(App* app, const mat4& viewProjection)
+{
+	FrustumCuller& culler = app->frustumCuller;
+	CullingStats& stats = culler.stats;
+	stats = {};
+
+	const u32 entityCount = (u32)app->entityList.size();
+	app->visibleEntities.clear();
+
+	ExtractFrustumPlanes(viewProjection, culler.planes);
+
+	//The compute shader tests every submesh, so everything has to reach the instance params
+	const bool cullOnCpu = culler.enabled && app->submissionMode != SubmissionMode_GPUCulled;
+
+	// Candidates from the BVH, the rest of the scene is skipped without touching it -----------------------------------
+	culler.candidates.clear();
+
+	if (cullOnCpu && culler.useBvh && app->entityBvhLeaves.size() == entityCount)
+	{
+		BvhQueryFrustum(app->sceneBvh, culler.planes, culler.candidates);
+		std::sort(culler.candidates.begin(), culler.candidates.end());
+	}
+	else
+	{
+		culler.candidates.resize(entityCount);
+		for (u32 i = 0; i < entityCount; ++i)
+		{
+			culler.candidates[i] = i;
+		}
+	}
+
+	const u32 candidateCount = (u32)culler.candidates.size();
+	stats.bvhCandidates = candidateCount;
+
+	// Candidate spheres, all at once ---------------------------------------------------------------------------------
+	culler.sphereX.resize(candidateCount);
+	culler.sphereY.resize(candidateCount);
+	culler.sphereZ.resize(candidateCount);
+	culler.sphereRadius.resize(candidateCount);
+	culler.sphereVisible.resize(candidateCount);
+
+	for (u32 c = 0; c < candidateCount; ++c)
+	{
+		const Entity& entity = app->entityList[culler.candidates[c]];
+		const Mesh& mesh = app->meshes[app->models[entity.model].meshIdx];
+		const mat4& world = entity.transformationMatrix;
+
+		vec3 center = vec3(world * vec4(vec3(mesh.boundingSphere), 1.0f));
+		f32 scale = glm::max(glm::length(vec3(world[0])), glm::max(glm::length(vec3(world[1])), glm::length(vec3(world[2]))));
+
+		culler.sphereX[c] = center.x;
+		culler.sphereY[c] = center.y;
+		culler.sphereZ[c] = center.z;
+		culler.sphereRadius[c] = mesh.boundingSphere.w * scale;
+	}
+
+	if (cullOnCpu)
+		CullSpheres(culler.planes, culler.sphereX.data(), culler.sphereY.data(), culler.sphereZ.data(), culler.sphereRadius.data(), candidateCount, culler.sphereVisible.data());
+	else
+		std::fill(culler.sphereVisible.begin(), culler.sphereVisible.end(), (u8)1);
+
+	// Submesh boxes, only for the entities that survived ------------------------------------------------------------
+	u32 c = 0;
+	for (u32 i = 0; i < entityCount; ++i)
+	{
+		Entity& entity = app->entityList[i];
+		const Mesh& mesh = app->meshes[app->models[entity.model].meshIdx];
+		const u32 submeshCount = (u32)mesh.submeshes.size();
+
+		const bool isCandidate = c < candidateCount && culler.candidates[c] == i;
+		const bool sphereVisible = isCandidate && culler.sphereVisible[c];
+		if (isCandidate)
+			c++;
+
+		if (!sphereVisible)
+		{
+			stats.culledEntities++;
+			stats.culledSubmeshes += submeshCount;
+			continue;
+		}
+
+		entity.visibleSubmeshes = ~0ull;
+
+		if (cullOnCpu && submeshCount > 1)
+		{
+			for (u32 s = 0; s < submeshCount && s < 64; ++s)
+			{
+				const Submesh& submesh = mesh.submeshes[s];
+				if (!IsBoxVisible(culler.planes, entity.transformationMatrix, submesh.boundsMin, submesh.boundsMax))
+					entity.visibleSubmeshes &= ~(1ull << s);
+			}
+		}
+
+		u32 visibleSubmeshCount = 0;
+		for (u32 s = 0; s < submeshCount; ++s)
+		{
+			if (IsSubmeshVisible(entity, s))
+				visibleSubmeshCount++;
+		}
+
+		stats.visibleSubmeshes += visibleSubmeshCount;
+		stats.culledSubmeshes += submeshCount - visibleSubmeshCount;
+
+		if (visibleSubmeshCount == 0)
+		{
+			stats.culledEntities++;
+			continue;
+		}
+
+		entity.instanceIdx = (u32)app->visibleEntities.size();
+		app->visibleEntities.push_back(i);
+		stats.visibleEntities++;
+	}
+}
\ No newline at end of file
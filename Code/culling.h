@@ -0,0 +1,27 @@
+#pragma once
+
+#include "engine.h"
+
+// Bounds ---------------------------------------------------------------------------------------------------------------
+
+//From the positions still kept in the submesh vertices
+void ComputeSubmeshBounds(Submesh& submesh);
+void ComputeMeshBounds(Mesh& mesh);
+
+// Frustum tests --------------------------------------------------------------------------------------------------------
+
+//Planes point inwards and are normalized, so plane distances are in world units
+void ExtractFrustumPlanes(const mat4& viewProjection, vec4 planes[6]);
+
+//Four spheres per iteration, visible gets 1 or 0 for each sphere
+void CullSpheres(const vec4 planes[6], const f32* x, const f32* y, const f32* z, const f32* radius, u32 count, u8* visible);
+
+bool IsBoxVisible(const vec4 planes[6], const mat4& world, const vec3& boundsMin, const vec3& boundsMax);
+
+inline bool IsSubmeshVisible(const Entity& entity, u32 submeshIdx)
+{
+	return submeshIdx >= 64 || (entity.visibleSubmeshes & (1ull << submeshIdx)) != 0;
+}
+
+//Fills app->visibleEntities and the visible submeshes of each entity
+void CullScene(App* app, const mat4& viewProjection);
\ No newline at end of file
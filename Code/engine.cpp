@@ -7,12 +7,44 @@
 
 #include "engine.h"
 #include "assimp_loading.h"
+#include "bloom.h"
 #include "buffer_management.h"
+#include "bvh.h"
+#include "clustered_lighting.h"
+#include "compute_blur.h"
+#include "culling.h"
+#include "geometry_heap.h"
+#include "light_buffer.h"
+#include "light_volumes.h"
+#include "gl_state.h"
+#include "gpu_culling.h"
+#include "render_graph.h"
+#include "render_queue.h"
+#include "render_target_pool.h"
 #include "resource_management.h"
+#include "simd_transforms.h"
+#include "staging_ring.h"
 #include <imgui.h>
+#include <algorithm>
 #include <stb_image.h>
 #include <stb_image_write.h>
 
+// Uniform block layouts, as the shaders should see them ---------------------------------------------------------------
+
+static const UniformFieldLayout globalParamsFields[] =
+{
+	{ "uCameraPosition", GlobalParams::Offset(GlobalParams_CameraPosition) },
+};
+static const UniformBlockLayout globalParamsLayout = { "GlobalParams", GlobalParams::size, globalParamsFields, ARRAY_COUNT(globalParamsFields) };
+
+static const UniformFieldLayout localParamsFields[] =
+{
+	{ "uWorldMatrix",               LocalParams::Offset(LocalParams_WorldMatrix) },
+	{ "uWorldViewProjectionMatrix", LocalParams::Offset(LocalParams_WorldViewProjectionMatrix) },
+	{ "reflectiveness",             LocalParams::Offset(LocalParams_Reflectiveness) },
+};
+static const UniformBlockLayout localParamsLayout = { "LocalParams", LocalParams::size, localParamsFields, ARRAY_COUNT(localParamsFields) };
+
 mat4 TransformPositionScale(const vec3& pos, const vec3& scaleFactors)
 {
 	mat4 transform = glm::translate(pos);
@@ -79,49 +111,41 @@ void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei l
 	}
 }
 
-void GenerateTextureBuffer(App* app, GLuint& attachmentHandle)
+//Allocated size of a target, the full resolution ones may be bigger than the display
+ivec2 GetRenderTargetSize(const App* app, f32 scale)
 {
-	glGenTextures(1, &attachmentHandle);
-	glBindTexture(GL_TEXTURE_2D, attachmentHandle);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	return glm::max(ivec2(vec2(app->frameBufferResize.allocatedSize) * scale), ivec2(1));
 }
 
-void GenerateDepthBuffer(App* app, GLuint& attachmentHandle)
+//Part of a target the frame is drawn into
+ivec2 GetRenderViewportSize(const App* app, f32 scale)
 {
-	glGenTextures(1, &attachmentHandle);
-	glBindTexture(GL_TEXTURE_2D, attachmentHandle);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return glm::max(ivec2(vec2(app->frameBufferResize.renderSize) * scale), ivec2(1));
 }
 
-void GenFrameBuffers(App* app)
+//Maps the [0, 1] screen quad coordinates to the drawn part of the targets
+vec2 GetRenderTargetUvScale(const App* app)
 {
-	// Direct lighting to render texture buffer -----------------------------------------------------------------------
-	GenerateTextureBuffer(app, app->frameBufferAttachmentHandle);
-	GenerateDepthBuffer(app, app->depthAttachmentHandle);
+	return vec2(GetRenderViewportSize(app, 1.0f)) / vec2(GetRenderTargetSize(app, 1.0f));
+}
 
-	glGenFramebuffers(1, &app->directFrameBufferHandle);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->directFrameBufferHandle);
+void GenerateTextureBuffer(App* app, const RenderTargetDesc& desc)
+{
+	*desc.handle = AcquireRenderTarget(app->renderTargetPool, desc.internalFormat, GetRenderTargetSize(app, desc.scale), desc.filter);
+}
 
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, app->frameBufferAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, app->depthAttachmentHandle, 0);
+void GenerateDepthBuffer(App* app, GLuint& attachmentHandle)
+{
+	attachmentHandle = AcquireRenderTarget(app->renderTargetPool, GL_DEPTH_COMPONENT24, GetRenderTargetSize(app, 1.0f), GL_NEAREST);
+}
 
-	GLenum directFramebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (directFramebufferStatus != GL_FRAMEBUFFER_COMPLETE)
+void CheckFramebufferStatus(const char* name)
+{
+	GLenum framebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (framebufferStatus != GL_FRAMEBUFFER_COMPLETE)
 	{
-		switch (directFramebufferStatus)
+		ELOG("Incomplete %s framebuffer", name);
+		switch (framebufferStatus)
 		{
 		case GL_FRAMEBUFFER_UNDEFINED:ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
 		case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
@@ -134,52 +158,112 @@ void GenFrameBuffers(App* app)
 		default:ELOG("Unknown framebuffer status error");
 		}
 	}
+}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+//Gives the targets back to the pool and deletes the framebuffer that used them
+static void ReleaseFrameBuffers(App* app)
+{
+	if (app->directFrameBufferHandle == 0)
+		return;
 
-	// Defferred lighting to render texture buffer --------------------------------------------------------------------
+	ReleaseRenderTarget(app->renderTargetPool, app->frameBufferAttachmentHandle);
+	ReleaseRenderTarget(app->renderTargetPool, app->directDepthAttachmentHandle);
+	app->frameBufferAttachmentHandle = 0;
+	app->directDepthAttachmentHandle = 0;
 
-	GenerateTextureBuffer(app, app->albedoAttachmentHandle);
-	GenerateTextureBuffer(app, app->normalsAttachmentHandle);
-	GenerateTextureBuffer(app, app->positionAttachmentHandle);
-	GenerateTextureBuffer(app, app->deferredAttachmentHandle);
-	GenerateTextureBuffer(app, app->brightColorsAttachmentHandle);
-	GenerateTextureBuffer(app, app->halfBlurredColorsAttachmentHandle);
-	GenerateTextureBuffer(app, app->blurredColorsAttachmentHandle);
-	GenerateTextureBuffer(app, app->mixedBlurImage);
+	StateDeleteFramebuffer(app->directFrameBufferHandle);
+	app->directFrameBufferHandle = 0;
+}
 
-	//Create the Frame Buffer where all the textures will be stored
-	glGenFramebuffers(1, &app->deferredFrameBufferHandle);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->deferredFrameBufferHandle);
+//The deferred targets are not created here, the render graph takes them from the pool every frame
+void GenFrameBuffers(App* app)
+{
+	FrameBufferResize& resize = app->frameBufferResize;
+	ReleaseFrameBuffers(app);
 
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, app->albedoAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, app->normalsAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, app->positionAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, app->deferredAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, app->brightColorsAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, app->halfBlurredColorsAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT6, GL_TEXTURE_2D, app->blurredColorsAttachmentHandle, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT7, GL_TEXTURE_2D, app->mixedBlurImage, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, app->depthAttachmentHandle, 0);
+	resize.allocatedSize = ChooseRenderTargetSize(resize, app->displaySize);
+	resize.renderSize = glm::clamp(app->displaySize, ivec2(1), resize.allocatedSize);
+	resize.pending = false;
 
-	GLenum framebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (framebufferStatus != GL_FRAMEBUFFER_COMPLETE)
+	// Direct lighting to render texture buffer -----------------------------------------------------------------------
+	GenerateTextureBuffer(app, { &app->frameBufferAttachmentHandle, GL_RGBA8, 1.0f, GL_NEAREST });
+	GenerateDepthBuffer(app, app->directDepthAttachmentHandle);
+
+	glGenFramebuffers(1, &app->directFrameBufferHandle);
+	StateBindFramebuffer(GL_FRAMEBUFFER, app->directFrameBufferHandle);
+
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, app->frameBufferAttachmentHandle, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, app->directDepthAttachmentHandle, 0);
+
+	CheckFramebufferStatus("direct");
+
+	StateBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	//The depth pyramid was built from the old depth buffer
+	app->hiZ.valid = false;
+}
+
+//Transient targets of the deferred pipeline, aliased by the render graph when their lifetimes don't overlap
+static void InitDeferredRenderGraph(App* app)
+{
+	RenderGraph& graph = app->renderGraph;
+	InitRenderGraph(graph);
+
+	//HDR targets use R11F_G11F_B10F, 32 bits per pixel like RGBA8 and half of RGBA16F, they have no alpha
+	struct { RenderResource id; const char* name; RenderTargetDesc desc; } targets[] =
 	{
-		switch (framebufferStatus)
-		{
-		case GL_FRAMEBUFFER_UNDEFINED:ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-		case GL_FRAMEBUFFER_UNSUPPORTED:ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-		case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-		default:ELOG("Unknown framebuffer status error");
-		}
+		//id                           name            handle                                   format                 scale               filter
+		{ RenderResource_Depth,        "Depth",        { &app->depthAttachmentHandle,            GL_DEPTH24_STENCIL8,  1.0f,               GL_NEAREST } }, //Same format as the volume depth, for the copy
+		{ RenderResource_Albedo,       "Albedo",       { &app->albedoAttachmentHandle,           GL_RGBA8,             1.0f,               GL_NEAREST } },
+		{ RenderResource_Normals,      "Normals",      { &app->normalsAttachmentHandle,          GL_RG16,              1.0f,               GL_NEAREST } }, //Octahedral, the position comes from the depth
+		{ RenderResource_Deferred,     "Deferred",     { &app->deferredAttachmentHandle,         GL_R11F_G11F_B10F,    1.0f,               GL_LINEAR } }, //Filtered by the bloom downsample
+		{ RenderResource_Bloom,        "Bloom",        { &app->bloomAttachmentHandle,            GL_R11F_G11F_B10F,    BLOOM_TARGET_SCALE, GL_LINEAR } }, //Top of the bloom chain
+		{ RenderResource_VolumeDepth,  "Volume depth", { &app->volumeDepthAttachmentHandle,      GL_DEPTH24_STENCIL8,  1.0f,               GL_NEAREST } }, //Copy of the depth, with the light volume marks
+	};
+
+	for (const auto& target : targets)
+	{
+		u32 resource = AddRenderGraphResource(graph, target.name, target.desc);
+		ASSERT(resource == (u32)target.id, "Render graph resources registered out of order");
+	}
+}
+
+void OnFrameBufferResized(App* app, ivec2 displaySize)
+{
+	FrameBufferResize& resize = app->frameBufferResize;
+	app->displaySize = displaySize;
+
+	//Minimized, keep everything as it is until the window comes back
+	if (displaySize.x <= 0 || displaySize.y <= 0)
+		return;
+
+	//Drawn into the current targets until the size settles, stretched to the window if they are too small
+	resize.renderSize = glm::clamp(displaySize, ivec2(1), resize.allocatedSize);
+
+	if (ChooseRenderTargetSize(resize, displaySize) == resize.allocatedSize)
+	{
+		resize.pending = false;
+		resize.absorbedCount++;
+		return;
 	}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	resize.pending = true;
+	resize.timer = resize.debounceSeconds;
+}
+
+//Reallocates the targets once no resize event arrived for debounceSeconds
+static void UpdateFrameBufferResize(App* app)
+{
+	FrameBufferResize& resize = app->frameBufferResize;
+	if (!resize.pending)
+		return;
+
+	resize.timer -= app->deltaTime;
+	if (resize.timer > 0.0f)
+		return;
+
+	GenFrameBuffers(app);
+	resize.reallocationCount++;
 }
 
 void InitPrimitiveGeometry(GLuint& geometryVao, const VertexV3V2 vertices[], GLsizeiptr verticesSize, const u16 indices[], GLsizeiptr indicesSize)
@@ -189,28 +273,28 @@ void InitPrimitiveGeometry(GLuint& geometryVao, const VertexV3V2 vertices[], GLs
 
 	//VBO
 	glGenBuffers(1, &embeddedVerticesIdx);
-	glBindBuffer(GL_ARRAY_BUFFER, embeddedVerticesIdx);
+	StateBindBuffer(GL_ARRAY_BUFFER, embeddedVerticesIdx);
 	glBufferData(GL_ARRAY_BUFFER, verticesSize, vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	StateBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	//EBO
 	glGenBuffers(1, &embeddedElementsIdx);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, embeddedElementsIdx);
+	StateBindBuffer(GL_ELEMENT_ARRAY_BUFFER, embeddedElementsIdx);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesSize, indices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	StateBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
 	//VAO, we use this in render, in FindVAOs
 	glGenVertexArrays(1, &geometryVao);
-	glBindVertexArray(geometryVao);
-	glBindBuffer(GL_ARRAY_BUFFER, embeddedVerticesIdx);
+	StateBindVertexArray(geometryVao);
+	StateBindBuffer(GL_ARRAY_BUFFER, embeddedVerticesIdx);
 
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)0);  //The first parameter is 0 because this is
 	glEnableVertexAttribArray(0);                                                   //the "location" we declare in the shader
 	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)12); //The first parameter is 1 because this is
 	glEnableVertexAttribArray(1);                                                   //the "location" we declare in the shader
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, embeddedElementsIdx);
-	glBindVertexArray(0);
+	StateBindBuffer(GL_ELEMENT_ARRAY_BUFFER, embeddedElementsIdx);
+	StateBindVertexArray(0);
 }
 
 u32 LoadCubemapTexture(App* app, std::vector<std::string> cubemapTexturePaths)
@@ -235,7 +319,7 @@ u32 LoadCubemapTexture(App* app, std::vector<std::string> cubemapTexturePaths)
 
 	unsigned int textureID;
 	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+	StateBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
 
 	int width, height, nrChannels;
 	for (unsigned int i = 0; i < cubemapTexturePaths.size(); i++)
@@ -266,6 +350,8 @@ u32 LoadCubemapTexture(App* app, std::vector<std::string> cubemapTexturePaths)
 
 void Init(App* app)
 {
+	InvalidateGLState();
+
 	if (GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3))
 	{
 		glDebugMessageCallback(OnGlError, app);
@@ -405,9 +491,9 @@ void Init(App* app)
 	};
 
 	InitPrimitiveGeometry(app->targetQuad_vao, targetQuad_vertices, sizeof(targetQuad_vertices), targetQuad_indices, sizeof(targetQuad_indices));
+	glGenVertexArrays(1, &app->fullScreenTriangle_vao);
 	InitPrimitiveGeometry(app->cube_vao, cube_vertices, sizeof(cube_vertices), cube_indices, sizeof(cube_indices));
 	InitPrimitiveGeometry(app->sphere_vao, sphere_vertices, sizeof(sphere_vertices), sphere_indices, sizeof(sphere_indices));
-	InitPrimitiveGeometry(app->skybox_vao, cube_vertices, sizeof(cube_vertices), cube_indices, sizeof(cube_indices));
 
 	// Programs init --------------------------------------------------------------------------------------------------
 
@@ -415,12 +501,15 @@ void Init(App* app)
 	app->texturedGeometryProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY"); //This is used to render a plane
 	Program& texturedGeometryProgram = app->programs[app->texturedGeometryProgramIdx];
 	app->programUniformTexture = glGetUniformLocation(texturedGeometryProgram.handle, "uTexture");
+	app->programUniformUvScale = glGetUniformLocation(texturedGeometryProgram.handle, "uUvScale");
 
 	// Direct Mode
 	app->texturedMeshProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH"); //This is used to render a mesh
 	Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
 
 	app->texturedMeshProgram_uTexture = glGetUniformLocation(texturedMeshProgram.handle, "uTexture");
+	ExpectUniformBlock(app, app->texturedMeshProgramIdx, globalParamsLayout);
+	ExpectUniformBlock(app, app->texturedMeshProgramIdx, localParamsLayout);
 
 	// Render textures
 	app->renderTexturesProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "RENDER_TEXTURES"); //This is used to render a mesh
@@ -428,40 +517,84 @@ void Init(App* app)
 
 	app->renderTexturesProgram_uTexture = glGetUniformLocation(renderTexturesProgram.handle, "uTexture");
 	app->renderTexturesProgram_cubeTexture = glGetUniformLocation(renderTexturesProgram.handle, "cubeTexture");
+	ExpectUniformBlock(app, app->renderTexturesProgramIdx, globalParamsLayout);
+	ExpectUniformBlock(app, app->renderTexturesProgramIdx, localParamsLayout);
+
+	//Same shader, reads the transforms from the instance params buffer for multi-draw indirect
+	app->renderTexturesIndirectProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "RENDER_TEXTURES_INDIRECT");
+	Program& renderTexturesIndirectProgram = app->programs[app->renderTexturesIndirectProgramIdx];
+
+	app->renderTexturesIndirectProgram_uTexture = glGetUniformLocation(renderTexturesIndirectProgram.handle, "uTexture");
+	app->renderTexturesIndirectProgram_cubeTexture = glGetUniformLocation(renderTexturesIndirectProgram.handle, "cubeTexture");
+	ExpectUniformBlock(app, app->renderTexturesIndirectProgramIdx, globalParamsLayout);
+
+	//Compute pass that frustum culls the indirect draws
+	InitGpuCulling(app);
+
+	//Depth only versions for the pre-pass, they compute the position exactly like the G-buffer ones
+	app->depthPrePass.programIdx = LoadProgram(app, "render_textures_shader.glsl", "DEPTH_PREPASS");
+	ExpectUniformBlock(app, app->depthPrePass.programIdx, localParamsLayout);
+
+	app->depthPrePass.indirectProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "DEPTH_PREPASS_INDIRECT");
+
+	glGenQueries(DEPTH_PREPASS_TIMER_FRAMES * 2, &app->depthPrePass.timerQueries[0][0]);
 
 	// Deferred Lighting
 	app->deferredLightingProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "DEFERRED_LIGHTING_PASS"); //This is used for the deferred lighting pass
 	Program& deferredLightingProgram = app->programs[app->deferredLightingProgramIdx];
 
-	app->deferredLightingPass_posTexture = glGetUniformLocation(deferredLightingProgram.handle, "positionTexture");
+	app->deferredLightingPass_depthTexture = glGetUniformLocation(deferredLightingProgram.handle, "depthTexture");
 	app->deferredLightingPass_normalTexture = glGetUniformLocation(deferredLightingProgram.handle, "normalTexture");
 	app->deferredLightingPass_albedoTexture = glGetUniformLocation(deferredLightingProgram.handle, "albedoTexture");
+	app->deferredLightingPass_inverseViewProjection = glGetUniformLocation(deferredLightingProgram.handle, "uInverseViewProjection");
+	app->deferredLightingPass_uvScale = glGetUniformLocation(deferredLightingProgram.handle, "uUvScale");
+	app->deferredLightingPass_directionalOnly = glGetUniformLocation(deferredLightingProgram.handle, "uDirectionalOnly");
+	ExpectUniformBlock(app, app->deferredLightingProgramIdx, globalParamsLayout);
+
+	//Same shading, only with the lights binned in the clusters of the pixel
+	InitClusteredLighting(app);
+	ExpectUniformBlock(app, app->clusteredLighting.shadingProgramIdx, globalParamsLayout);
+
+	//Or one light at a time, on the pixels inside its sphere
+	InitLightVolumes(app, sphere_vertices, sphere_indices, ARRAY_COUNT(sphere_indices));
+	ExpectUniformBlock(app, app->lightVolumes.shadingProgramIdx, globalParamsLayout);
+
+	// G-buffer debug views
+	app->gBufferDebugProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "GBUFFER_DEBUG");
+	Program& gBufferDebugProgram = app->programs[app->gBufferDebugProgramIdx];
+
+	app->gBufferDebug_depthTexture = glGetUniformLocation(gBufferDebugProgram.handle, "depthTexture");
+	app->gBufferDebug_normalTexture = glGetUniformLocation(gBufferDebugProgram.handle, "normalTexture");
+	app->gBufferDebug_inverseViewProjection = glGetUniformLocation(gBufferDebugProgram.handle, "uInverseViewProjection");
+	app->gBufferDebug_view = glGetUniformLocation(gBufferDebugProgram.handle, "uView");
+	app->gBufferDebug_uvScale = glGetUniformLocation(gBufferDebugProgram.handle, "uUvScale");
 
 	// Lights Visualization
 	app->lightVisualizationProgramIdx = LoadProgram(app, "light_visualization_shader.glsl", "LIGHT_VISUALIZATION"); //This is used to render a mesh
 	Program& lightVisProgram = app->programs[app->lightVisualizationProgramIdx];
+	app->lightGizmos.viewProjectionLocation = glGetUniformLocation(lightVisProgram.handle, "uViewProjection");
+	app->lightGizmos.firstInstanceLocation = glGetUniformLocation(lightVisProgram.handle, "uFirstInstance");
 
 	// Bloom
-	app->blurPassProgramIdx = LoadProgram(app, "bloom_pass.glsl", "BLUR_PASS");
-	Program& blurProgram = app->programs[app->blurPassProgramIdx];
+	InitBloom(app);
 
-	app->bloom_brightColorImage = glGetUniformLocation(blurProgram.handle, "brightColorImage");
-	app->bloom_horizontalLocation = glGetUniformLocation(blurProgram.handle, "horizontal");
-	app->bloomStrengthLocation = glGetUniformLocation(blurProgram.handle, "strength");
-	app->bloomIterationsLocation = glGetUniformLocation(blurProgram.handle, "iterations");
+	// Blur, for the passes that need it
+	InitComputeBlur(app);
 
 	// Bloom mix
-	app->bloomMixProgramIdx = LoadProgram(app, "bloom_pass.glsl", "MIX_BLOOM");
-	Program& bloomMixProgram = app->programs[app->bloomMixProgramIdx];
+	app->compositeProgramIdx = LoadProgram(app, "composite.glsl", "COMPOSITE");
+	Program& compositeProgram = app->programs[app->compositeProgramIdx];
 
-	app->bloom_blurredImage = glGetUniformLocation(bloomMixProgram.handle, "blurredImage");
-	app->bloom_originalImage = glGetUniformLocation(bloomMixProgram.handle, "originalColor");	
+	app->composite_litImage = glGetUniformLocation(compositeProgram.handle, "uLitImage");
+	app->composite_bloomImage = glGetUniformLocation(compositeProgram.handle, "uBloomImage");
+	app->composite_uvScale = glGetUniformLocation(compositeProgram.handle, "uUvScale");
+	app->composite_bloomIntensity = glGetUniformLocation(compositeProgram.handle, "uBloomIntensity");
 
 	//Skybox
 	app->skyboxProgramIdx = LoadProgram(app, "skybox_shader.glsl", "SKYBOX"); //This is used to render a mesh
 	Program& skyboxProgram = app->programs[app->skyboxProgramIdx];
 	app->skybox_uTexture = glGetUniformLocation(skyboxProgram.handle, "uTexture");
-	app->skybox_uMatrix = glGetUniformLocation(skyboxProgram.handle, "uWorldViewProjectionMatrix");
+	app->skybox_uInverseViewProjection = glGetUniformLocation(skyboxProgram.handle, "uInverseViewProjection");
 
 	// Camera init ----------------------------------------------------------------------------------------------------
 
@@ -552,6 +685,11 @@ void Init(App* app)
 
 	// Models init ----------------------------------------------------------------------------------------------------
 
+	//All the models share one vertex and one index buffer, both grow if they run out of space
+	InitGeometryHeap(app->geometryHeap, MB(16), MB(4));
+	InitStagingRing(app->stagingRing, MB(8), MB(2));
+	InitBvh(app->sceneBvh, 0.1f);
+
 	app->patrickModel = LoadModel(app, "Patrick/Patrick.obj");
 	app->planeModel = LoadModel(app, "Plane/Plane.obj", GL_NEAREST);
 
@@ -565,12 +703,14 @@ void Init(App* app)
 
 	// Lights placement -----------------------------------------------------------------------------------------------
 
-	app->lightList.push_back({ LightType_Point, 1, vec3(1,0,0), vec3(0), vec3(0,0.1,0) });
-	app->lightList.push_back({ LightType_Point, 1, vec3(0,1,0), vec3(0), vec3(1,3,1.5) });
-	app->lightList.push_back({ LightType_Point, 1, vec3(0,0,1), vec3(0), vec3(-1,3,1.5) });
+	app->lightList.push_back({ LightType_Point, 1, vec3(1,0,0), vec3(0), vec3(0,0.1,0), 10.0f });
+	app->lightList.push_back({ LightType_Point, 1, vec3(0,1,0), vec3(0), vec3(1,3,1.5), 10.0f });
+	app->lightList.push_back({ LightType_Point, 1, vec3(0,0,1), vec3(0), vec3(-1,3,1.5), 10.0f });
 
 	app->lightList.push_back({ LightType_Directional, 1, vec3(1,1,0), vec3(0,-1, 0), vec3(0,5,0) });
 
+	app->sceneLightCount = (u32)app->lightList.size();
+
 	// Buffer creation ------------------------------------------------------------------------------------------------
 
 	//Get info to create and use uniforms buffer
@@ -579,14 +719,29 @@ void Init(App* app)
 
 	//Create the buffer to pass the transforms to the shader
 	app->uniformsBuffer = CreateConstantBuffer(app->maxUniformBufferSize);
-	app->lightMatricesBuffer = CreateConstantBuffer(app->maxUniformBufferSize);
 
+	//The lights are read from storage buffers, there is no limit to their count
+	InitLightBuffer(app);
+
+	//Grown in PushSceneToBuffer if the scene gets bigger
+	app->instanceParamsBuffer = CreateBuffer(KB(64), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+	app->lightGizmos.instances = CreateBuffer(KB(16), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW); //Grown in Update
+	app->indirectBuffer = CreateBuffer(KB(16), GL_DRAW_INDIRECT_BUFFER, GL_STREAM_DRAW);
+
+	app->frameBufferResize.debounceSeconds = 0.2f;
+	app->frameBufferResize.growMargin = 0.1f;
+	app->frameBufferResize.shrinkThreshold = 0.6f;
 	GenFrameBuffers(app);
+	InitDeferredRenderGraph(app);
 
 	// Set default render mode ----------------------------------------------------------------------------------------
 
 	app->mode = Mode_DeferredRenderTextures;
 	app->renderTexMode = RendTexMode_DeferredBloom;
+	app->submissionMode = SubmissionMode_Instanced;
+	app->lightingMode = LightingMode_Clustered;
+	app->frustumCuller.enabled = true;
+	app->frustumCuller.useBvh = true;
 	app->currentSkybox = 0;
 }
 
@@ -645,10 +800,116 @@ void RenderingModesWindow(App* app)
 			}
 			ImGui::EndCombo();
 		}
+
+		const char* lightingTags[] = { "Full screen", "Clustered", "Light volumes" };
+		if (ImGui::BeginCombo("Lighting", lightingTags[app->lightingMode]))
+		{
+			for (int n = 0; n < ARRAY_COUNT(lightingTags); n++)
+			{
+				bool selected = (n == app->lightingMode);
+
+				if (ImGui::Selectable(lightingTags[n], selected))
+					app->lightingMode = LightingMode(n);
+
+				if (selected)
+					ImGui::SetItemDefaultFocus();
+			}
+			ImGui::EndCombo();
+		}
+
+		ClusteredLighting& clustered = app->clusteredLighting;
+		ImGui::SliderInt("Stress point lights", &clustered.stressLightCount, 0, 8192);
+		ImGui::Text("Lighting average: %.3f ms full screen, %.3f ms clustered, %.3f ms light volumes",
+			clustered.lightingMs[LightingMode_FullScreen], clustered.lightingMs[LightingMode_Clustered], clustered.lightingMs[LightingMode_LightVolumes]);
+		ImGui::Text("%u lights, %u sent this frame (%u bytes)", (u32)app->lightList.size(), app->lightBuffer.uploadedLights, app->lightBuffer.uploadedBytes);
+		if (app->lightingMode == LightingMode_Clustered)
+			ImGui::Text("%u clusters (%ux%ux%u), up to %u lights each", LIGHT_CLUSTER_COUNT, LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y, LIGHT_CLUSTER_GRID_Z, LIGHT_CLUSTER_MAX_LIGHTS);
+		else if (app->lightingMode == LightingMode_LightVolumes)
+			ImGui::Text("Light volumes: %u drawn, %u outside the frustum", app->lightVolumes.drawnLights, app->lightVolumes.culledLights);
+		ImGui::Text("Gizmos: %u cubes, %u spheres, one instanced draw per shape", app->lightGizmos.directionalCount, app->lightGizmos.pointCount);
+
+		ImGui::Checkbox("Frustum culling", &app->frustumCuller.enabled);
+		ImGui::Checkbox("BVH broad phase", &app->frustumCuller.useBvh);
+
+		DepthPrePass& prePass = app->depthPrePass;
+		ImGui::Checkbox("Depth pre-pass", &prePass.enabled);
+		ImGui::Text("Pre-pass %.3f ms, G-buffer %.3f ms", prePass.prePassMs, prePass.gBufferMs);
+		ImGui::Text("Mesh stage average: %.3f ms without pre-pass, %.3f ms with", prePass.totalMs[0], prePass.totalMs[1]);
+
+		const char* submissionTags[] = { "Direct", "Multi-draw indirect", "Instanced", "GPU culled" };
+		if (ImGui::BeginCombo("Submission", submissionTags[app->submissionMode]))
+		{
+			for (int n = 0; n < ARRAY_COUNT(submissionTags); n++)
+			{
+				bool selected = (n == app->submissionMode);
+
+				if (ImGui::Selectable(submissionTags[n], selected))
+					app->submissionMode = SubmissionMode(n);
+
+				if (selected)
+					ImGui::SetItemDefaultFocus();
+			}
+			ImGui::EndCombo();
+		}
+	}
+
+	ImGui::Text("Mesh draw calls: %u", app->meshDrawCalls);
+
+	const CullingStats& cullingStats = app->frustumCuller.stats;
+	ImGui::Text("Entities: %u visible, %u culled", cullingStats.visibleEntities, cullingStats.culledEntities);
+	ImGui::Text("Submeshes: %u visible, %u culled", cullingStats.visibleSubmeshes, cullingStats.culledSubmeshes);
+	if (app->submissionMode == SubmissionMode_GPUCulled)
+	{
+		ImGui::Text("Frustum culling runs in a compute shader, the counts above are before culling");
+
+		HiZPyramid& hiZ = app->hiZ;
+		ImGui::Checkbox("Hi-Z occlusion culling", &hiZ.enabled);
+		ImGui::SliderFloat("Max camera move", &hiZ.maxCameraMove, 0.0f, 5.0f, "%.2f");
+		ImGui::SliderFloat("Max camera turn (deg)", &hiZ.maxCameraTurnDegrees, 0.0f, 45.0f, "%.1f");
+		ImGui::Text("Hi-Z %ux%u, %u levels, %s", hiZ.size.x, hiZ.size.y, hiZ.levelCount, hiZ.usedThisFrame ? "used this frame" : "skipped this frame");
+	}
+	ImGui::Text("BVH: %u candidates, %u leaves, height %u", cullingStats.bvhCandidates, app->sceneBvh.leafCount, GetBvhHeight(app->sceneBvh));
+
+	FrameBufferResize& resize = app->frameBufferResize;
+	u32 targetCount, targetsInUse;
+	u64 targetBytes;
+	GetRenderTargetPoolStats(app->renderTargetPool, targetCount, targetsInUse, targetBytes);
+	ImGui::Text("Render targets %ux%u, drawing %ux%u%s", resize.allocatedSize.x, resize.allocatedSize.y, resize.renderSize.x, resize.renderSize.y, resize.pending ? ", resize pending" : "");
+	ImGui::Text("Pool: %u textures (%u in use), %.1f MB", targetCount, targetsInUse, targetBytes / (1024.0f * 1024.0f));
+	ImGui::Text("Resizes: %u reallocated, %u absorbed", resize.reallocationCount, resize.absorbedCount);
+
+	if (app->mode == Mode_DeferredRenderTextures && ImGui::CollapsingHeader("Render graph", ImGuiTreeNodeFlags_None))
+	{
+		const RenderGraph& graph = app->renderGraph;
+		ImGui::Text("%u passes, %u culled", (u32)graph.passes.size(), graph.culledPassCount);
+		ImGui::Text("%u textures, %u targets aliased", graph.textureCount, graph.aliasedCount);
+
+		for (const RenderGraphPass& pass : graph.passes)
+			ImGui::BulletText("%s%s", pass.name, pass.culled ? " (culled)" : "");
+
+		for (u32 i = 0; i < graph.resources.size(); ++i)
+		{
+			const RenderGraphResource& resource = graph.resources[i];
+			if (resource.imported)
+				continue;
+
+			if (resource.firstPass == RENDER_GRAPH_NONE)
+				ImGui::BulletText("%s: unused", resource.name);
+			else
+				ImGui::BulletText("%s: passes %u-%u%s", resource.name, resource.firstPass, resource.lastPass, resource.aliased ? ", aliased" : "");
+		}
 	}
 
-	ImGui::SliderFloat("Bloom strength", (float*)&app->bloomStrength, 0.0f, 100.0f, "%.1f");
-	ImGui::SliderInt("Bloom iterations", (int*)&app->bloomIterations, 0, 50, "%i");
+	Bloom& bloom = app->bloom;
+	ImGui::SliderFloat("Bloom threshold", &bloom.threshold, 0.0f, 4.0f, "%.2f");
+	ImGui::SliderFloat("Bloom soft knee", &bloom.softKnee, 0.0f, 1.0f, "%.2f");
+	ImGui::SliderFloat("Bloom intensity", &bloom.intensity, 0.0f, 4.0f, "%.2f");
+	ImGui::SliderFloat("Bloom radius", &bloom.radius, 0.5f, 3.0f, "%.2f");
+	ImGui::SliderInt("Bloom levels", &bloom.levelCount, 1, BLOOM_MAX_LEVELS);
+	ImGui::Checkbox("Compute blur of the bloom", &bloom.computeBlur);
+	if (bloom.computeBlur)
+		ImGui::SliderFloat("Compute blur sigma", &bloom.computeBlurSigma, 0.5f, COMPUTE_BLUR_MAX_RADIUS / 3.0f, "%.2f");
+	ImGui::Text("Bloom chain %ux%u, %u levels used", bloom.chainSize.x, bloom.chainSize.y, bloom.usedLevels);
 
 	ImGui::End();
 }
@@ -701,6 +962,10 @@ void InspectorWindow(App* app, Light& selectedLight)
 
 	ImGui::DragInt("Light Strength", (int*)&selectedLight.strength, 1, 0, 9999, "%d", ImGuiSliderFlags_AlwaysClamp);
 
+	//Which clusters the light is binned into, and where its attenuation reaches zero
+	if (selectedLight.type == LightType_Point)
+		ImGui::SliderFloat("Light Radius", &selectedLight.radius, 0.1f, 50.0f, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+
 	ImGui::Spacing();
 
 	ImGui::Text("Light Color");
@@ -730,14 +995,21 @@ void HierarchyWindow(App* app)
 
 	ImGui::Text("Lights");
 	ImGui::Separator();
-	for (int i = 0; i < app->lightList.size(); i++)
+
+	//Only the visible rows are submitted, there can be thousands of stress lights
+	ImGuiListClipper clipper;
+	clipper.Begin((int)app->lightList.size());
+	while (clipper.Step())
 	{
-		std::string name = "Light " + std::to_string(i);
-		if (ImGui::Selectable(name.c_str(), app->selectedLightsIndex == i))
+		for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
 		{
-			app->selectedObjType = true;
-			app->selectedEntityIndex = -1;
-			app->selectedLightsIndex = i;
+			std::string name = "Light " + std::to_string(i);
+			if (ImGui::Selectable(name.c_str(), app->selectedLightsIndex == i))
+			{
+				app->selectedObjType = true;
+				app->selectedEntityIndex = -1;
+				app->selectedLightsIndex = i;
+			}
 		}
 	}
 
@@ -807,6 +1079,143 @@ void InformationWindow(App* app)
 		ImGui::EndTable();
 	}
 
+	if (ImGui::CollapsingHeader("Geometry heap", ImGuiTreeNodeFlags_None))
+	{
+		GeometryHeap& heap = app->geometryHeap;
+
+		const char* heapNames[] = { "Vertices", "Indices" };
+		const GpuHeap* heaps[] = { &heap.vertices, &heap.indices };
+
+		for (u32 i = 0; i < ARRAY_COUNT(heaps); ++i)
+		{
+			const HeapAllocator& allocator = heaps[i]->allocator;
+
+			u32 freeBlockCount, largestFreeBlock;
+			GetHeapStats(allocator, freeBlockCount, largestFreeBlock);
+
+			ImGui::Text("%s: %.2f / %.2f MB used", heapNames[i], allocator.usedBytes / (float)MB(1), allocator.capacity / (float)MB(1));
+			ImGui::Text("    %u free blocks, largest %.2f MB", freeBlockCount, largestFreeBlock / (float)MB(1));
+		}
+
+		ImGui::Text("Shared vaos: %u", (u32)heap.vaos.size());
+
+		if (ImGui::Button("Defragment"))
+			heap.defragmentRequested = true;
+		ImGui::SameLine();
+		if (ImGui::Button("Reload models"))
+			heap.reloadRequested = true;
+	}
+
+	if (ImGui::CollapsingHeader("GL state cache", ImGuiTreeNodeFlags_None))
+	{
+		const GLStateCounters& counters = GetGLStateCounters();
+
+		if (ImGui::BeginTable("GLStateCounters", 3))
+		{
+			ImGui::TableSetupColumn("State");
+			ImGui::TableSetupColumn("Issued");
+			ImGui::TableSetupColumn("Skipped");
+			ImGui::TableHeadersRow();
+
+			u32 totalIssued = 0;
+			u32 totalSkipped = 0;
+
+			for (u32 i = 0; i < GLStateCategory_Count; ++i)
+			{
+				ImGui::TableNextRow();
+				ImGui::TableSetColumnIndex(0);
+				ImGui::Text("%s", GetGLStateCategoryName(GLStateCategory(i)));
+				ImGui::TableSetColumnIndex(1);
+				ImGui::Text("%u", counters.issued[i]);
+				ImGui::TableSetColumnIndex(2);
+				ImGui::Text("%u", counters.skipped[i]);
+
+				totalIssued += counters.issued[i];
+				totalSkipped += counters.skipped[i];
+			}
+
+			ImGui::TableNextRow();
+			ImGui::TableSetColumnIndex(0);
+			ImGui::Text("Total");
+			ImGui::TableSetColumnIndex(1);
+			ImGui::Text("%u", totalIssued);
+			ImGui::TableSetColumnIndex(2);
+			ImGui::Text("%u", totalSkipped);
+
+			ImGui::EndTable();
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Staging ring", ImGuiTreeNodeFlags_None))
+	{
+		StagingRing& ring = app->stagingRing;
+
+		ImGui::Text("In use: %.2f / %.2f MB", ring.usedBytes / (float)MB(1), ring.buffer.size / (float)MB(1));
+		ImGui::Text("Pending copies: %u, fences in flight: %u", (u32)ring.pendingCopies.size(), (u32)ring.fences.size());
+		ImGui::Text("Copied last frame: %.2f KB", ring.bytesCopiedLastFlush / (float)KB(1));
+
+		int budgetKB = (int)(ring.bytesPerFrame / KB(1));
+		if (ImGui::SliderInt("Budget per frame (KB)", &budgetKB, 64, 8192))
+			ring.bytesPerFrame = (u32)budgetKB * KB(1);
+	}
+
+	if (ImGui::CollapsingHeader("Transform kernel benchmark", ImGuiTreeNodeFlags_None))
+	{
+		TransformBenchmark& benchmark = app->transformBenchmark;
+
+		ImGui::Text("Detected instruction set: %s", GetSimdLevelName(DetectSimdLevel()));
+		ImGui::SliderInt("Entities", (int*)&benchmark.entityCount, 1000, 1000000, "%d", ImGuiSliderFlags_Logarithmic);
+
+		if (ImGui::Button("Run benchmark"))
+			benchmark.requested = true;
+
+		if (benchmark.hasResults)
+		{
+			ImGui::Text("projection * view * world: %.0f entities/ms", benchmark.entitiesPerMs[SimdLevel_Count]);
+
+			for (u32 level = 0; level < SimdLevel_Count; ++level)
+			{
+				if (level > (u32)DetectSimdLevel())
+					ImGui::Text("Batch %s: not supported", GetSimdLevelName(SimdLevel(level)));
+				else
+					ImGui::Text("Batch %s: %.0f entities/ms", GetSimdLevelName(SimdLevel(level)), benchmark.entitiesPerMs[level]);
+			}
+		}
+	}
+
+	if (ImGui::CollapsingHeader("BVH benchmark", ImGuiTreeNodeFlags_None))
+	{
+		BvhBenchmark& benchmark = app->bvhBenchmark;
+
+		ImGui::TextWrapped("Random scenes with the same density, queries with the current camera frustum, spheres of radius 5 and rays from the center");
+
+		if (ImGui::Button("Run BVH benchmark"))
+			benchmark.requested = true;
+
+		if (benchmark.hasResults && ImGui::BeginTable("BvhBenchmarkResults", 6))
+		{
+			ImGui::TableSetupColumn("Entities");
+			ImGui::TableSetupColumn("Build (ms)");
+			ImGui::TableSetupColumn("Move 10% (ms)");
+			ImGui::TableSetupColumn("Frustum (us) tree/scan");
+			ImGui::TableSetupColumn("Sphere (us) tree/scan");
+			ImGui::TableSetupColumn("Ray (us) tree/scan");
+			ImGui::TableHeadersRow();
+
+			for (u32 i = 0; i < BVH_BENCHMARK_SCALES; ++i)
+			{
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn(); ImGui::Text("%u (height %u)", benchmark.entityCount[i], benchmark.treeHeight[i]);
+				ImGui::TableNextColumn(); ImGui::Text("%.2f", benchmark.buildMs[i]);
+				ImGui::TableNextColumn(); ImGui::Text("%.2f", benchmark.updateMs[i]);
+				ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", benchmark.frustumUs[i][0], benchmark.frustumUs[i][1]);
+				ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", benchmark.sphereUs[i][0], benchmark.sphereUs[i][1]);
+				ImGui::TableNextColumn(); ImGui::Text("%.1f / %.1f", benchmark.rayUs[i][0], benchmark.rayUs[i][1]);
+			}
+			ImGui::EndTable();
+		}
+	}
+
 	ImGui::End();
 }
 
@@ -829,12 +1238,15 @@ void ProgramHotReload(App* app)
 		u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.c_str());
 		if (currentTimestamp > program.lastWriteTimestamp)
 		{
-			glDeleteProgram(program.handle);
+			StateDeleteProgram(program.handle);
 
 			String programSource = ReadTextFile(program.filepath.c_str());
 			const char* programName = program.programName.c_str();
-			program.handle = CreateProgramFromSource(programSource, programName);
+			program.handle = program.isCompute ? CreateComputeProgramFromSource(programSource, programName) : CreateProgramFromSource(programSource, programName);
 			program.lastWriteTimestamp = currentTimestamp;
+
+			for (const UniformBlockLayout* layout : program.uniformBlockLayouts)
+				ValidateUniformBlockLayout(program, *layout);
 		}
 	}
 }
@@ -943,49 +1355,89 @@ void HandleInput(App* app, Camera& cam)
 
 void PushSceneToBuffer(App* app, mat4 projection, mat4 view)
 {
+	// Lights go to their own storage buffers, only the ones that changed ------------------------------------------
+	UploadLights(app);
+
 	MapBuffer(app->uniformsBuffer, GL_WRITE_ONLY);
 
-	// Push lights to the buffer --------------------------------------------------------------------------------------
-	PushVec3(app->uniformsBuffer, (vec3)app->camera.transformation[3]);
+	GlobalParams globalParams = {};
+	globalParams.Set<GlobalParams_CameraPosition>((vec3)app->camera.transformation[3]);
 
-	PushUInt(app->uniformsBuffer, app->lightList.size());
+	PushData(app->uniformsBuffer, globalParams.data, GlobalParams::size);
 
-	for (Light& light : app->lightList)
-	{
-		AlignHead(app->uniformsBuffer, sizeof(vec4));
+	app->globalParamsSize = app->uniformsBuffer.head;
 
-		PushUInt(app->uniformsBuffer, light.type);
-		PushUInt(app->uniformsBuffer, light.strength);
-		PushVec3(app->uniformsBuffer, light.color);
-		PushVec3(app->uniformsBuffer, light.direction);
-		PushVec3(app->uniformsBuffer, light.position);
+	// Transform all visible entities at once -----------------------------------------------------------------------
+	u32 entityCount = (u32)app->visibleEntities.size();
+	app->entityWorldMatrices.resize(entityCount);
+	app->entityWVPMatrices.resize(entityCount);
+
+	for (u32 i = 0; i < entityCount; ++i)
+	{
+		app->entityWorldMatrices[i] = app->entityList[app->visibleEntities[i]].transformationMatrix;
 	}
 
-	app->globalParamsSize = app->uniformsBuffer.head;
+	mat4 viewProjection = projection * view;
+	BatchTransformMatrices(viewProjection, app->entityWorldMatrices.data(), app->entityWVPMatrices.data(), entityCount);
 
 	// Push entities to the buffer ------------------------------------------------------------------------------------
-	for (Entity& entity : app->entityList)
+	u32 instanceParamsSize = entityCount * LocalParams::size;
+	if (instanceParamsSize > app->instanceParamsBuffer.size)
+	{
+		StateDeleteBuffer(app->instanceParamsBuffer.handle);
+		app->instanceParamsBuffer = CreateBuffer(instanceParamsSize * 2, GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+	}
+
+	MapBuffer(app->instanceParamsBuffer, GL_WRITE_ONLY);
+
+	for (u32 i = 0; i < entityCount; ++i)
 	{
-		mat4 worldViewProjection = projection * view * entity.transformationMatrix;
+		Entity& entity = app->entityList[app->visibleEntities[i]];
+		ASSERT(entity.instanceIdx == i, "Instance params must follow the visible list");
+
+		LocalParams localParams = {};
+		localParams.Set<LocalParams_WorldMatrix>(app->entityWorldMatrices[i]);
+		localParams.Set<LocalParams_WorldViewProjectionMatrix>(app->entityWVPMatrices[i]);
+		localParams.Set<LocalParams_Reflectiveness>((i32)entity.reflectiveness);
 
 		AlignHead(app->uniformsBuffer, app->uniformBlockAlignment);
 
 		entity.head = app->uniformsBuffer.head;
 
-		PushMat4(app->uniformsBuffer, entity.transformationMatrix);
-		PushMat4(app->uniformsBuffer, worldViewProjection);
-		PushUInt(app->uniformsBuffer, entity.reflectiveness);
+		PushData(app->uniformsBuffer, localParams.data, LocalParams::size);
 
 		entity.size = app->uniformsBuffer.head - entity.head;
+
+		//Tightly packed, the std430 array stride of LocalParams is its std140 size
+		PushData(app->instanceParamsBuffer, localParams.data, LocalParams::size);
 	}
 
+	UnmapBuffer(app->instanceParamsBuffer);
 	UnmapBuffer(app->uniformsBuffer);
 }
 
 void Update(App* app)
 {
+	BeginGLStateFrame();
+
 	ProgramHotReload(app);
 
+	FlushStagingRing(app->stagingRing, app->stagingRing.bytesPerFrame);
+
+	//Frees the ranges of the models and allocates them again, the freed blocks are merged and reused
+	if (app->geometryHeap.reloadRequested)
+	{
+		ReloadModel(app, app->patrickModel, "Patrick/Patrick.obj");
+		ReloadModel(app, app->planeModel, "Plane/Plane.obj", GL_NEAREST);
+		app->geometryHeap.reloadRequested = false;
+	}
+
+	if (app->geometryHeap.defragmentRequested)
+	{
+		DefragmentGeometryHeap(app);
+		app->geometryHeap.defragmentRequested = false;
+	}
+
 	Camera& cam = app->camera;
 	HandleInput(app, cam);
 
@@ -1013,371 +1465,910 @@ void Update(App* app)
 	glm::mat3 skyboxRot = glm::mat3(view);
 	glm::mat4 skyboxView = glm::mat4(skyboxRot);
 
-	app->skyboxViewProjection = projection * skyboxView * TransformPositionScale(vec3(0.0f), vec3(cam.zfar / 2));
+	app->skyboxInverseViewProjection = glm::inverse(projection * skyboxView);
+	app->viewProjection = projection * view;
+
+	UpdateSceneBvh(app);
+
+	CullScene(app, projection * view);
 
 	PushSceneToBuffer(app, projection, view);
 
-	// Light gizmos need transformation matrices to be displayed on the scene -----------------------------------------
-	MapBuffer(app->lightMatricesBuffer, GL_WRITE_ONLY);
+	if (app->transformBenchmark.requested)
+	{
+		RunTransformBenchmark(app->transformBenchmark, projection, view);
+		app->transformBenchmark.requested = false;
+	}
 
-	for (Light& light : app->lightList)
+	if (app->bvhBenchmark.requested)
 	{
-		mat4 worldViewProjection = projection * view * TransformPositionScale(light.position, vec3(0.2f));
+		RunBvhBenchmark(app->bvhBenchmark, app->frustumCuller.planes);
+		app->bvhBenchmark.requested = false;
+	}
 
-		AlignHead(app->lightMatricesBuffer, app->uniformBlockAlignment);
+	UpdateStressLights(app);
 
-		PushMat4(app->lightMatricesBuffer, worldViewProjection);
+	// Light gizmos, grouped by shape so every shape is a contiguous range of instances -------------------------------
+	LightGizmos& gizmos = app->lightGizmos;
+	gizmos.directionalCount = 0;
+	gizmos.pointCount = 0;
+	for (const Light& light : app->lightList)
+	{
+		if (light.type == LightType_Directional)
+			gizmos.directionalCount++;
+		else if (light.type == LightType_Point)
+			gizmos.pointCount++;
 	}
 
-	UnmapBuffer(app->lightMatricesBuffer);
+	u32 gizmosSize = (gizmos.directionalCount + gizmos.pointCount) * sizeof(GpuLightGizmo);
+	if (gizmosSize > gizmos.instances.size)
+	{
+		StateDeleteBuffer(gizmos.instances.handle);
+		gizmos.instances = CreateBuffer(gizmosSize * 2, GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+	}
+
+	if (gizmosSize > 0)
+	{
+		MapBuffer(gizmos.instances, GL_WRITE_ONLY);
+
+		const LightType shapeOrder[] = { LightType_Directional, LightType_Point };
+		for (LightType type : shapeOrder)
+		{
+			for (const Light& light : app->lightList)
+			{
+				if (light.type != type)
+					continue;
+
+				GpuLightGizmo gizmo = { TransformPositionScale(light.position, vec3(0.2f)), vec4(light.color, 1.0f) };
+				PushData(gizmos.instances, &gizmo, sizeof(gizmo));
+			}
+		}
+
+		UnmapBuffer(gizmos.instances);
+	}
 }
 
-void RenderToQuad(App* app, GLuint textureHandle)
+//uvScale is the drawn part of the texture, see GetRenderTargetUvScale
+void RenderToQuad(App* app, GLuint textureHandle, vec2 uvScale)
 {
+	//The clear is masked too
+	StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	StateDepthMask(GL_TRUE);
 	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	StateViewport(0, 0, app->displaySize.x, app->displaySize.y);
 
 	Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-	glUseProgram(programTexturedGeometry.handle);
-	glBindVertexArray(app->targetQuad_vao);
+	StateUseProgram(programTexturedGeometry.handle);
+	StateBindVertexArray(app->targetQuad_vao);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	StateEnable(GL_BLEND);
+	StateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	glUniform1i(app->programUniformTexture, 0);
-	glActiveTexture(GL_TEXTURE0);
+	glUniform2fv(app->programUniformUvScale, 1, &uvScale[0]);
+	StateActiveTexture(GL_TEXTURE0);
 
-	glBindTexture(GL_TEXTURE_2D, textureHandle);
+	StateBindTexture(GL_TEXTURE_2D, textureHandle);
 
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-
-	glBindVertexArray(0);
-	glUseProgram(0);
 }
 
-void RenderMeshes(App* app, Program& renderProgram)
+//Decodes the normals or reconstructs the positions of the G-buffer on the screen quad
+void RenderGBufferDebug(App* app)
 {
+	StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	StateDepthMask(GL_TRUE);
 	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glEnable(GL_DEPTH_TEST);
-	glUseProgram(renderProgram.handle);
+	StateViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+	Program& program = app->programs[app->gBufferDebugProgramIdx];
+	StateUseProgram(program.handle);
+	StateBindVertexArray(app->targetQuad_vao);
+
+	StateEnable(GL_BLEND);
+	StateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glUniform1i(app->gBufferDebug_depthTexture, 0);
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
 
-	glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize); //Harcoded at 0 bc it is at the beginning
+	glUniform1i(app->gBufferDebug_normalTexture, 1);
+	StateActiveTexture(GL_TEXTURE1);
+	StateBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
 
-	glActiveTexture(GL_TEXTURE0);
+	mat4 inverseViewProjection = glm::inverse(app->viewProjection);
+	glUniformMatrix4fv(app->gBufferDebug_inverseViewProjection, 1, GL_FALSE, &inverseViewProjection[0][0]);
+	glUniform1i(app->gBufferDebug_view, app->renderTexMode == RendTexMode_Position ? 1 : 0);
+
+	vec2 uvScale = GetRenderTargetUvScale(app);
+	glUniform2fv(app->gBufferDebug_uvScale, 1, &uvScale[0]);
+
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+}
+
+//The first mesh pass of the frame gathers the draws, a G-buffer pass after a depth pre-pass reuses them
+static bool IsFirstMeshPass(App* app, MeshPass pass)
+{
+	return pass == MeshPass_DepthOnly || !app->depthPrePass.activeThisFrame;
+}
+
+//Clears the target and binds what every mesh draw shares
+static void BeginMeshPass(App* app, Program& renderProgram, GLuint cubeTextureLocation, MeshPass pass)
+{
+	if (IsFirstMeshPass(app, pass))
+		app->meshDrawCalls = 0;
+
+	StateEnable(GL_DEPTH_TEST);
+	StateUseProgram(renderProgram.handle);
+
+	//Set before the clears, they are masked too
+	StateDepthFunc(GL_LESS);
+	StateDepthMask(GL_TRUE);
+
+	if (pass == MeshPass_DepthOnly)
+	{
+		glClear(GL_DEPTH_BUFFER_BIT);
+		StateColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		return;
+	}
+
+	StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+
+	//The depth is already final, only the closest fragment of each pixel passes
+	if (app->depthPrePass.activeThisFrame)
+	{
+		glClear(GL_COLOR_BUFFER_BIT);
+		StateDepthFunc(GL_EQUAL);
+		StateDepthMask(GL_FALSE);
+	}
+	else
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+
+	StateBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize); //Harcoded at 0 bc it is at the beginning
+
+	StateActiveTexture(GL_TEXTURE0);
 	switch (app->currentSkybox)
 	{
-	case 0:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
-	case 1:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->langholmenSkyboxTexIdx); break;
-	case 2:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->SFParkSkyboxTexIdx); break;
-	case 3:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->bikiniBottomSkyboxTexIdx); break;
-	case 4:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->hornstullsStrandSkyboxTexIdx); break;
-	case 5:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->pondSkyboxTexIdx); break;
-	case 6:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->powerLinesSkyboxTexIdx); break;
-	case 7:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->swedishRoyalCastleSkyboxTexIdx); break;
-	case 8:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->yokohamaSkyboxTexIdx); break;
-	default:	glBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
+	case 0:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
+	case 1:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->langholmenSkyboxTexIdx); break;
+	case 2:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->SFParkSkyboxTexIdx); break;
+	case 3:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->bikiniBottomSkyboxTexIdx); break;
+	case 4:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->hornstullsStrandSkyboxTexIdx); break;
+	case 5:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->pondSkyboxTexIdx); break;
+	case 6:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->powerLinesSkyboxTexIdx); break;
+	case 7:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->swedishRoyalCastleSkyboxTexIdx); break;
+	case 8:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->yokohamaSkyboxTexIdx); break;
+	default:	StateBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
 	}
-	glUniform1i(app->renderTexturesProgram_cubeTexture, 0);
+	glUniform1i(cubeTextureLocation, 0);
+}
+
+static void EndMeshPass()
+{
+	StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	StateDepthFunc(GL_LESS);
+	StateDepthMask(GL_TRUE);
+
+	StateDisable(GL_DEPTH_TEST);
+}
+
+void RenderMeshes(App* app, u32 renderProgramIdx, MeshPass pass)
+{
+	Program& renderProgram = app->programs[renderProgramIdx];
+	BeginMeshPass(app, renderProgram, app->renderTexturesProgram_cubeTexture, pass);
+
+	// Fill the queue -------------------------------------------------------------------------------------------------
+	RenderQueue& queue = app->renderQueue;
+	ClearRenderQueue(queue);
 
-	for (Entity& entity : app->entityList)
+	const Camera& cam = app->camera;
+	const vec3 cameraPosition = vec3(cam.transformation[3]);
+	const vec3 cameraForward = -vec3(cam.transformation[2]);
+
+	for (u32 entityIdx : app->visibleEntities)
 	{
+		Entity& entity = app->entityList[entityIdx];
 		Model& model = app->models[entity.model];
 		Mesh& mesh = app->meshes[model.meshIdx];
 
-		glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->uniformsBuffer.handle, entity.head, entity.size);
+		//View depth of the entity origin, normalized to the clip range
+		f32 viewDepth = glm::dot(vec3(entity.transformationMatrix[3]) - cameraPosition, cameraForward);
+		f32 depth = (viewDepth - cam.znear) / (cam.zfar - cam.znear);
 
 		for (u32 i = 0; i < mesh.submeshes.size(); ++i)
 		{
-			GLuint vao = FindVAO(mesh, i, renderProgram);
-			glBindVertexArray(vao);
+			const Submesh& submesh = mesh.submeshes[i];
+
+			//Culled, or still waiting in the staging ring
+			if (!IsSubmeshVisible(entity, i) || submesh.uploadTicket > app->stagingRing.issuedTicket)
+				continue;
+
+			RenderQueueItem item = {};
+			item.programIdx = renderProgramIdx;
+			item.vao = FindVAO(app->geometryHeap, submesh.vertexBufferLayout, renderProgram);
+			item.materialIdx = model.materialIdx[i];
+			item.entityIdx = entityIdx;
+			item.submesh = &submesh;
+
+			PushToRenderQueue(queue, MakeSortKey(QueuePass_Opaque, item.programIdx, item.vao, item.materialIdx, depth), item);
+		}
+	}
+
+	SortRenderQueue(queue);
+
+	// Submit, only touching the state that differs from the previous draw --------------------------------------------
+	const bool bindMaterials = pass != MeshPass_DepthOnly;
+	if (bindMaterials)
+	{
+		StateActiveTexture(GL_TEXTURE1);
+		glUniform1i(app->renderTexturesProgram_uTexture, 1);
+	}
+
+	GLuint boundVao = 0;
+	u32 boundMaterialIdx = UINT32_MAX;
+	u32 boundEntityIdx = UINT32_MAX;
+
+	for (const RenderQueueEntry& entry : queue.entries)
+	{
+		const RenderQueueItem& item = queue.items[entry.itemIdx];
 
-			u32 submeshMaterialIdx = model.materialIdx[i];
-			Material& submeshMaterial = app->materials[submeshMaterialIdx];
+		if (item.vao != boundVao)
+		{
+			StateBindVertexArray(item.vao);
+			boundVao = item.vao;
+		}
 
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-			glUniform1i(app->renderTexturesProgram_uTexture, 1);
+		if (bindMaterials && item.materialIdx != boundMaterialIdx)
+		{
+			Material& material = app->materials[item.materialIdx];
+			StateBindTexture(GL_TEXTURE_2D, app->textures[material.albedoTextureIdx].handle);
+			boundMaterialIdx = item.materialIdx;
+		}
 
-			Submesh& submesh = mesh.submeshes[i];
-			glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+		if (item.entityIdx != boundEntityIdx)
+		{
+			Entity& entity = app->entityList[item.entityIdx];
+			StateBindBufferRange(GL_UNIFORM_BUFFER, 1, app->uniformsBuffer.handle, entity.head, entity.size);
+			boundEntityIdx = item.entityIdx;
 		}
+
+		const Submesh& submesh = *item.submesh;
+		glDrawElementsBaseVertex(GL_TRIANGLES, submesh.indexCount, GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), submesh.baseVertex);
+		app->meshDrawCalls++;
 	}
 
-	glDisable(GL_DEPTH_TEST);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	EndMeshPass();
 }
 
-void DeferredLightingPass(App* app)
+//Collects one draw per submesh of every entity, sorted so identical submeshes end up next to each other.
+//Returns the number of draws.
+static u32 CollectMeshDraws(App* app, Program& renderProgram)
 {
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	std::vector<IndirectDraw>& draws = app->indirectDraws;
+	draws.clear();
 
-	Program& shadingPassProgram = app->programs[app->deferredLightingProgramIdx];
-	glUseProgram(shadingPassProgram.handle);
-	glBindVertexArray(app->targetQuad_vao);
+	for (u32 entityIdx : app->visibleEntities)
+	{
+		const Entity& entity = app->entityList[entityIdx];
+		Model& model = app->models[entity.model];
+		Mesh& mesh = app->meshes[model.meshIdx];
 
-	//Bind buffer for global params
-	glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize); //Harcoded at 0 bc it is at the beginning
+		for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+		{
+			const Submesh& submesh = mesh.submeshes[i];
 
-	glUniform1i(app->deferredLightingPass_posTexture, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+			if (!IsSubmeshVisible(entity, i) || submesh.uploadTicket > app->stagingRing.issuedTicket)
+				continue;
 
-	glUniform1i(app->deferredLightingPass_normalTexture, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+			IndirectDraw draw = {};
+			draw.vao = FindVAO(app->geometryHeap, submesh.vertexBufferLayout, renderProgram);
+			draw.materialIdx = model.materialIdx[i];
+			draw.entityIdx = entityIdx;
+			draw.submesh = &submesh;
+			draws.push_back(draw);
+		}
+	}
 
-	glUniform1i(app->deferredLightingPass_albedoTexture, 2);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+	std::sort(draws.begin(), draws.end(), [](const IndirectDraw& a, const IndirectDraw& b)
+	{
+		if (a.vao != b.vao) return a.vao < b.vao;
+		if (a.materialIdx != b.materialIdx) return a.materialIdx < b.materialIdx;
+		if (a.submesh != b.submesh) return a.submesh < b.submesh;
+		return a.entityIdx < b.entityIdx;
+	});
 
-	//glDrawBuffer(GL_COLOR_ATTACHMENT3); //Deferred
+	return glm::min((u32)draws.size(), (u32)MAX_INSTANCES);
+}
 
-	GLuint drawBuffers[] = { GL_COLOR_ATTACHMENT3, // Deferred
-								 GL_COLOR_ATTACHMENT4 }; // Bright colors
-	glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+//Same as CollectMeshDraws, and uploads the entity of each draw to the instance index buffer
+static u32 GatherMeshDraws(App* app, Program& renderProgram)
+{
+	const std::vector<IndirectDraw>& draws = app->indirectDraws;
+	u32 drawCount = CollectMeshDraws(app, renderProgram);
 
-	//glUniform1i(app->deferredLightingPass_brightColors, 4);
-	//glActiveTexture(GL_TEXTURE4);
-	//glBindTexture(GL_TEXTURE_2D, app->brightColorsAttachmentHandle);
+	app->instanceIndices.resize(drawCount);
+	for (u32 i = 0; i < drawCount; ++i)
+	{
+		app->instanceIndices[i] = app->entityList[draws[i].entityIdx].instanceIdx;
+	}
 
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	//Orphan the buffer so the previous frame can still read the old contents
+	Buffer& instanceIndices = app->geometryHeap.instanceIndices;
+	StateBindBuffer(GL_ARRAY_BUFFER, instanceIndices.handle);
+	glBufferData(GL_ARRAY_BUFFER, instanceIndices.size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, drawCount * sizeof(u32), app->instanceIndices.data());
 
-	//glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return drawCount;
 }
 
-void RenderLightGizmos(App* app)
+//Program of the indirect paths, the depth only one reads the same instance params
+static Program& GetIndirectPassProgram(App* app, MeshPass pass)
 {
-	Program& lightsVisProgram = app->programs[app->lightVisualizationProgramIdx];
-	glUseProgram(lightsVisProgram.handle);
+	return app->programs[pass == MeshPass_DepthOnly ? app->depthPrePass.indirectProgramIdx : app->renderTexturesIndirectProgramIdx];
+}
 
-	glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize); //Harcoded at 0 bc it is at the beginning
+void RenderMeshesIndirect(App* app, MeshPass pass)
+{
+	Program& renderProgram = GetIndirectPassProgram(app, pass);
+	BeginMeshPass(app, renderProgram, app->renderTexturesIndirectProgram_cubeTexture, pass);
+
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, app->instanceParamsBuffer.handle);
 
-	for (u32 i = 0; i < app->lightList.size(); ++i)
+	const std::vector<IndirectDraw>& draws = app->indirectDraws;
+
+	// Build the commands ---------------------------------------------------------------------------------------------
+	if (IsFirstMeshPass(app, pass))
 	{
-		Light currentLight = app->lightList[i];
+		//The vaos only link attributes by location, so the ones of the G-buffer program also serve the depth program
+		u32 drawCount = GatherMeshDraws(app, app->programs[app->renderTexturesIndirectProgramIdx]);
+
+		app->indirectCommands.resize(drawCount);
 
-		//Binding and unbinding for each entity is not the most efficient (not batching), but will do
-		GLsizei indexAmount;
-		if (currentLight.type == LightType_Directional)
+		for (u32 i = 0; i < drawCount; ++i)
 		{
-			glBindVertexArray(app->cube_vao);
-			indexAmount = 36;
+			const Submesh& submesh = *draws[i].submesh;
+
+			//baseInstance picks the slot of the instance index buffer, which holds the entity to read in the shader
+			DrawElementsIndirectCommand& command = app->indirectCommands[i];
+			command.count = submesh.indexCount;
+			command.instanceCount = 1;
+			command.firstIndex = submesh.firstIndex;
+			command.baseVertex = submesh.baseVertex;
+			command.baseInstance = i;
 		}
-		else if (currentLight.type == LightType_Point)
+
+		u32 commandsSize = drawCount * sizeof(DrawElementsIndirectCommand);
+		app->indirectBuffer.size = glm::max(app->indirectBuffer.size, commandsSize);
+		StateBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.handle);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.size, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commandsSize, app->indirectCommands.data());
+	}
+
+	const u32 drawCount = (u32)app->indirectCommands.size();
+	StateBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.handle);
+
+	// Submit one call per vao and material ---------------------------------------------------------------------------
+	const bool bindMaterials = pass != MeshPass_DepthOnly;
+	if (bindMaterials)
+	{
+		StateActiveTexture(GL_TEXTURE1);
+		glUniform1i(app->renderTexturesIndirectProgram_uTexture, 1);
+	}
+
+	u32 first = 0;
+	while (first < drawCount)
+	{
+		u32 last = first + 1;
+		while (last < drawCount && draws[last].vao == draws[first].vao && draws[last].materialIdx == draws[first].materialIdx)
+			++last;
+
+		StateBindVertexArray(draws[first].vao);
+
+		if (bindMaterials)
 		{
-			glBindVertexArray(app->sphere_vao);
-			indexAmount = 144;
+			Material& material = app->materials[draws[first].materialIdx];
+			StateBindTexture(GL_TEXTURE_2D, app->textures[material.albedoTextureIdx].handle);
 		}
 
-		glUniform3f(0, currentLight.color.x, currentLight.color.y, currentLight.color.z); //First param is 0 bc it is the only uniform in the shader
-		glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->lightMatricesBuffer.handle, i * app->uniformBlockAlignment, app->uniformBlockAlignment);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)(first * sizeof(DrawElementsIndirectCommand)), last - first, 0);
+		app->meshDrawCalls++;
 
-		glDrawElements(GL_TRIANGLES, indexAmount, GL_UNSIGNED_SHORT, 0);
-		glBindVertexArray(0);
+		first = last;
 	}
 
-	glUseProgram(0);
+	EndMeshPass();
 }
 
-void RenderSkybox(App* app)
+void RenderMeshesInstanced(App* app, MeshPass pass)
 {
-	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-
-	Program& skyboxProgram = app->programs[app->skyboxProgramIdx];
-	glUseProgram(skyboxProgram.handle);
+	Program& renderProgram = GetIndirectPassProgram(app, pass);
+	BeginMeshPass(app, renderProgram, app->renderTexturesIndirectProgram_cubeTexture, pass);
 
-	glUniformMatrix4fv(app->skybox_uMatrix, 1, GL_FALSE, glm::value_ptr(app->skyboxViewProjection));
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, app->instanceParamsBuffer.handle);
 
-	glBindVertexArray(app->skybox_vao);
-	GLsizei indexAmount = 36;
+	const std::vector<IndirectDraw>& draws = app->indirectDraws;
+	if (IsFirstMeshPass(app, pass))
+		GatherMeshDraws(app, app->programs[app->renderTexturesIndirectProgramIdx]);
 
-	glUniform1i(app->skybox_uTexture, 0);
-	glActiveTexture(GL_TEXTURE0);
+	const u32 drawCount = (u32)app->instanceIndices.size();
 
-	switch (app->currentSkybox)
+	const bool bindMaterials = pass != MeshPass_DepthOnly;
+	if (bindMaterials)
 	{
-		case 0:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
-		case 1:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->langholmenSkyboxTexIdx); break;
-		case 2:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->SFParkSkyboxTexIdx); break;
-		case 3:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->bikiniBottomSkyboxTexIdx); break;
-		case 4:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->hornstullsStrandSkyboxTexIdx); break;
-		case 5:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->pondSkyboxTexIdx); break;
-		case 6:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->powerLinesSkyboxTexIdx); break;
-		case 7:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->swedishRoyalCastleSkyboxTexIdx); break;
-		case 8:		glBindTexture(GL_TEXTURE_CUBE_MAP, app->yokohamaSkyboxTexIdx); break;
-		default:	glBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
+		StateActiveTexture(GL_TEXTURE1);
+		glUniform1i(app->renderTexturesIndirectProgram_uTexture, 1);
 	}
 
-	glDrawElements(GL_TRIANGLES, indexAmount, GL_UNSIGNED_SHORT, 0);
+	GLuint boundVao = 0;
+	u32 boundMaterialIdx = UINT32_MAX;
+
+	//Every entity drawing the same submesh with the same material is one instance of a single draw
+	u32 first = 0;
+	while (first < drawCount)
+	{
+		u32 last = first + 1;
+		while (last < drawCount && draws[last].submesh == draws[first].submesh && draws[last].materialIdx == draws[first].materialIdx)
+			++last;
+
+		const IndirectDraw& draw = draws[first];
+
+		if (draw.vao != boundVao)
+		{
+			StateBindVertexArray(draw.vao);
+			boundVao = draw.vao;
+		}
+
+		if (bindMaterials && draw.materialIdx != boundMaterialIdx)
+		{
+			Material& material = app->materials[draw.materialIdx];
+			StateBindTexture(GL_TEXTURE_2D, app->textures[material.albedoTextureIdx].handle);
+			boundMaterialIdx = draw.materialIdx;
+		}
+
+		const Submesh& submesh = *draw.submesh;
+		glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, submesh.indexCount, GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), last - first, submesh.baseVertex, first);
+		app->meshDrawCalls++;
+
+		first = last;
+	}
 
-	glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	EndMeshPass();
 }
 
-void RenderBloom(App* app) 
+void RenderMeshesGpuCulled(App* app, MeshPass pass)
 {
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	Program& renderProgram = GetIndirectPassProgram(app, pass);
+
+	const std::vector<IndirectDraw>& draws = app->indirectDraws;
+
+	//Runs before the pass starts since it switches to the compute program
+	if (IsFirstMeshPass(app, pass))
+	{
+		u32 drawCount = CollectMeshDraws(app, app->programs[app->renderTexturesIndirectProgramIdx]);
+		CullDrawsOnGpu(app, drawCount);
+	}
 
-	Program& blurProgram = app->programs[app->blurPassProgramIdx];
-	glUseProgram(blurProgram.handle);
-	glBindVertexArray(app->targetQuad_vao);
+	const u32 commandCount = (u32)app->indirectCommands.size();
+	const std::vector<u32>& commandDraws = app->gpuCuller.commandDraws;
 
-	//Send float and int uniforms
-	glUniform1f(app->bloomStrengthLocation, app->bloomStrength);
-	glUniform1i(app->bloomIterationsLocation, app->bloomIterations);
+	BeginMeshPass(app, renderProgram, app->renderTexturesIndirectProgram_cubeTexture, pass);
 
-	for (int i = 0; i < 10; i++)
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, app->instanceParamsBuffer.handle);
+	StateBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.handle);
+
+	const bool bindMaterials = pass != MeshPass_DepthOnly;
+	if (bindMaterials)
 	{
-		if (i < 5)
-		{
-			glUniform1i(app->bloom_brightColorImage, 0);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, app->brightColorsAttachmentHandle);
+		StateActiveTexture(GL_TEXTURE1);
+		glUniform1i(app->renderTexturesIndirectProgram_uTexture, 1);
+	}
 
-			glUniform1i(app->bloom_horizontalLocation, 1); //True
+	//One call per vao and material, the culled commands are still submitted but draw no instances
+	u32 first = 0;
+	while (first < commandCount)
+	{
+		const IndirectDraw& draw = draws[commandDraws[first]];
 
-			glDrawBuffer(GL_COLOR_ATTACHMENT5);
-		}
-		else
-		{
-			glUniform1i(app->bloom_brightColorImage, 0);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, app->halfBlurredColorsAttachmentHandle);
+		u32 last = first + 1;
+		while (last < commandCount && draws[commandDraws[last]].vao == draw.vao && draws[commandDraws[last]].materialIdx == draw.materialIdx)
+			++last;
 
-			glUniform1i(app->bloom_horizontalLocation, 0); //False
+		StateBindVertexArray(draw.vao);
 
-			glDrawBuffer(GL_COLOR_ATTACHMENT6);
+		if (bindMaterials)
+		{
+			Material& material = app->materials[draw.materialIdx];
+			StateBindTexture(GL_TEXTURE_2D, app->textures[material.albedoTextureIdx].handle);
 		}
-		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)(first * sizeof(DrawElementsIndirectCommand)), last - first, 0);
+		app->meshDrawCalls++;
+
+		first = last;
 	}
 
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-	glUseProgram(0);
+	EndMeshPass();
+}
+
+void DrawFullScreenLighting(App* app, bool directionalOnly)
+{
+	ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+	StateViewport(0, 0, viewportSize.x, viewportSize.y);
 
-	//--------------------------------------------------------------------------------------------------------------------
+	Program& shadingPassProgram = app->programs[app->deferredLightingProgramIdx];
+	StateUseProgram(shadingPassProgram.handle);
+	StateBindVertexArray(app->targetQuad_vao);
 
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	//Bind buffer for global params
+	StateBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize); //Harcoded at 0 bc it is at the beginning
 
-	Program& bloomMixProgram = app->programs[app->bloomMixProgramIdx];
-	glUseProgram(bloomMixProgram.handle);
-	//glBindVertexArray(app->targetQuad_vao);
+	//The position is reconstructed from the depth
+	glUniform1i(app->deferredLightingPass_depthTexture, 0);
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
 
-	glUniform1i(app->bloom_blurredImage, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, app->blurredColorsAttachmentHandle);
+	mat4 inverseViewProjection = glm::inverse(app->viewProjection);
+	glUniformMatrix4fv(app->deferredLightingPass_inverseViewProjection, 1, GL_FALSE, &inverseViewProjection[0][0]);
 
-	glUniform1i(app->bloom_originalImage, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, app->deferredAttachmentHandle);
+	vec2 uvScale = GetRenderTargetUvScale(app);
+	glUniform2fv(app->deferredLightingPass_uvScale, 1, &uvScale[0]);
+	glUniform1i(app->deferredLightingPass_directionalOnly, directionalOnly);
 
+	glUniform1i(app->deferredLightingPass_normalTexture, 1);
+	StateActiveTexture(GL_TEXTURE1);
+	StateBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
 
-	glDrawBuffer(GL_COLOR_ATTACHMENT7);
+	glUniform1i(app->deferredLightingPass_albedoTexture, 2);
+	StateActiveTexture(GL_TEXTURE2);
+	StateBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
 
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-	glUseProgram(0);
+}
+
+void DeferredLightingPass(App* app)
+{
+	BeginLightingTimer(app);
+	DrawFullScreenLighting(app, false);
+	EndLightingTimer(app);
+}
+
+void RenderLightGizmos(App* app)
+{
+	const LightGizmos& gizmos = app->lightGizmos;
+	if (gizmos.directionalCount + gizmos.pointCount == 0)
+		return;
+
+	Program& lightsVisProgram = app->programs[app->lightVisualizationProgramIdx];
+	StateUseProgram(lightsVisProgram.handle);
+
+	glUniformMatrix4fv(gizmos.viewProjectionLocation, 1, GL_FALSE, glm::value_ptr(app->viewProjection));
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_GIZMOS_BUFFER_BINDING, gizmos.instances.handle);
+
+	//The instance index doesn't include the base instance, each draw is told where its range starts
+	if (gizmos.directionalCount > 0)
+	{
+		StateBindVertexArray(app->cube_vao);
+		glUniform1ui(gizmos.firstInstanceLocation, 0);
+		glDrawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0, gizmos.directionalCount);
+	}
+
+	if (gizmos.pointCount > 0)
+	{
+		StateBindVertexArray(app->sphere_vao);
+		glUniform1ui(gizmos.firstInstanceLocation, gizmos.directionalCount);
+		glDrawElementsInstanced(GL_TRIANGLES, 144, GL_UNSIGNED_SHORT, 0, gizmos.pointCount);
+	}
+}
+
+//Full screen triangle at the far plane, drawn after the opaque geometry so early-Z rejects every covered pixel
+void RenderSkybox(App* app)
+{
+	StateEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+	//The sky is exactly at the cleared depth, and doesn't need to write it
+	StateDepthFunc(GL_LEQUAL);
+	StateDepthMask(GL_FALSE);
+
+	Program& skyboxProgram = app->programs[app->skyboxProgramIdx];
+	StateUseProgram(skyboxProgram.handle);
+
+	glUniformMatrix4fv(app->skybox_uInverseViewProjection, 1, GL_FALSE, glm::value_ptr(app->skyboxInverseViewProjection));
+
+	StateBindVertexArray(app->fullScreenTriangle_vao);
+
+	glUniform1i(app->skybox_uTexture, 0);
+	StateActiveTexture(GL_TEXTURE0);
+
+	switch (app->currentSkybox)
+	{
+		case 0:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
+		case 1:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->langholmenSkyboxTexIdx); break;
+		case 2:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->SFParkSkyboxTexIdx); break;
+		case 3:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->bikiniBottomSkyboxTexIdx); break;
+		case 4:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->hornstullsStrandSkyboxTexIdx); break;
+		case 5:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->pondSkyboxTexIdx); break;
+		case 6:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->powerLinesSkyboxTexIdx); break;
+		case 7:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->swedishRoyalCastleSkyboxTexIdx); break;
+		case 8:		StateBindTexture(GL_TEXTURE_CUBE_MAP, app->yokohamaSkyboxTexIdx); break;
+		default:	StateBindTexture(GL_TEXTURE_CUBE_MAP, app->meadowSkyboxTexIdx); break;
+	}
 
+	glDrawArrays(GL_TRIANGLES, 0, 3);
 
-	glBindVertexArray(0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	StateDepthFunc(GL_LESS);
+	StateDepthMask(GL_TRUE);
+
+	StateDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 }
 
-void PostRenderPass(App* app)
+//Adds the bloom to the lit scene, tone maps it and applies the gamma, straight to the backbuffer.
+//Every pixel is written so there is nothing to clear, and nothing to blend.
+void CompositePass(App* app)
 {
-	glEnable(GL_DEPTH_TEST);
+	StateViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	StateDisable(GL_DEPTH_TEST);
+	StateDisable(GL_BLEND);
+
+	vec2 uvScale = GetRenderTargetUvScale(app);
+
+	Program& compositeProgram = app->programs[app->compositeProgramIdx];
+	StateUseProgram(compositeProgram.handle);
+	StateBindVertexArray(app->fullScreenTriangle_vao);
+	glUniform2fv(app->composite_uvScale, 1, &uvScale[0]);
+
+	//Level 0 holds the sum of every level of the chain
+	glUniform1f(app->composite_bloomIntensity, app->bloom.intensity / (f32)glm::max(app->bloom.usedLevels, 1u));
+
+	glUniform1i(app->composite_litImage, 0);
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->deferredAttachmentHandle);
 
-	//Then we copy the G-Buffer depth to the default depth buffer to render the cubes as if their depth was the scene's.
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, app->deferredFrameBufferHandle);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0); // write to default framebuffer
-	glBlitFramebuffer(0, 0, app->displaySize.x, app->displaySize.y,
-		0, 0, app->displaySize.x, app->displaySize.y,
-		GL_DEPTH_BUFFER_BIT, GL_NEAREST
-	);
+	glUniform1i(app->composite_bloomImage, 1);
+	StateActiveTexture(GL_TEXTURE1);
+	StateBindTexture(GL_TEXTURE_2D, app->bloomAttachmentHandle);
 
-	//We "bind" the default frame buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	//One triangle over the whole screen, no diagonal seam to shade twice
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+//Draws the gizmos and the skybox in the bound offscreen target, tested against the depth of the scene attached to it.
+//Being drawn before the composite, the sky gets the bloom and the tone mapping too.
+void SkyAndGizmosPass(App* app)
+{
+	ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+	StateViewport(0, 0, viewportSize.x, viewportSize.y);
 
-	//And then we proceed as usual
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	StateDisable(GL_BLEND);
+	StateEnable(GL_DEPTH_TEST);
 
+	//Gizmos first, the sky is then skipped behind them too
 	RenderLightGizmos(app);
 	RenderSkybox(app);
 
-	glDisable(GL_DEPTH_TEST);
+	StateDisable(GL_DEPTH_TEST);
+}
+
+static void RenderMeshStage(App* app, MeshPass pass)
+{
+	switch (app->submissionMode)
+	{
+	case SubmissionMode_MultiDrawIndirect: RenderMeshesIndirect(app, pass); break;
+	case SubmissionMode_Instanced:         RenderMeshesInstanced(app, pass); break;
+	case SubmissionMode_GPUCulled:         RenderMeshesGpuCulled(app, pass); break;
+	default:                               RenderMeshes(app, pass == MeshPass_DepthOnly ? app->depthPrePass.programIdx : app->renderTexturesProgramIdx, pass); break;
+	}
+}
+
+//Results of the last frame that used the queries of this frame, kept as they are until the GPU is done with them
+static void ReadDepthPrePassTimers(App* app)
+{
+	DepthPrePass& prePass = app->depthPrePass;
+	const u32 frame = prePass.timerFrame;
+
+	if (!prePass.timerIssued[frame][MeshPass_GBuffer])
+		return;
+
+	GLint available = 0;
+	glGetQueryObjectiv(prePass.timerQueries[frame][MeshPass_GBuffer], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint64 gBufferNs = 0;
+	GLuint64 prePassNs = 0;
+	glGetQueryObjectui64v(prePass.timerQueries[frame][MeshPass_GBuffer], GL_QUERY_RESULT, &gBufferNs);
+
+	const bool hadPrePass = prePass.timerIssued[frame][MeshPass_DepthOnly];
+	if (hadPrePass)
+		glGetQueryObjectui64v(prePass.timerQueries[frame][MeshPass_DepthOnly], GL_QUERY_RESULT, &prePassNs);
+
+	prePass.timerIssued[frame][MeshPass_GBuffer] = false;
+	prePass.timerIssued[frame][MeshPass_DepthOnly] = false;
+
+	prePass.gBufferMs = gBufferNs / 1000000.0f;
+	prePass.prePassMs = prePassNs / 1000000.0f;
+
+	f32& totalMs = prePass.totalMs[hadPrePass];
+	f32 frameMs = prePass.gBufferMs + prePass.prePassMs;
+	totalMs = totalMs > 0.0f ? glm::mix(totalMs, frameMs, 0.05f) : frameMs;
+}
+
+//Mesh stage of the deferred path, with the optional depth pre-pass
+static void RenderGBufferPass(App* app)
+{
+	ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+	StateViewport(0, 0, viewportSize.x, viewportSize.y);
+
+	DepthPrePass& prePass = app->depthPrePass;
+	prePass.activeThisFrame = prePass.enabled;
+
+	ReadDepthPrePassTimers(app);
+
+	if (prePass.activeThisFrame)
+	{
+		glBeginQuery(GL_TIME_ELAPSED, prePass.timerQueries[prePass.timerFrame][MeshPass_DepthOnly]);
+		RenderMeshStage(app, MeshPass_DepthOnly);
+		glEndQuery(GL_TIME_ELAPSED);
+		prePass.timerIssued[prePass.timerFrame][MeshPass_DepthOnly] = true;
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, prePass.timerQueries[prePass.timerFrame][MeshPass_GBuffer]);
+	RenderMeshStage(app, MeshPass_GBuffer);
+	glEndQuery(GL_TIME_ELAPSED);
+	prePass.timerIssued[prePass.timerFrame][MeshPass_GBuffer] = true;
+
+	prePass.timerFrame = (prePass.timerFrame + 1) % DEPTH_PREPASS_TIMER_FRAMES;
+}
+
+//Shows the selected render texture on the backbuffer
+static void PresentRenderTexture(App* app)
+{
+	GLuint textureHandle = 0;
+	switch (app->renderTexMode)
+	{
+	case RendTexMode_Albedo:   textureHandle = app->albedoAttachmentHandle; break;
+	case RendTexMode_Depth:    textureHandle = app->depthAttachmentHandle; break;
+	case RendTexMode_DeferredOnly: textureHandle = app->deferredAttachmentHandle; break;
+	default: break;
+	}
+
+	//Normals and positions are packed, they go through a decoding shader
+	if (app->renderTexMode == RendTexMode_Normals || app->renderTexMode == RendTexMode_Position)
+		RenderGBufferDebug(app);
+	else
+		RenderToQuad(app, textureHandle, GetRenderTargetUvScale(app));
 }
 
 void Render(App* app)
 {
+	UpdateFrameBufferResize(app);
+	TrimRenderGraph(app->renderGraph);
+	TrimRenderTargetPool(app->renderTargetPool);
+
+	//Only the deferred G-buffer stage has a pre-pass
+	app->depthPrePass.activeThisFrame = false;
+
+	//The depth pyramid is only kept up to date by the GPU culled deferred path
+	if (app->mode != Mode_DeferredRenderTextures || app->submissionMode != SubmissionMode_GPUCulled || !app->hiZ.enabled)
+		app->hiZ.valid = false;
+
 	switch (app->mode)
 	{
 	case Mode_TexturedQuad:
 	{
-		RenderToQuad(app, app->textures[app->diceTexIdx].handle);
+		RenderToQuad(app, app->textures[app->diceTexIdx].handle, vec2(1.0f));
 	}
 	break;
 	case Mode_Meshes:
 	{
-		RenderMeshes(app, app->programs[app->texturedMeshProgramIdx]);
+		StateViewport(0, 0, app->displaySize.x, app->displaySize.y);
+		RenderMeshes(app, app->texturedMeshProgramIdx, MeshPass_GBuffer);
 	}
 	break;
 	case Mode_FrameBuffer:
 	{
 		//Render on this frame buffer render targets
-		glBindFramebuffer(GL_FRAMEBUFFER, app->directFrameBufferHandle);
+		StateBindFramebuffer(GL_FRAMEBUFFER, app->directFrameBufferHandle);
+
+		ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+		StateViewport(0, 0, viewportSize.x, viewportSize.y);
 
 		//Select on which render targets to draw
 		GLuint drawBuffers[] = { app->frameBufferAttachmentHandle };
 		glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
 
-		RenderMeshes(app, app->programs[app->texturedMeshProgramIdx]);
+		RenderMeshes(app, app->texturedMeshProgramIdx, MeshPass_GBuffer);
+		SkyAndGizmosPass(app);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glDisable(GL_DEPTH_TEST);
+		StateBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-		RenderToQuad(app, app->frameBufferAttachmentHandle);
-
-		PostRenderPass(app);
+		RenderToQuad(app, app->frameBufferAttachmentHandle, GetRenderTargetUvScale(app));
 	}
 	break;
 	case Mode_DeferredRenderTextures:
 	{
-		//Render on this frame buffer render targets
-		glBindFramebuffer(GL_FRAMEBUFFER, app->deferredFrameBufferHandle);
+		RenderGraph& graph = app->renderGraph;
+		BeginRenderGraph(graph);
 
-		//Select on which render targets to draw
-		GLuint drawBuffers[] = { GL_COLOR_ATTACHMENT0,      //Albedo
-								 GL_COLOR_ATTACHMENT1,      //Normals
-								 GL_COLOR_ATTACHMENT2 };    //Position
-		glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+		u32 gBuffer = AddRenderGraphPass(graph, "G-buffer", RenderGBufferPass);
+		WriteRenderGraphResource(graph, gBuffer, RenderResource_Albedo);
+		WriteRenderGraphResource(graph, gBuffer, RenderResource_Normals);
+		SetRenderGraphDepth(graph, gBuffer, RenderResource_Depth);
 
-		RenderMeshes(app, app->programs[app->renderTexturesProgramIdx]);
-
-		DeferredLightingPass(app);
+		if (app->submissionMode == SubmissionMode_GPUCulled && app->hiZ.enabled)
+		{
+			//Read by the culling of the next frame
+			u32 hiZ = AddRenderGraphPass(graph, "Hi-Z pyramid", BuildHiZPyramid);
+			ReadRenderGraphResource(graph, hiZ, RenderResource_Depth);
+			SetRenderGraphSideEffects(graph, hiZ);
+		}
 
-		RenderBloom(app);
+		if (app->lightingMode == LightingMode_LightVolumes)
+		{
+			//Tests the light volumes against a copy of the depth, the depth itself is sampled
+			u32 volumes = AddRenderGraphPass(graph, "Light volumes", LightVolumesPass);
+			ReadRenderGraphResource(graph, volumes, RenderResource_Depth);
+			ReadRenderGraphResource(graph, volumes, RenderResource_Normals);
+			ReadRenderGraphResource(graph, volumes, RenderResource_Albedo);
+			WriteRenderGraphResource(graph, volumes, RenderResource_Deferred);
+			SetRenderGraphDepth(graph, volumes, RenderResource_VolumeDepth);
+		}
+		else
+		{
+			u32 lighting = app->lightingMode == LightingMode_Clustered ?
+				AddRenderGraphPass(graph, "Clustered lighting", ClusteredLightingPass) :
+				AddRenderGraphPass(graph, "Lighting", DeferredLightingPass);
+			ReadRenderGraphResource(graph, lighting, RenderResource_Depth);
+			ReadRenderGraphResource(graph, lighting, RenderResource_Normals);
+			ReadRenderGraphResource(graph, lighting, RenderResource_Albedo);
+			WriteRenderGraphResource(graph, lighting, RenderResource_Deferred);
+		}
 
-		GLuint textureHandle = 0;
-		switch (app->renderTexMode)
+		//Only the lit views show them, the G-buffer views keep the raw targets
+		if (app->renderTexMode == RendTexMode_DeferredOnly || app->renderTexMode == RendTexMode_DeferredBloom)
 		{
-		case RendTexMode_Albedo:   textureHandle = app->albedoAttachmentHandle; break;
-		case RendTexMode_Normals:  textureHandle = app->normalsAttachmentHandle; break;
-		case RendTexMode_Position: textureHandle = app->positionAttachmentHandle; break;
-		case RendTexMode_Depth:    textureHandle = app->depthAttachmentHandle; break;
-		case RendTexMode_DeferredOnly: textureHandle = app->deferredAttachmentHandle; break;
-		case RendTexMode_DeferredBloom: textureHandle = app->mixedBlurImage; break;
-		default: break;
+			u32 overlay = AddRenderGraphPass(graph, "Gizmos and skybox", SkyAndGizmosPass);
+			ReadRenderGraphResource(graph, overlay, RenderResource_Deferred);
+			WriteRenderGraphResource(graph, overlay, RenderResource_Deferred);
+			SetRenderGraphDepth(graph, overlay, RenderResource_Depth);
 		}
 
-		RenderToQuad(app, textureHandle);
+		//The lower levels of the chain are owned by the bloom, only its top is a render graph target
+		u32 bloomChain = AddRenderGraphPass(graph, "Bloom", BloomPass);
+		ReadRenderGraphResource(graph, bloomChain, RenderResource_Deferred);
+		WriteRenderGraphResource(graph, bloomChain, RenderResource_Bloom);
+
+		//Only what the selected view shows is kept, the passes before it that nothing else reads are culled
+		if (app->renderTexMode == RendTexMode_DeferredBloom)
+		{
+			u32 composite = AddRenderGraphPass(graph, "Composite", CompositePass);
+			ReadRenderGraphResource(graph, composite, RenderResource_Deferred);
+			ReadRenderGraphResource(graph, composite, RenderResource_Bloom);
+			WriteRenderGraphResource(graph, composite, RenderResource_Backbuffer);
+		}
+		else
+		{
+			u32 present = AddRenderGraphPass(graph, "Present", PresentRenderTexture);
+			switch (app->renderTexMode)
+			{
+			case RendTexMode_Albedo:       ReadRenderGraphResource(graph, present, RenderResource_Albedo); break;
+			case RendTexMode_Normals:      ReadRenderGraphResource(graph, present, RenderResource_Normals); break;
+			case RendTexMode_Position:     ReadRenderGraphResource(graph, present, RenderResource_Depth); break;
+			case RendTexMode_Depth:        ReadRenderGraphResource(graph, present, RenderResource_Depth); break;
+			case RendTexMode_DeferredOnly: ReadRenderGraphResource(graph, present, RenderResource_Deferred); break;
+			default: break;
+			}
+			WriteRenderGraphResource(graph, present, RenderResource_Backbuffer);
+		}
 
-		PostRenderPass(app);
+		CompileRenderGraph(graph);
+		ExecuteRenderGraph(app, graph);
 	}
 	break;
 
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "platform.h"
+#include "std140_layout.h"
 #include <glad/glad.h>
 
 typedef glm::vec2  vec2;
@@ -17,6 +18,16 @@ typedef glm::mat4  mat4;
 
 #pragma region Resource Management
 
+//Buffer
+struct Buffer
+{
+	GLuint handle;
+	GLenum type;
+	u32 size;
+	u32 head;
+	void* data; //mapped data
+};
+
 struct Image
 {
 	void* pixels;
@@ -62,10 +73,126 @@ struct VertexShaderLayout
 	std::vector<VertexShaderAttribute> attributes;
 };
 
+//Vaos are shared by every submesh with the same vertex format, they all live in the geometry heap
 struct Vao
 {
 	GLuint handle;
 	GLuint programHandle;
+	VertexBufferLayout vertexBufferLayout;
+};
+
+//Geometry heap
+#define HEAP_NULL_BLOCK UINT32_MAX
+#define HEAP_SL_LOG2    4
+#define HEAP_SL_COUNT   (1 << HEAP_SL_LOG2)
+#define HEAP_FL_COUNT   32
+
+struct HeapBlock
+{
+	u32 offset;
+	u32 size;
+	u32 alignment;
+	u32 prevPhysical;
+	u32 nextPhysical;
+	u32 prevFree;
+	u32 nextFree;
+	bool isFree;
+};
+
+//TLSF allocator, it only keeps the bookkeeping, the memory itself is a GL buffer
+struct HeapAllocator
+{
+	u32 capacity;
+	u32 usedBytes;
+
+	std::vector<HeapBlock> blocks;
+	std::vector<u32> unusedBlocks;
+	u32 firstBlock;
+	u32 lastBlock;
+
+	u32 flBitmap;
+	u32 slBitmap[HEAP_FL_COUNT];
+	u32 freeLists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+};
+
+struct HeapAllocation
+{
+	u32 block;
+	u32 offset;
+	u32 size;
+};
+
+struct HeapMove
+{
+	u32 srcOffset;
+	u32 dstOffset;
+	u32 size;
+};
+
+struct GpuHeap
+{
+	Buffer buffer;
+	HeapAllocator allocator;
+};
+
+//Staging ring
+struct StagingCopy
+{
+	u32 srcOffset;
+	u32 size;
+	u32 ringBytes; //size plus the bytes skipped at the end of the ring when it wrapped
+	const Buffer* dst;
+	u32 dstOffset;
+	u64 ticket;
+	bool ready;
+};
+
+struct StagingFence
+{
+	GLsync fence;
+	u32 releasedBytes;
+	u32 tail;
+	u64 ticket; //of the last copy before the fence
+};
+
+//Mapped buffer the loader (or a worker thread) writes into, the GPU then copies it to the final buffers
+struct StagingRing
+{
+	Buffer buffer;
+	u8* mapped;
+
+	u32 head;
+	u32 tail;
+	u32 usedBytes;
+	u32 bytesPerFrame;
+	u32 bytesCopiedLastFlush;
+
+	std::deque<StagingCopy> pendingCopies;
+	std::deque<StagingFence> fences;
+	u32 pendingWrites;
+
+	u64 nextTicket;
+	u64 issuedTicket;
+	u64 retiredTicket; //the copies up to this one are done on the GPU
+
+	std::mutex mutex;
+};
+
+//Vertex input of the indirect/instanced shaders, fetched once per instance (baseInstance + gl_InstanceID)
+#define INSTANCE_INDEX_LOCATION 5
+#define MAX_INSTANCES 65536
+
+struct GeometryHeap
+{
+	GpuHeap vertices;
+	GpuHeap indices;
+	std::vector<Vao> vaos;
+
+	//Per instance attribute linked in every vao, holds the index of the instance data to read
+	Buffer instanceIndices;
+
+	bool defragmentRequested;
+	bool reloadRequested; //loads the scene models again, to churn the heap
 };
 
 //3D Model
@@ -80,17 +207,32 @@ struct Submesh
 	VertexBufferLayout vertexBufferLayout;
 	std::vector<float> vertices;
 	std::vector<u32> indices;
-	u32 vertexOffset;
-	u32 indexOffset;
 
-	std::vector<Vao> vaos;
+	//Ranges inside the geometry heap, in vertices and indices
+	HeapAllocation vertexAllocation;
+	HeapAllocation indexAllocation;
+	u32 baseVertex;
+	u32 vertexCount;
+	u32 firstIndex;
+	u32 indexCount;
+
+	//The submesh can't be drawn until the staging ring has issued this upload
+	u64 uploadTicket;
+
+	//Model space bounds, the sphere is xyz center and w radius
+	vec3 boundsMin;
+	vec3 boundsMax;
+	vec4 boundingSphere;
 };
 
 struct Mesh
 {
 	std::vector<Submesh> submeshes;
-	GLuint vertexBufferHandle;
-	GLuint indexBufferHandle;
+
+	//Bounds of every submesh together
+	vec3 boundsMin;
+	vec3 boundsMax;
+	vec4 boundingSphere;
 };
 
 struct Material
@@ -113,10 +255,141 @@ struct Program
 	std::string        programName;
 	u64                lastWriteTimestamp;
 	VertexShaderLayout vertexInputLayout;
+	bool               isCompute;
+
+	//Blocks the engine fills from C++, checked against the reflection every time the program is (re)loaded
+	std::vector<const UniformBlockLayout*> uniformBlockLayouts;
 };
 
 #pragma endregion
 
+//Texture a render target is created with, handle gets the texture
+struct RenderTargetDesc
+{
+	GLuint* handle;
+	GLint   internalFormat;
+	f32     scale; //of the display size
+	GLint   filter;
+};
+
+//The bloom runs at a lower resolution, its first level and viewport use this scale
+#define BLOOM_TARGET_SCALE 0.5f
+
+//Textures handed out by the render target pool, keyed by format, size and filter
+struct PooledRenderTarget
+{
+	GLuint handle;
+	GLint  internalFormat;
+	ivec2  size;
+	GLint  filter;
+	bool   inUse;
+	u32    idleFrames; //since it was released
+};
+
+#define RENDER_TARGET_POOL_MAX_IDLE_FRAMES 8
+
+struct RenderTargetPool
+{
+	std::vector<PooledRenderTarget> targets;
+	u32 createdCount;
+	u32 reusedCount;
+	u32 destroyedCount;
+};
+
+#define RENDER_TARGET_SIZE_ALIGNMENT 64
+
+//The targets are only reallocated once the window stops changing size, and can be bigger than the window.
+//Frames are drawn in the bottom left renderSize pixels of the targets and sampled with GetRenderTargetUvScale.
+struct FrameBufferResize
+{
+	bool  pending;
+	f32   timer;           //seconds left before the pending size is applied
+	f32   debounceSeconds;
+	f32   growMargin;      //fraction of the display added when the targets are reallocated
+	f32   shrinkThreshold; //the targets are reallocated when the display covers less of their area than this
+
+	ivec2 allocatedSize;   //of the full resolution targets
+	ivec2 renderSize;      //the display size clamped to the allocation
+
+	u32   reallocationCount;
+	u32   absorbedCount;   //resizes that fit in the current targets
+};
+
+// Render graph -----------------------------------------------------------------------------------------------------------
+
+//Targets of the deferred pipeline, registered in this order
+enum RenderResource
+{
+	RenderResource_Backbuffer,
+	RenderResource_Depth,
+	RenderResource_Albedo,
+	RenderResource_Normals,
+	RenderResource_Deferred,
+	RenderResource_Bloom,
+	RenderResource_VolumeDepth,
+	RenderResource_Count
+};
+
+#define RENDER_GRAPH_NONE 0xFFFFFFFFu
+#define RENDER_GRAPH_MAX_READS 4
+#define RENDER_GRAPH_MAX_COLOR_WRITES 4
+
+//Less than RENDER_TARGET_POOL_MAX_IDLE_FRAMES, so a cached framebuffer never outlives its textures
+#define RENDER_GRAPH_FRAMEBUFFER_MAX_IDLE_FRAMES 2
+
+struct App;
+typedef void (*RenderGraphExecute)(App* app);
+
+struct RenderGraphResource
+{
+	const char*      name;
+	RenderTargetDesc desc;     //desc.handle holds the texture while the resource is alive
+	bool             imported; //not allocated by the graph, the backbuffer
+
+	//Compiled every frame, RENDER_GRAPH_NONE if no pass that runs uses it
+	u32  firstPass;
+	u32  lastPass;
+	bool aliased; //got a texture another resource used earlier in the frame
+};
+
+struct RenderGraphPass
+{
+	const char*        name;
+	RenderGraphExecute execute;
+
+	u32  reads[RENDER_GRAPH_MAX_READS];             //sampled as textures
+	u32  readCount;
+	u32  colorWrites[RENDER_GRAPH_MAX_COLOR_WRITES]; //write i goes to shader output i
+	u32  colorWriteCount;
+	u32  depth;       //depth attachment, RENDER_GRAPH_NONE if there is none
+	bool sideEffects; //the results are used outside the graph, never culled
+
+	bool culled;
+};
+
+//Framebuffers are cached by their attachments, the pool hands out the same textures every frame
+struct RenderGraphFramebuffer
+{
+	GLuint handle;
+	GLuint colors[RENDER_GRAPH_MAX_COLOR_WRITES];
+	u32    colorCount;
+	GLuint depth;
+	u32    lastUsedFrame;
+};
+
+struct RenderGraph
+{
+	std::vector<RenderGraphResource> resources;
+	std::vector<RenderGraphPass> passes; //declared again every frame
+	std::vector<RenderGraphFramebuffer> framebuffers;
+	u32 frame;
+
+	//Last executed frame
+	u32 culledPassCount;
+	u32 textureCount;
+	u32 aliasedCount;
+};
+
 enum Mode
 {
 	Mode_TexturedQuad,
@@ -126,6 +399,151 @@ enum Mode
 	Mode_Count
 };
 
+enum SubmissionMode
+{
+	SubmissionMode_Direct,
+	SubmissionMode_MultiDrawIndirect,
+	SubmissionMode_Instanced,
+	SubmissionMode_GPUCulled,
+	SubmissionMode_Count
+};
+
+//Mesh passes of the G-buffer stage
+enum MeshPass
+{
+	MeshPass_GBuffer,   //shades, testing against the pre-pass depth if there was one
+	MeshPass_DepthOnly, //pre-pass, positions only
+};
+
+//Depth only pass before the G-buffer one, so the G-buffer shader runs once per pixel
+#define DEPTH_PREPASS_TIMER_FRAMES 2
+
+struct DepthPrePass
+{
+	bool enabled;
+	bool activeThisFrame;
+
+	u32 programIdx;         //direct submission
+	u32 indirectProgramIdx; //multi-draw indirect, instanced and GPU culled
+
+	//GPU time of both passes, read a few frames later so the queries never stall
+	GLuint timerQueries[DEPTH_PREPASS_TIMER_FRAMES][2];
+	bool timerIssued[DEPTH_PREPASS_TIMER_FRAMES][2];
+	u32 timerFrame;
+
+	f32 prePassMs;
+	f32 gBufferMs;
+
+	//Smoothed total of the mesh stage with and without the pre-pass, for the comparison
+	f32 totalMs[2];
+};
+
+//Same layout glMultiDrawElementsIndirect reads from the indirect buffer
+struct DrawElementsIndirectCommand
+{
+	u32 count;
+	u32 instanceCount;
+	u32 firstIndex;
+	i32 baseVertex;
+	u32 baseInstance;
+};
+
+//One submesh of one entity, before being turned into an indirect command or an instance
+struct IndirectDraw
+{
+	GLuint vao;
+	u32 materialIdx;
+	u32 entityIdx;
+	const Submesh* submesh;
+};
+
+//Input of the culling compute shader, one per submesh of every entity (std430 layout of CullInstance)
+struct GpuCullInstance
+{
+	vec4 localSphere;
+	u32 commandIdx;
+	u32 instanceParamIdx;
+	u32 padding[2];
+};
+
+struct GpuCuller
+{
+	u32 programIdx;
+	GLint planesLocation;
+	GLint instanceCountLocation;
+	GLint occlusionEnabledLocation;
+	GLint hiZLocation;
+	GLint hiZLevelCountLocation;
+	GLint hiZViewProjectionLocation;
+
+	Buffer instancesBuffer;
+	std::vector<GpuCullInstance> instances;
+	std::vector<u32> commandDraws; //first draw of each command, gives its vao and material
+};
+
+//Depth pyramid built from the G-buffer depth, each texel keeps the closest and farthest depth of the area it covers
+struct HiZPyramid
+{
+	bool enabled;
+	bool valid; //built last frame with the current framebuffer size
+
+	GLuint texture; //RG32F, level 0 is the power of 2 below the depth buffer size
+	ivec2 size;
+	u32 levelCount;
+
+	u32 reduceProgramIdx;
+	GLint sourceLocation;
+	GLint sourceLevelLocation;
+	GLint sourceIsDepthLocation;
+	GLint sourceSizeLocation;
+
+	//Camera the depth was rendered with
+	mat4 viewProjection;
+	vec3 cameraPosition;
+	vec3 cameraForward;
+
+	//Past these the previous depth says nothing about the current view and the test is skipped
+	f32 maxCameraMove;
+	f32 maxCameraTurnDegrees;
+	bool usedThisFrame;
+};
+
+//Render queue
+enum QueuePass
+{
+	QueuePass_Opaque,
+	QueuePass_Count
+};
+
+//Fields of a sort key, from the most to the least significant bits
+#define SORT_KEY_PASS_BITS     4
+#define SORT_KEY_PROGRAM_BITS  8
+#define SORT_KEY_VAO_BITS      8
+#define SORT_KEY_MATERIAL_BITS 16
+#define SORT_KEY_DEPTH_BITS    28
+
+struct RenderQueueItem
+{
+	u32 programIdx;
+	GLuint vao;
+	u32 materialIdx;
+	u32 entityIdx;
+	const Submesh* submesh;
+};
+
+struct RenderQueueEntry
+{
+	u64 key;
+	u32 itemIdx;
+};
+
+struct RenderQueue
+{
+	std::vector<RenderQueueItem> items;
+	std::vector<RenderQueueEntry> entries; //sorted by key after SortRenderQueue
+	std::vector<RenderQueueEntry> scratch;
+};
+
 enum RenderTextureMode
 {
 	RendTexMode_Albedo,
@@ -137,16 +555,6 @@ enum RenderTextureMode
 	RendTexMode_Count
 };
 
-//Buffer
-struct Buffer
-{
-	GLuint handle;
-	GLenum type;
-	u32 size;
-	u32 head;
-	void* data; //mapped data
-};
-
 //Camera
 struct Camera
 {
@@ -172,6 +580,39 @@ struct Entity
 
 	u32 head;
 	u32 size;
+
+	//Filled by the culling, only valid while the entity is in the visible list
+	u32 instanceIdx; //entry of the instance params buffer
+	u64 visibleSubmeshes; //one bit per submesh, submeshes past 64 are always drawn
+};
+
+//Frustum culling
+struct CullingStats
+{
+	u32 visibleEntities;
+	u32 culledEntities;
+	u32 visibleSubmeshes;
+	u32 culledSubmeshes;
+	u32 bvhCandidates;
+};
+
+struct FrustumCuller
+{
+	bool enabled;
+	bool useBvh;
+	vec4 planes[6];
+
+	//Entities whose BVH leaf touches the frustum, in entity order
+	std::vector<u32> candidates;
+
+	//World bounding spheres of the candidates, as a structure of arrays for the SIMD kernel
+	std::vector<f32> sphereX;
+	std::vector<f32> sphereY;
+	std::vector<f32> sphereZ;
+	std::vector<f32> sphereRadius;
+	std::vector<u8> sphereVisible;
+
+	CullingStats stats;
 };
 
 //Lights
@@ -188,8 +629,282 @@ struct Light
 	vec3 color;
 	vec3 direction;
 	vec3 position;
+	f32 radius; //Point lights only, nothing past it is lit
+};
+
+//std430 layout of a light in the lights buffer, the floats fill the padding after the vec3s
+struct GpuLight
+{
+	vec3 position;
+	f32 radius;
+	vec3 color;
+	f32 strength;
+	vec3 direction;
+	u32 type;
+};
+
+static_assert(sizeof(GpuLight) == 48, "GpuLight has to match the std430 array stride of Light");
+
+//Shader storage bindings of the lights, every lighting shader reads them from there
+#define LIGHTS_BUFFER_BINDING 4
+#define DIRECTIONAL_LIGHTS_BUFFER_BINDING 5
+#define LIGHTS_BUFFER_HEADER_SIZE 16 //the count, padded to the alignment of the array
+
+//Lights in shader storage buffers, mirrored on the CPU so only the entries that changed are sent
+struct LightBuffer
+{
+	Buffer lights;                       //count, then one GpuLight per entry of lightList
+	Buffer directionalLights;            //count, then the indices of the directional lights
+	std::vector<GpuLight> uploaded;      //what the GPU has
+	std::vector<u32> directionalIndices; //what the GPU has
+
+	//Last upload
+	u32 uploadedLights;
+	u32 uploadedBytes;
+};
+
+//std430 layout of a light gizmo, the shape is given by the draw it is part of
+struct GpuLightGizmo
+{
+	mat4 worldMatrix;
+	vec4 color;
+};
+
+static_assert(sizeof(GpuLightGizmo) == 80, "GpuLightGizmo has to match the std430 array stride of LightGizmo");
+
+#define LIGHT_GIZMOS_BUFFER_BINDING 6
+
+//One instanced draw per shape, cubes for the directional lights and spheres for the point ones
+struct LightGizmos
+{
+	Buffer instances; //the directional lights first, then the point ones
+	u32 directionalCount;
+	u32 pointCount;
+
+	GLuint viewProjectionLocation;
+	GLuint firstInstanceLocation;
+};
+
+enum LightingMode
+{
+	LightingMode_FullScreen,
+	LightingMode_Clustered,
+	LightingMode_LightVolumes,
+	LightingMode_Count
+};
+
+//Clustered lighting, the view frustum is split in screen tiles and exponential depth slices
+#define LIGHT_CLUSTER_GRID_X 16
+#define LIGHT_CLUSTER_GRID_Y 9
+#define LIGHT_CLUSTER_GRID_Z 24
+#define LIGHT_CLUSTER_COUNT (LIGHT_CLUSTER_GRID_X * LIGHT_CLUSTER_GRID_Y * LIGHT_CLUSTER_GRID_Z)
+#define LIGHT_CLUSTER_MAX_LIGHTS 256 //per cluster, the lights past it are dropped
+#define LIGHTING_TIMER_FRAMES 2
+
+struct ClusteredLighting
+{
+	u32 buildProgramIdx;
+	GLint buildViewLocation;
+	GLint buildInverseProjectionLocation;
+	GLint buildDepthRangeLocation;
+	GLint buildGridLocation;
+	GLint buildMaxLightsLocation;
+
+	u32 shadingProgramIdx;
+	GLint shadingDepthTextureLocation;
+	GLint shadingNormalTextureLocation;
+	GLint shadingAlbedoTextureLocation;
+	GLint shadingInverseViewProjectionLocation;
+	GLint shadingViewLocation;
+	GLint shadingUvScaleLocation;
+	GLint shadingDepthRangeLocation;
+	GLint shadingGridLocation;
+	GLint shadingMaxLightsLocation;
+
+	//Point light count of every cluster, then LIGHT_CLUSTER_MAX_LIGHTS light indices per cluster.
+	//The directional lights are in every cluster, they are read from the directional lights buffer instead.
+	Buffer clustersBuffer;
+
+	//GPU time of the lighting pass of either mode, read a few frames later so the queries never stall
+	GLuint timerQueries[LIGHTING_TIMER_FRAMES];
+	bool timerIssued[LIGHTING_TIMER_FRAMES];
+	LightingMode timerMode[LIGHTING_TIMER_FRAMES];
+	u32 timerFrame;
+	f32 lightingMs[LightingMode_Count]; //smoothed
+
+	//Random point lights added after the scene ones, to load the lighting pass
+	i32 stressLightCount;
+	u32 spawnedStressLights;
+};
+
+//Deferred lighting that only shades the pixels inside the sphere of each point light, found with the stencil
+struct LightVolumes
+{
+	u32 stencilProgramIdx;
+	GLint stencilViewProjectionLocation;
+	GLint stencilLightPositionRadiusLocation;
+	GLint stencilVolumeScaleLocation;
+
+	u32 shadingProgramIdx;
+	GLint shadingViewProjectionLocation;
+	GLint shadingLightPositionRadiusLocation;
+	GLint shadingVolumeScaleLocation;
+	GLint shadingLightColorLocation;
+	GLint shadingDepthTextureLocation;
+	GLint shadingNormalTextureLocation;
+	GLint shadingAlbedoTextureLocation;
+	GLint shadingInverseViewProjectionLocation;
+	GLint shadingInverseViewportSizeLocation;
+	GLint shadingUvScaleLocation;
+
+	//The sphere mesh is inside the unit sphere, it is scaled up so its faces cover the whole radius
+	f32 volumeScale;
+	u32 sphereIndexCount;
+
+	//Reads the G-buffer depth for the copy into the depth stencil target of the pass
+	GLuint depthCopyFramebuffer;
+
+	u32 drawnLights;
+	u32 culledLights;
+};
+
+//Bloom, each level is half the size of the one above it
+#define BLOOM_MAX_LEVELS 7
+
+//Thresholded downsample of the lit image into the Bloom target, downsamples to the bottom of the chain and adds
+//each level back into the one above it. Fixed taps per level, the radius only spreads them.
+struct Bloom
+{
+	//Levels 1 and below, level 0 is the Bloom render graph target
+	GLuint chainTexture; //mip i is level i + 1
+	ivec2 chainSize;
+	u32 chainMipCount;
+	GLuint framebuffers[BLOOM_MAX_LEVELS]; //one per level, 0 has the render graph target attached
+
+	u32 downsampleProgramIdx;
+	GLint downsampleSourceLocation;
+	GLint downsampleTexelSizeLocation;
+	GLint downsampleUvScaleLocation;
+	GLint downsamplePrefilterLocation;
+	GLint downsampleThresholdLocation;
+
+	u32 upsampleProgramIdx;
+	GLint upsampleSourceLocation;
+	GLint upsampleTexelSizeLocation;
+	GLint upsampleUvScaleLocation;
+	GLint upsampleRadiusLocation;
+
+	f32 threshold; //luminance where the bloom starts
+	f32 softKnee;  //fraction of the threshold below it that fades in
+	f32 intensity;
+	f32 radius;    //of the upsample filter, in texels of the level it reads
+	i32 levelCount;
+	u32 usedLevels; //last frame, the chain stops at 1 texel
+
+	//Extra Gaussian blur of the top level with the compute blur, to soften the blockiness of few levels
+	bool computeBlur;
+	f32 computeBlurSigma; //in texels of the top level
+};
+
+//Separable Gaussian blur in compute, has to match compute_blur.glsl
+#define COMPUTE_BLUR_TILE 128      //outputs of a group, along the blur direction
+#define COMPUTE_BLUR_MAX_RADIUS 32 //taps on each side of the center
+
+struct ComputeBlurProgram
+{
+	u32 programIdx;
+	GLint sourceLocation;
+	GLint directionLocation;
+	GLint sizeLocation;
+	GLint radiusLocation;
+	GLint weightsLocation;
 };
 
+struct ComputeBlur
+{
+	ComputeBlurProgram colorProgram; //GL_R11F_G11F_B10F targets
+	ComputeBlurProgram redProgram;   //GL_R16F targets
+
+	//Weights of the last sigma, center first, the other taps are mirrored
+	f32 sigma;
+	i32 radius;
+	f32 weights[COMPUTE_BLUR_MAX_RADIUS + 1];
+};
+
+//SIMD
+enum SimdLevel
+{
+	SimdLevel_Scalar,
+	SimdLevel_SSE,
+	SimdLevel_AVX2,
+	SimdLevel_Count
+};
+
+struct TransformBenchmark
+{
+	u32 entityCount = 100000;
+	bool requested = false;
+	bool hasResults = false;
+
+	//One entry per batch kernel, the last one is the per entity "projection * view * world" path
+	f32 entitiesPerMs[SimdLevel_Count + 1];
+	f32 checksum;
+};
+
+//Dynamic bounding volume hierarchy
+#define BVH_NULL_NODE 0xFFFFFFFF
+
+struct BvhNode
+{
+	//Leaves store a fattened box so small movements don't need a reinsertion
+	vec3 boundsMin;
+	vec3 boundsMax;
+
+	u32 parent; //next free node while in the free list
+	u32 left;
+	u32 right;
+	i32 height; //0 for leaves, -1 for free nodes
+
+	u32 entityIdx;
+};
+
+struct Bvh
+{
+	std::vector<BvhNode> nodes;
+	u32 root;
+	u32 freeList;
+	u32 leafCount;
+	f32 margin;
+
+	std::vector<u32> stack; //scratch for the queries
+};
+
+#define BVH_BENCHMARK_SCALES 3
+
+struct BvhBenchmark
+{
+	bool requested = false;
+	bool hasResults = false;
+
+	//Each scale is a separate scene, the last one has 100k entities
+	u32 entityCount[BVH_BENCHMARK_SCALES];
+	f32 buildMs[BVH_BENCHMARK_SCALES];
+	f32 updateMs[BVH_BENCHMARK_SCALES]; //moving 10% of the entities
+	u32 treeHeight[BVH_BENCHMARK_SCALES];
+
+	//Average microseconds per query, tree and linear scan
+	f32 frustumUs[BVH_BENCHMARK_SCALES][2];
+	f32 sphereUs[BVH_BENCHMARK_SCALES][2];
+	f32 rayUs[BVH_BENCHMARK_SCALES][2];
+};
+
+//Uniform blocks, these have to match the GlobalParams/LocalParams declarations in the shaders
+typedef std140::Struct<vec3> GlobalParams;
+enum { GlobalParams_CameraPosition };
+
+typedef std140::Struct<mat4, mat4, i32> LocalParams;
+enum { LocalParams_WorldMatrix, LocalParams_WorldViewProjectionMatrix, LocalParams_Reflectiveness };
+
 //App
 struct OpenGLInfo
 {
@@ -222,18 +937,21 @@ struct App
 	std::vector<Material> materials;
 	std::vector<Mesh> meshes;
 	std::vector<Model> models;
+	GeometryHeap geometryHeap;
+	StagingRing stagingRing;
 	std::vector<Program> programs;
 
 	// program indices
 	u32 texturedGeometryProgramIdx;
 	u32 texturedMeshProgramIdx;
 	u32 renderTexturesProgramIdx;
+	u32 renderTexturesIndirectProgramIdx;
 	u32 deferredLightingProgramIdx;
+	u32 gBufferDebugProgramIdx;
 	u32 lightVisualizationProgramIdx;
 	u32 skyboxProgramIdx;
 	u32 skyboxReflectionProgramIdx;
-	u32 blurPassProgramIdx;
-	u32 bloomMixProgramIdx;
+	u32 compositeProgramIdx;
 
 	// texture indices
 	u32 diceTexIdx;
@@ -262,16 +980,38 @@ struct App
 	//Scene entities
 	std::vector<Entity> entityList;
 
+	//Entities that passed the culling this frame, the only ones pushed and drawn
+	std::vector<u32> visibleEntities;
+	FrustumCuller frustumCuller;
+
+	//Spatial index of the entities, one leaf per entity (BVH_NULL_NODE until inserted)
+	Bvh sceneBvh;
+	std::vector<u32> entityBvhLeaves;
+	BvhBenchmark bvhBenchmark;
+
+	//Contiguous copies of the entity matrices for the batch transform kernel
+	std::vector<mat4> entityWorldMatrices;
+	std::vector<mat4> entityWVPMatrices;
+	TransformBenchmark transformBenchmark;
+
 	//Scene lights
 	std::vector<Light> lightList;
+	u32 sceneLightCount; //the stress lights come after these
+	LightBuffer lightBuffer;
+	LightingMode lightingMode;
+	ClusteredLighting clusteredLighting;
+	LightVolumes lightVolumes;
 
 	// Mode
 	Mode mode;
+	SubmissionMode submissionMode;
+	u32 meshDrawCalls;
 	RenderTextureMode renderTexMode;
 	Camera camera;
 
 	// Location of the texture uniform in the textured quad shader
 	GLuint programUniformTexture;
+	GLuint programUniformUvScale;
 
 	// Location of the texture uniform in the mesh shader???
 	GLuint texturedMeshProgram_uTexture;
@@ -279,36 +1019,44 @@ struct App
 	// Location of the texture uniform in the render texture shader???
 	GLuint renderTexturesProgram_uTexture;
 	GLuint renderTexturesProgram_cubeTexture;
+	GLuint renderTexturesIndirectProgram_uTexture;
+	GLuint renderTexturesIndirectProgram_cubeTexture;
 
 	// Location of the texture uniforms in the lighting pass shader???
-	GLuint deferredLightingPass_posTexture;
+	GLuint deferredLightingPass_depthTexture;
 	GLuint deferredLightingPass_normalTexture;
 	GLuint deferredLightingPass_albedoTexture;
-	GLuint deferredLightingPass_brightColors;
+	GLuint deferredLightingPass_inverseViewProjection;
+	GLuint deferredLightingPass_uvScale;
+	GLuint deferredLightingPass_directionalOnly;
+
+	// Location of the uniforms in the G-buffer debug shader
+	GLuint gBufferDebug_depthTexture;
+	GLuint gBufferDebug_normalTexture;
+	GLuint gBufferDebug_inverseViewProjection;
+	GLuint gBufferDebug_view;
+	GLuint gBufferDebug_uvScale;
 
 	// Location of the texture uniforms in the skybox shader???
-	GLuint skybox_uMatrix;
+	GLuint skybox_uInverseViewProjection;
 	GLuint skybox_uTexture;
 
 	//
-	GLuint bloom_brightColorImage;
-	GLuint bloom_horizontalLocation;
-	GLuint bloomStrengthLocation;
-	GLuint bloomIterationsLocation;
-	float bloomStrength = 2.0f;
-	int bloomIterations = 25;
-
-	//
-	GLuint bloom_blurredImage;
-	GLuint bloom_originalImage;
+	GLuint composite_litImage;
+	GLuint composite_bloomImage;
+	GLuint composite_uvScale;
+	GLuint composite_bloomIntensity;
+	Bloom bloom;
+	ComputeBlur computeBlur;
 
 	// VAOs
 	GLuint targetQuad_vao;
+	GLuint fullScreenTriangle_vao; //no attributes, the vertex shader makes the triangle from gl_VertexID
 	GLuint cube_vao;
 	GLuint sphere_vao;
 
-	GLuint skybox_vao;
-	mat4 skyboxViewProjection;
+	mat4 skyboxInverseViewProjection;
+	mat4 viewProjection;
 
 	//Uniforms buffer
 	Buffer uniformsBuffer;
@@ -317,23 +1065,42 @@ struct App
 
 	GLint globalParamsSize;
 
-	//Light matrices buffer
-	Buffer lightMatricesBuffer;
+	//Per entity LocalParams in a plain array, read by the indirect shaders
+	Buffer instanceParamsBuffer;
+
+	//Multi-draw indirect
+	Buffer indirectBuffer;
+	std::vector<IndirectDraw> indirectDraws;
+	std::vector<DrawElementsIndirectCommand> indirectCommands;
+	std::vector<u32> instanceIndices;
+
+	//Frustum culling in a compute shader, fills the instance counts of the indirect commands
+	GpuCuller gpuCuller;
+	HiZPyramid hiZ;
+
+	DepthPrePass depthPrePass;
+
+	//Direct submission, sorted to skip redundant state changes
+	RenderQueue renderQueue;
+
+	LightGizmos lightGizmos;
 
+	//Deferred targets, only valid while the render graph executes the passes that use them
 	GLuint albedoAttachmentHandle;
 	GLuint normalsAttachmentHandle;
-	GLuint positionAttachmentHandle;
 	GLuint depthAttachmentHandle;
 	GLuint deferredAttachmentHandle;
-	GLuint brightColorsAttachmentHandle;
-	GLuint halfBlurredColorsAttachmentHandle;
-	GLuint blurredColorsAttachmentHandle;
-	GLuint mixedBlurImage;
+	GLuint volumeDepthAttachmentHandle;
+	GLuint bloomAttachmentHandle;
 
 	GLuint frameBufferAttachmentHandle;
+	GLuint directDepthAttachmentHandle;
 
 	GLuint directFrameBufferHandle;
-	GLuint deferredFrameBufferHandle;
+
+	RenderTargetPool renderTargetPool;
+	FrameBufferResize frameBufferResize;
+	RenderGraph renderGraph;
 
 
 	// UI
@@ -344,6 +1111,24 @@ struct App
 
 void GenFrameBuffers(App* app);
 
+//Allocated size of a target, the full resolution ones may be bigger than the display
+ivec2 GetRenderTargetSize(const App* app, f32 scale);
+
+//Part of a target the frame is drawn into
+ivec2 GetRenderViewportSize(const App* app, f32 scale);
+
+//Maps the [0, 1] screen quad coordinates to the drawn part of the targets
+vec2 GetRenderTargetUvScale(const App* app);
+
+//Logs why the bound framebuffer is incomplete, if it is
+void CheckFramebufferStatus(const char* name);
+
+//Full screen deferred lighting of the bound targets, directionalOnly leaves the point lights to the light volumes
+void DrawFullScreenLighting(App* app, bool directionalOnly);
+
+//Called by the platform layer for every resize event, the targets follow once the size settles
+void OnFrameBufferResized(App* app, ivec2 displaySize);
+
 void Init(App* app);
 
 void Gui(App* app);
@@ -0,0 +1,568 @@
+#include "geometry_heap.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+#include "staging_ring.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#pragma region TLSF
+
+static u32 FindLastSet(u32 value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, value);
+	return (u32)index;
+#else
+	return 31 - __builtin_clz(value);
+#endif
+}
+
+static u32 FindFirstSet(u32 value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (u32)index;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+
+static u32 AlignTo(u32 value, u32 alignment)
+{
+	return ((value + alignment - 1) / alignment) * alignment;
+}
+
+//First level is the power of 2 of the size, second level splits it linearly. Sizes under HEAP_SL_COUNT go to the first row
+static void MappingInsert(u32 size, u32& fl, u32& sl)
+{
+	if (size < HEAP_SL_COUNT)
+	{
+		fl = 0;
+		sl = size;
+	}
+	else
+	{
+		u32 msb = FindLastSet(size);
+		sl = (size >> (msb - HEAP_SL_LOG2)) ^ HEAP_SL_COUNT;
+		fl = msb - HEAP_SL_LOG2 + 1;
+	}
+}
+
+//Rounds the size up to the next class, so any block found there is big enough
+static void MappingSearch(u32 size, u32& fl, u32& sl)
+{
+	if (size >= HEAP_SL_COUNT)
+	{
+		u32 round = (1u << (FindLastSet(size) - HEAP_SL_LOG2)) - 1;
+		if (size <= UINT32_MAX - round)
+			size += round;
+	}
+	MappingInsert(size, fl, sl);
+}
+
+static u32 NewBlock(HeapAllocator& allocator)
+{
+	if (!allocator.unusedBlocks.empty())
+	{
+		u32 blockIdx = allocator.unusedBlocks.back();
+		allocator.unusedBlocks.pop_back();
+		return blockIdx;
+	}
+
+	allocator.blocks.push_back(HeapBlock{});
+	return (u32)allocator.blocks.size() - 1;
+}
+
+static void ReleaseBlock(HeapAllocator& allocator, u32 blockIdx)
+{
+	allocator.blocks[blockIdx] = HeapBlock{};
+	allocator.unusedBlocks.push_back(blockIdx);
+}
+
+static void InsertFreeBlock(HeapAllocator& allocator, u32 blockIdx)
+{
+	HeapBlock& block = allocator.blocks[blockIdx];
+
+	u32 fl, sl;
+	MappingInsert(block.size, fl, sl);
+
+	u32 head = allocator.freeLists[fl][sl];
+	block.isFree = true;
+	block.prevFree = HEAP_NULL_BLOCK;
+	block.nextFree = head;
+	if (head != HEAP_NULL_BLOCK)
+		allocator.blocks[head].prevFree = blockIdx;
+
+	allocator.freeLists[fl][sl] = blockIdx;
+	allocator.flBitmap |= 1u << fl;
+	allocator.slBitmap[fl] |= 1u << sl;
+}
+
+static void RemoveFreeBlock(HeapAllocator& allocator, u32 blockIdx)
+{
+	HeapBlock& block = allocator.blocks[blockIdx];
+
+	u32 fl, sl;
+	MappingInsert(block.size, fl, sl);
+
+	if (block.prevFree != HEAP_NULL_BLOCK)
+		allocator.blocks[block.prevFree].nextFree = block.nextFree;
+	else
+		allocator.freeLists[fl][sl] = block.nextFree;
+
+	if (block.nextFree != HEAP_NULL_BLOCK)
+		allocator.blocks[block.nextFree].prevFree = block.prevFree;
+
+	if (allocator.freeLists[fl][sl] == HEAP_NULL_BLOCK)
+	{
+		allocator.slBitmap[fl] &= ~(1u << sl);
+		if (allocator.slBitmap[fl] == 0)
+			allocator.flBitmap &= ~(1u << fl);
+	}
+
+	block.prevFree = HEAP_NULL_BLOCK;
+	block.nextFree = HEAP_NULL_BLOCK;
+}
+
+static u32 FindFreeBlock(HeapAllocator& allocator, u32 size)
+{
+	u32 fl, sl;
+	MappingSearch(size, fl, sl);
+
+	if (fl < HEAP_FL_COUNT)
+	{
+		u32 slMap = allocator.slBitmap[fl] & (~0u << sl);
+		if (slMap == 0)
+		{
+			u32 flMap = fl + 1 < HEAP_FL_COUNT ? allocator.flBitmap & (~0u << (fl + 1)) : 0;
+			if (flMap != 0)
+			{
+				fl = FindFirstSet(flMap);
+				slMap = allocator.slBitmap[fl];
+			}
+		}
+
+		if (slMap != 0)
+			return allocator.freeLists[fl][FindFirstSet(slMap)];
+	}
+
+	//The rounding can skip a block of the request's own class that is big enough, look there before giving up
+	MappingInsert(size, fl, sl);
+	for (u32 blockIdx = allocator.freeLists[fl][sl]; blockIdx != HEAP_NULL_BLOCK; blockIdx = allocator.blocks[blockIdx].nextFree)
+	{
+		if (allocator.blocks[blockIdx].size >= size)
+			return blockIdx;
+	}
+
+	return HEAP_NULL_BLOCK;
+}
+
+//Links a block at the physical end of the heap
+static void AppendBlock(HeapAllocator& allocator, u32 blockIdx)
+{
+	HeapBlock& block = allocator.blocks[blockIdx];
+	block.prevPhysical = allocator.lastBlock;
+	block.nextPhysical = HEAP_NULL_BLOCK;
+
+	if (allocator.lastBlock != HEAP_NULL_BLOCK)
+		allocator.blocks[allocator.lastBlock].nextPhysical = blockIdx;
+	else
+		allocator.firstBlock = blockIdx;
+
+	allocator.lastBlock = blockIdx;
+}
+
+static void AppendFreeBlock(HeapAllocator& allocator, u32 offset, u32 size)
+{
+	u32 blockIdx = NewBlock(allocator);
+	allocator.blocks[blockIdx].offset = offset;
+	allocator.blocks[blockIdx].size = size;
+	AppendBlock(allocator, blockIdx);
+	InsertFreeBlock(allocator, blockIdx);
+}
+
+static void ResetFreeLists(HeapAllocator& allocator)
+{
+	allocator.flBitmap = 0;
+	for (u32 fl = 0; fl < HEAP_FL_COUNT; ++fl)
+	{
+		allocator.slBitmap[fl] = 0;
+		for (u32 sl = 0; sl < HEAP_SL_COUNT; ++sl)
+			allocator.freeLists[fl][sl] = HEAP_NULL_BLOCK;
+	}
+}
+
+void InitHeapAllocator(HeapAllocator& allocator, u32 capacity)
+{
+	allocator.capacity = capacity;
+	allocator.usedBytes = 0;
+	allocator.blocks.clear();
+	allocator.unusedBlocks.clear();
+	allocator.firstBlock = HEAP_NULL_BLOCK;
+	allocator.lastBlock = HEAP_NULL_BLOCK;
+	ResetFreeLists(allocator);
+
+	AppendFreeBlock(allocator, 0, capacity);
+}
+
+bool HeapAllocate(HeapAllocator& allocator, u32 size, u32 alignment, HeapAllocation& allocation)
+{
+	ASSERT(size > 0, "Empty allocations are not allowed");
+	if (alignment == 0)
+		alignment = 1;
+
+	//Worst case, the padding needed to align the start of the block
+	u32 request = size + alignment - 1;
+
+	u32 blockIdx = FindFreeBlock(allocator, request);
+	if (blockIdx == HEAP_NULL_BLOCK)
+		return false;
+
+	RemoveFreeBlock(allocator, blockIdx);
+
+	//Give the padding in front back to the heap as its own block
+	u32 offset = allocator.blocks[blockIdx].offset;
+	u32 alignedOffset = AlignTo(offset, alignment);
+	if (alignedOffset > offset)
+	{
+		u32 frontIdx = NewBlock(allocator);
+		HeapBlock& front = allocator.blocks[frontIdx];
+		HeapBlock& block = allocator.blocks[blockIdx];
+
+		front.offset = offset;
+		front.size = alignedOffset - offset;
+		front.prevPhysical = block.prevPhysical;
+		front.nextPhysical = blockIdx;
+
+		if (block.prevPhysical != HEAP_NULL_BLOCK)
+			allocator.blocks[block.prevPhysical].nextPhysical = frontIdx;
+		else
+			allocator.firstBlock = frontIdx;
+
+		block.prevPhysical = frontIdx;
+		block.offset = alignedOffset;
+		block.size -= front.size;
+
+		InsertFreeBlock(allocator, frontIdx);
+	}
+
+	//And the remainder at the back
+	if (allocator.blocks[blockIdx].size > size)
+	{
+		u32 backIdx = NewBlock(allocator);
+		HeapBlock& back = allocator.blocks[backIdx];
+		HeapBlock& block = allocator.blocks[blockIdx];
+
+		back.offset = block.offset + size;
+		back.size = block.size - size;
+		back.prevPhysical = blockIdx;
+		back.nextPhysical = block.nextPhysical;
+
+		if (block.nextPhysical != HEAP_NULL_BLOCK)
+			allocator.blocks[block.nextPhysical].prevPhysical = backIdx;
+		else
+			allocator.lastBlock = backIdx;
+
+		block.nextPhysical = backIdx;
+		block.size = size;
+
+		InsertFreeBlock(allocator, backIdx);
+	}
+
+	HeapBlock& block = allocator.blocks[blockIdx];
+	block.isFree = false;
+	block.alignment = alignment;
+	allocator.usedBytes += block.size;
+
+	allocation.block = blockIdx;
+	allocation.offset = block.offset;
+	allocation.size = block.size;
+
+	return true;
+}
+
+void HeapFree(HeapAllocator& allocator, const HeapAllocation& allocation)
+{
+	u32 blockIdx = allocation.block;
+	ASSERT(!allocator.blocks[blockIdx].isFree, "Freeing a block twice");
+
+	allocator.usedBytes -= allocator.blocks[blockIdx].size;
+
+	//Merge with the physical neighbours so free space never gets split in pieces
+	u32 prevIdx = allocator.blocks[blockIdx].prevPhysical;
+	if (prevIdx != HEAP_NULL_BLOCK && allocator.blocks[prevIdx].isFree)
+	{
+		RemoveFreeBlock(allocator, prevIdx);
+
+		HeapBlock& prev = allocator.blocks[prevIdx];
+		HeapBlock& block = allocator.blocks[blockIdx];
+		prev.size += block.size;
+		prev.nextPhysical = block.nextPhysical;
+
+		if (block.nextPhysical != HEAP_NULL_BLOCK)
+			allocator.blocks[block.nextPhysical].prevPhysical = prevIdx;
+		else
+			allocator.lastBlock = prevIdx;
+
+		ReleaseBlock(allocator, blockIdx);
+		blockIdx = prevIdx;
+	}
+
+	u32 nextIdx = allocator.blocks[blockIdx].nextPhysical;
+	if (nextIdx != HEAP_NULL_BLOCK && allocator.blocks[nextIdx].isFree)
+	{
+		RemoveFreeBlock(allocator, nextIdx);
+
+		HeapBlock& next = allocator.blocks[nextIdx];
+		HeapBlock& block = allocator.blocks[blockIdx];
+		block.size += next.size;
+		block.nextPhysical = next.nextPhysical;
+
+		if (next.nextPhysical != HEAP_NULL_BLOCK)
+			allocator.blocks[next.nextPhysical].prevPhysical = blockIdx;
+		else
+			allocator.lastBlock = blockIdx;
+
+		ReleaseBlock(allocator, nextIdx);
+	}
+
+	InsertFreeBlock(allocator, blockIdx);
+}
+
+void GrowHeapAllocator(HeapAllocator& allocator, u32 newCapacity)
+{
+	ASSERT(newCapacity > allocator.capacity, "Heaps can only grow");
+
+	u32 extraSize = newCapacity - allocator.capacity;
+	u32 lastIdx = allocator.lastBlock;
+
+	if (lastIdx != HEAP_NULL_BLOCK && allocator.blocks[lastIdx].isFree)
+	{
+		RemoveFreeBlock(allocator, lastIdx);
+		allocator.blocks[lastIdx].size += extraSize;
+		InsertFreeBlock(allocator, lastIdx);
+	}
+	else
+	{
+		AppendFreeBlock(allocator, allocator.capacity, extraSize);
+	}
+
+	allocator.capacity = newCapacity;
+}
+
+u32 CompactHeapAllocator(HeapAllocator& allocator, std::vector<HeapMove>& moves)
+{
+	//Used blocks keep their index, so the allocations that point to them stay valid
+	std::vector<u32> usedBlocks;
+	for (u32 blockIdx = allocator.firstBlock; blockIdx != HEAP_NULL_BLOCK; blockIdx = allocator.blocks[blockIdx].nextPhysical)
+	{
+		if (allocator.blocks[blockIdx].isFree)
+			continue;
+		usedBlocks.push_back(blockIdx);
+	}
+
+	for (u32 blockIdx = allocator.firstBlock; blockIdx != HEAP_NULL_BLOCK;)
+	{
+		u32 nextIdx = allocator.blocks[blockIdx].nextPhysical;
+		if (allocator.blocks[blockIdx].isFree)
+			ReleaseBlock(allocator, blockIdx);
+		blockIdx = nextIdx;
+	}
+
+	ResetFreeLists(allocator);
+	allocator.firstBlock = HEAP_NULL_BLOCK;
+	allocator.lastBlock = HEAP_NULL_BLOCK;
+
+	u32 movedBlocks = 0;
+	u32 head = 0;
+
+	moves.clear();
+	for (u32 blockIdx : usedBlocks)
+	{
+		HeapBlock& block = allocator.blocks[blockIdx];
+
+		u32 alignedHead = AlignTo(head, block.alignment);
+		if (alignedHead > head)
+			AppendFreeBlock(allocator, head, alignedHead - head);
+
+		HeapBlock& movedBlock = allocator.blocks[blockIdx];
+		moves.push_back(HeapMove{ movedBlock.offset, alignedHead, movedBlock.size });
+		if (movedBlock.offset != alignedHead)
+			movedBlocks++;
+
+		movedBlock.offset = alignedHead;
+		AppendBlock(allocator, blockIdx);
+
+		head = alignedHead + movedBlock.size;
+	}
+
+	if (head < allocator.capacity)
+		AppendFreeBlock(allocator, head, allocator.capacity - head);
+
+	return movedBlocks;
+}
+
+void GetHeapStats(const HeapAllocator& allocator, u32& freeBlockCount, u32& largestFreeBlock)
+{
+	freeBlockCount = 0;
+	largestFreeBlock = 0;
+
+	for (u32 blockIdx = allocator.firstBlock; blockIdx != HEAP_NULL_BLOCK; blockIdx = allocator.blocks[blockIdx].nextPhysical)
+	{
+		const HeapBlock& block = allocator.blocks[blockIdx];
+		if (block.isFree)
+		{
+			freeBlockCount++;
+			largestFreeBlock = glm::max(largestFreeBlock, block.size);
+		}
+	}
+}
+
+#pragma endregion
+
+#pragma region GPU heaps
+
+static void InitGpuHeap(GpuHeap& heap, u32 capacity, GLenum type)
+{
+	heap.buffer = CreateBuffer(capacity, type, GL_STATIC_DRAW);
+	InitHeapAllocator(heap.allocator, capacity);
+}
+
+//Copies the given ranges into a new buffer. The copy targets are used so no vao gets its bindings touched
+static void ReallocateGpuHeap(GpuHeap& heap, u32 newSize, const std::vector<HeapMove>& copies)
+{
+	GLuint newHandle;
+	glGenBuffers(1, &newHandle);
+	StateBindBuffer(GL_COPY_WRITE_BUFFER, newHandle);
+	glBufferData(GL_COPY_WRITE_BUFFER, newSize, NULL, GL_STATIC_DRAW);
+
+	StateBindBuffer(GL_COPY_READ_BUFFER, heap.buffer.handle);
+	for (const HeapMove& copy : copies)
+	{
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.srcOffset, copy.dstOffset, copy.size);
+	}
+
+	StateBindBuffer(GL_COPY_READ_BUFFER, 0);
+	StateBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	StateDeleteBuffer(heap.buffer.handle);
+	heap.buffer.handle = newHandle;
+	heap.buffer.size = newSize;
+}
+
+static HeapAllocation GpuHeapAllocate(GpuHeap& heap, u32 size, u32 alignment)
+{
+	HeapAllocation allocation = {};
+
+	while (!HeapAllocate(heap.allocator, size, alignment, allocation))
+	{
+		u32 oldCapacity = heap.allocator.capacity;
+		u32 newCapacity = glm::max(oldCapacity * 2, oldCapacity + size + alignment);
+
+		std::vector<HeapMove> copies = { HeapMove{ 0, 0, oldCapacity } };
+		ReallocateGpuHeap(heap, newCapacity, copies);
+		GrowHeapAllocator(heap.allocator, newCapacity);
+	}
+
+	return allocation;
+}
+
+static bool DefragmentGpuHeap(GpuHeap& heap)
+{
+	std::vector<HeapMove> copies;
+	if (CompactHeapAllocator(heap.allocator, copies) == 0)
+		return false;
+
+	ReallocateGpuHeap(heap, heap.allocator.capacity, copies);
+	return true;
+}
+
+//Vaos point to the old buffers after a reallocation, they will be created again on demand
+static void ReleaseGeometryVaos(GeometryHeap& heap)
+{
+	for (Vao& vao : heap.vaos)
+	{
+		StateDeleteVertexArray(vao.handle);
+	}
+	heap.vaos.clear();
+}
+
+void InitGeometryHeap(GeometryHeap& heap, u32 vertexCapacity, u32 indexCapacity)
+{
+	InitGpuHeap(heap.vertices, vertexCapacity, GL_ARRAY_BUFFER);
+	InitGpuHeap(heap.indices, indexCapacity, GL_ELEMENT_ARRAY_BUFFER);
+	heap.instanceIndices = CreateBuffer(MAX_INSTANCES * sizeof(u32), GL_ARRAY_BUFFER, GL_STREAM_DRAW);
+	heap.vaos.clear();
+	heap.defragmentRequested = false;
+	heap.reloadRequested = false;
+}
+
+HeapAllocation AllocateVertices(GeometryHeap& heap, u32 size, u32 stride)
+{
+	GLuint previousHandle = heap.vertices.buffer.handle;
+	HeapAllocation allocation = GpuHeapAllocate(heap.vertices, size, stride);
+
+	if (heap.vertices.buffer.handle != previousHandle)
+		ReleaseGeometryVaos(heap);
+
+	return allocation;
+}
+
+HeapAllocation AllocateIndices(GeometryHeap& heap, u32 size)
+{
+	GLuint previousHandle = heap.indices.buffer.handle;
+	HeapAllocation allocation = GpuHeapAllocate(heap.indices, size, sizeof(u32));
+
+	if (heap.indices.buffer.handle != previousHandle)
+		ReleaseGeometryVaos(heap);
+
+	return allocation;
+}
+
+void FreeSubmeshGeometry(GeometryHeap& heap, Submesh& submesh)
+{
+	HeapFree(heap.vertices.allocator, submesh.vertexAllocation);
+	HeapFree(heap.indices.allocator, submesh.indexAllocation);
+
+	submesh.vertexCount = 0;
+	submesh.indexCount = 0;
+}
+
+void UpdateSubmeshRanges(GeometryHeap& heap, Submesh& submesh)
+{
+	submesh.vertexAllocation.offset = heap.vertices.allocator.blocks[submesh.vertexAllocation.block].offset;
+	submesh.indexAllocation.offset = heap.indices.allocator.blocks[submesh.indexAllocation.block].offset;
+
+	submesh.baseVertex = submesh.vertexAllocation.offset / submesh.vertexBufferLayout.stride;
+	submesh.firstIndex = submesh.indexAllocation.offset / sizeof(u32);
+}
+
+void DefragmentGeometryHeap(App* app)
+{
+	GeometryHeap& heap = app->geometryHeap;
+
+	//Staged copies still point at the old offsets
+	FinishStagingRing(app->stagingRing);
+
+	bool verticesMoved = DefragmentGpuHeap(heap.vertices);
+	bool indicesMoved = DefragmentGpuHeap(heap.indices);
+
+	if (!verticesMoved && !indicesMoved)
+		return;
+
+	ReleaseGeometryVaos(heap);
+
+	for (Mesh& mesh : app->meshes)
+	{
+		for (Submesh& submesh : mesh.submeshes)
+		{
+			UpdateSubmeshRanges(heap, submesh);
+		}
+	}
+}
+
+#pragma endregion
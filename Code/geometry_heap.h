@@ -0,0 +1,35 @@
+#pragma once
+
+#include "engine.h"
+
+// TLSF sub-allocator ---------------------------------------------------------------------------------------------------
+
+void InitHeapAllocator(HeapAllocator& allocator, u32 capacity);
+
+//Alignment does not need to be a power of 2, vertex ranges are aligned to the vertex stride
+bool HeapAllocate(HeapAllocator& allocator, u32 size, u32 alignment, HeapAllocation& allocation);
+
+void HeapFree(HeapAllocator& allocator, const HeapAllocation& allocation);
+
+void GrowHeapAllocator(HeapAllocator& allocator, u32 newCapacity);
+
+//Packs every used block at the start of the heap, moves has one entry per used block (even the ones that stay)
+u32 CompactHeapAllocator(HeapAllocator& allocator, std::vector<HeapMove>& moves);
+
+void GetHeapStats(const HeapAllocator& allocator, u32& freeBlockCount, u32& largestFreeBlock);
+
+// GPU heaps ------------------------------------------------------------------------------------------------------------
+
+void InitGeometryHeap(GeometryHeap& heap, u32 vertexCapacity, u32 indexCapacity);
+
+//Both grow the underlying buffer if there is no room left
+HeapAllocation AllocateVertices(GeometryHeap& heap, u32 size, u32 stride);
+HeapAllocation AllocateIndices(GeometryHeap& heap, u32 size);
+
+void FreeSubmeshGeometry(GeometryHeap& heap, Submesh& submesh);
+
+//Reads back the final offsets of the submesh ranges after they were allocated or moved
+void UpdateSubmeshRanges(GeometryHeap& heap, Submesh& submesh);
+
+//Compacts both heaps on the GPU and patches every submesh range
+void DefragmentGeometryHeap(App* app);
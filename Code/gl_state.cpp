@@ -0,0 +1,504 @@
+#include "gl_state.h"
+
+#define GL_STATE_UNKNOWN 0xFFFFFFFFu
+#define GL_STATE_TEXTURE_UNITS 16
+#define GL_STATE_BUFFER_BINDINGS 16
+
+enum CachedTextureTarget
+{
+	CachedTextureTarget_2D,
+	CachedTextureTarget_CubeMap,
+	CachedTextureTarget_Count
+};
+
+enum CachedBufferTarget
+{
+	CachedBufferTarget_Array,
+	CachedBufferTarget_CopyRead,
+	CachedBufferTarget_CopyWrite,
+	CachedBufferTarget_DrawIndirect,
+	CachedBufferTarget_Uniform,
+	CachedBufferTarget_ShaderStorage,
+	CachedBufferTarget_Count
+};
+
+enum CachedCapability
+{
+	CachedCapability_DepthTest,
+	CachedCapability_Blend,
+	CachedCapability_CullFace,
+	CachedCapability_StencilTest,
+	CachedCapability_CubeMapSeamless,
+	CachedCapability_Count
+};
+
+struct CachedBufferRange
+{
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+struct GLStateCache
+{
+	GLuint program;
+	GLuint vertexArray;
+
+	GLuint activeTextureUnit;
+	GLuint textures[GL_STATE_TEXTURE_UNITS][CachedTextureTarget_Count];
+
+	GLuint buffers[CachedBufferTarget_Count];
+	CachedBufferRange uniformRanges[GL_STATE_BUFFER_BINDINGS];
+	CachedBufferRange storageRanges[GL_STATE_BUFFER_BINDINGS];
+
+	GLuint readFramebuffer;
+	GLuint drawFramebuffer;
+
+	u32 capabilities[CachedCapability_Count]; //0, 1 or unknown
+	GLenum blendSrc;
+	GLenum blendDst;
+
+	GLuint depthFunc;
+	GLuint depthMask;
+	GLuint colorMask; //one bit per channel
+	GLuint stencilFunc[3]; //func, ref, mask
+	GLuint stencilOp[3];
+	GLuint stencilMask;
+
+	GLint viewport[4];
+
+	GLStateCounters frameCounters;
+	GLStateCounters lastFrameCounters;
+};
+
+//Mirrors the GL context, which is global too
+static GLStateCache cache;
+
+// Helpers ------------------------------------------------------------------------------------------------------------
+
+//Returns true if the call has to be issued, and updates the cached value
+static bool Changes(GLStateCategory category, GLuint& cached, GLuint value)
+{
+	if (cached == value)
+	{
+		cache.frameCounters.skipped[category]++;
+		return false;
+	}
+
+	cached = value;
+	cache.frameCounters.issued[category]++;
+	return true;
+}
+
+static void Issued(GLStateCategory category)
+{
+	cache.frameCounters.issued[category]++;
+}
+
+static u32 GetCachedTextureTarget(GLenum target)
+{
+	switch (target)
+	{
+	case GL_TEXTURE_2D:       return CachedTextureTarget_2D;
+	case GL_TEXTURE_CUBE_MAP: return CachedTextureTarget_CubeMap;
+	default:                  return CachedTextureTarget_Count;
+	}
+}
+
+//Element array bindings belong to the bound vao, so they are not cached
+static u32 GetCachedBufferTarget(GLenum target)
+{
+	switch (target)
+	{
+	case GL_ARRAY_BUFFER:          return CachedBufferTarget_Array;
+	case GL_COPY_READ_BUFFER:      return CachedBufferTarget_CopyRead;
+	case GL_COPY_WRITE_BUFFER:     return CachedBufferTarget_CopyWrite;
+	case GL_DRAW_INDIRECT_BUFFER:  return CachedBufferTarget_DrawIndirect;
+	case GL_UNIFORM_BUFFER:        return CachedBufferTarget_Uniform;
+	case GL_SHADER_STORAGE_BUFFER: return CachedBufferTarget_ShaderStorage;
+	default:                       return CachedBufferTarget_Count;
+	}
+}
+
+static CachedBufferRange* GetCachedBufferRange(GLenum target, GLuint index)
+{
+	if (index >= GL_STATE_BUFFER_BINDINGS)
+		return NULL;
+
+	switch (target)
+	{
+	case GL_UNIFORM_BUFFER:        return &cache.uniformRanges[index];
+	case GL_SHADER_STORAGE_BUFFER: return &cache.storageRanges[index];
+	default:                       return NULL;
+	}
+}
+
+static u32 GetCachedCapability(GLenum capability)
+{
+	switch (capability)
+	{
+	case GL_DEPTH_TEST:                 return CachedCapability_DepthTest;
+	case GL_BLEND:                      return CachedCapability_Blend;
+	case GL_CULL_FACE:                  return CachedCapability_CullFace;
+	case GL_STENCIL_TEST:               return CachedCapability_StencilTest;
+	case GL_TEXTURE_CUBE_MAP_SEAMLESS:  return CachedCapability_CubeMapSeamless;
+	default:                            return CachedCapability_Count;
+	}
+}
+
+// Frame --------------------------------------------------------------------------------------------------------------
+
+void InvalidateGLState()
+{
+	cache.program = GL_STATE_UNKNOWN;
+	cache.vertexArray = GL_STATE_UNKNOWN;
+	cache.activeTextureUnit = GL_STATE_UNKNOWN;
+
+	for (u32 unit = 0; unit < GL_STATE_TEXTURE_UNITS; ++unit)
+		for (u32 target = 0; target < CachedTextureTarget_Count; ++target)
+			cache.textures[unit][target] = GL_STATE_UNKNOWN;
+
+	for (u32 target = 0; target < CachedBufferTarget_Count; ++target)
+		cache.buffers[target] = GL_STATE_UNKNOWN;
+
+	for (u32 index = 0; index < GL_STATE_BUFFER_BINDINGS; ++index)
+	{
+		cache.uniformRanges[index] = { GL_STATE_UNKNOWN, 0, 0 };
+		cache.storageRanges[index] = { GL_STATE_UNKNOWN, 0, 0 };
+	}
+
+	cache.readFramebuffer = GL_STATE_UNKNOWN;
+	cache.drawFramebuffer = GL_STATE_UNKNOWN;
+
+	for (u32 capability = 0; capability < CachedCapability_Count; ++capability)
+		cache.capabilities[capability] = GL_STATE_UNKNOWN;
+
+	cache.blendSrc = GL_STATE_UNKNOWN;
+	cache.blendDst = GL_STATE_UNKNOWN;
+
+	cache.depthFunc = GL_STATE_UNKNOWN;
+	cache.depthMask = GL_STATE_UNKNOWN;
+	cache.colorMask = GL_STATE_UNKNOWN;
+	cache.stencilFunc[0] = cache.stencilFunc[1] = cache.stencilFunc[2] = GL_STATE_UNKNOWN;
+	cache.stencilOp[0] = cache.stencilOp[1] = cache.stencilOp[2] = GL_STATE_UNKNOWN;
+	cache.stencilMask = GL_STATE_UNKNOWN;
+
+	cache.viewport[0] = cache.viewport[1] = cache.viewport[2] = cache.viewport[3] = -1;
+}
+
+void BeginGLStateFrame()
+{
+	cache.lastFrameCounters = cache.frameCounters;
+	cache.frameCounters = {};
+
+	InvalidateGLState();
+}
+
+const GLStateCounters& GetGLStateCounters()
+{
+	return cache.lastFrameCounters;
+}
+
+const char* GetGLStateCategoryName(GLStateCategory category)
+{
+	switch (category)
+	{
+	case GLStateCategory_Program:      return "Programs";
+	case GLStateCategory_VertexArray:  return "Vertex arrays";
+	case GLStateCategory_Texture:      return "Textures";
+	case GLStateCategory_Buffer:       return "Buffers";
+	case GLStateCategory_Framebuffer:  return "Framebuffers";
+	case GLStateCategory_Capability:   return "Capabilities";
+	case GLStateCategory_Viewport:     return "Viewport";
+	case GLStateCategory_DepthStencil: return "Depth and stencil";
+	default:                           return "Unknown";
+	}
+}
+
+// Setters ------------------------------------------------------------------------------------------------------------
+
+void StateUseProgram(GLuint program)
+{
+	if (Changes(GLStateCategory_Program, cache.program, program))
+		glUseProgram(program);
+}
+
+void StateBindVertexArray(GLuint vertexArray)
+{
+	if (Changes(GLStateCategory_VertexArray, cache.vertexArray, vertexArray))
+		glBindVertexArray(vertexArray);
+}
+
+void StateActiveTexture(GLenum unit)
+{
+	if (Changes(GLStateCategory_Texture, cache.activeTextureUnit, unit))
+		glActiveTexture(unit);
+}
+
+void StateBindTexture(GLenum target, GLuint texture)
+{
+	u32 unit = cache.activeTextureUnit - GL_TEXTURE0;
+	u32 cachedTarget = GetCachedTextureTarget(target);
+
+	if (cache.activeTextureUnit == GL_STATE_UNKNOWN || unit >= GL_STATE_TEXTURE_UNITS || cachedTarget == CachedTextureTarget_Count)
+	{
+		Issued(GLStateCategory_Texture);
+		glBindTexture(target, texture);
+		return;
+	}
+
+	if (Changes(GLStateCategory_Texture, cache.textures[unit][cachedTarget], texture))
+		glBindTexture(target, texture);
+}
+
+void StateBindBuffer(GLenum target, GLuint buffer)
+{
+	u32 cachedTarget = GetCachedBufferTarget(target);
+
+	if (cachedTarget == CachedBufferTarget_Count)
+	{
+		Issued(GLStateCategory_Buffer);
+		glBindBuffer(target, buffer);
+		return;
+	}
+
+	if (Changes(GLStateCategory_Buffer, cache.buffers[cachedTarget], buffer))
+		glBindBuffer(target, buffer);
+}
+
+void StateBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	CachedBufferRange* range = GetCachedBufferRange(target, index);
+
+	if (range && range->buffer == buffer && range->offset == offset && range->size == size)
+	{
+		cache.frameCounters.skipped[GLStateCategory_Buffer]++;
+		return;
+	}
+
+	if (range)
+		*range = { buffer, offset, size };
+
+	//Indexed binds also change the generic binding of the target
+	u32 cachedTarget = GetCachedBufferTarget(target);
+	if (cachedTarget != CachedBufferTarget_Count)
+		cache.buffers[cachedTarget] = buffer;
+
+	Issued(GLStateCategory_Buffer);
+	glBindBufferRange(target, index, buffer, offset, size);
+}
+
+void StateBindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+	CachedBufferRange* range = GetCachedBufferRange(target, index);
+
+	//A size of 0 stands for the whole buffer
+	if (range && range->buffer == buffer && range->offset == 0 && range->size == 0)
+	{
+		cache.frameCounters.skipped[GLStateCategory_Buffer]++;
+		return;
+	}
+
+	if (range)
+		*range = { buffer, 0, 0 };
+
+	u32 cachedTarget = GetCachedBufferTarget(target);
+	if (cachedTarget != CachedBufferTarget_Count)
+		cache.buffers[cachedTarget] = buffer;
+
+	Issued(GLStateCategory_Buffer);
+	glBindBufferBase(target, index, buffer);
+}
+
+void StateBindFramebuffer(GLenum target, GLuint framebuffer)
+{
+	switch (target)
+	{
+	case GL_READ_FRAMEBUFFER:
+		if (Changes(GLStateCategory_Framebuffer, cache.readFramebuffer, framebuffer))
+			glBindFramebuffer(target, framebuffer);
+		break;
+	case GL_DRAW_FRAMEBUFFER:
+		if (Changes(GLStateCategory_Framebuffer, cache.drawFramebuffer, framebuffer))
+			glBindFramebuffer(target, framebuffer);
+		break;
+	default:
+		if (cache.readFramebuffer == framebuffer && cache.drawFramebuffer == framebuffer)
+		{
+			cache.frameCounters.skipped[GLStateCategory_Framebuffer]++;
+			break;
+		}
+
+		cache.readFramebuffer = framebuffer;
+		cache.drawFramebuffer = framebuffer;
+		Issued(GLStateCategory_Framebuffer);
+		glBindFramebuffer(target, framebuffer);
+		break;
+	}
+}
+
+static void SetCapability(GLenum capability, bool enabled)
+{
+	u32 cachedCapability = GetCachedCapability(capability);
+
+	if (cachedCapability != CachedCapability_Count && !Changes(GLStateCategory_Capability, cache.capabilities[cachedCapability], enabled ? 1 : 0))
+		return;
+
+	if (cachedCapability == CachedCapability_Count)
+		Issued(GLStateCategory_Capability);
+
+	if (enabled)
+		glEnable(capability);
+	else
+		glDisable(capability);
+}
+
+void StateEnable(GLenum capability)
+{
+	SetCapability(capability, true);
+}
+
+void StateDisable(GLenum capability)
+{
+	SetCapability(capability, false);
+}
+
+void StateBlendFunc(GLenum src, GLenum dst)
+{
+	if (cache.blendSrc == src && cache.blendDst == dst)
+	{
+		cache.frameCounters.skipped[GLStateCategory_Capability]++;
+		return;
+	}
+
+	cache.blendSrc = src;
+	cache.blendDst = dst;
+	Issued(GLStateCategory_Capability);
+	glBlendFunc(src, dst);
+}
+
+void StateDepthFunc(GLenum func)
+{
+	if (Changes(GLStateCategory_DepthStencil, cache.depthFunc, func))
+		glDepthFunc(func);
+}
+
+void StateDepthMask(GLboolean enabled)
+{
+	if (Changes(GLStateCategory_DepthStencil, cache.depthMask, enabled ? 1 : 0))
+		glDepthMask(enabled);
+}
+
+void StateColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha)
+{
+	GLuint mask = (red ? 1 : 0) | (green ? 2 : 0) | (blue ? 4 : 0) | (alpha ? 8 : 0);
+	if (Changes(GLStateCategory_DepthStencil, cache.colorMask, mask))
+		glColorMask(red, green, blue, alpha);
+}
+
+void StateStencilFunc(GLenum func, GLint ref, GLuint mask)
+{
+	if (cache.stencilFunc[0] == func && cache.stencilFunc[1] == (GLuint)ref && cache.stencilFunc[2] == mask)
+	{
+		cache.frameCounters.skipped[GLStateCategory_DepthStencil]++;
+		return;
+	}
+
+	cache.stencilFunc[0] = func;
+	cache.stencilFunc[1] = (GLuint)ref;
+	cache.stencilFunc[2] = mask;
+	Issued(GLStateCategory_DepthStencil);
+	glStencilFunc(func, ref, mask);
+}
+
+void StateStencilOp(GLenum stencilFail, GLenum depthFail, GLenum depthPass)
+{
+	if (cache.stencilOp[0] == stencilFail && cache.stencilOp[1] == depthFail && cache.stencilOp[2] == depthPass)
+	{
+		cache.frameCounters.skipped[GLStateCategory_DepthStencil]++;
+		return;
+	}
+
+	cache.stencilOp[0] = stencilFail;
+	cache.stencilOp[1] = depthFail;
+	cache.stencilOp[2] = depthPass;
+	Issued(GLStateCategory_DepthStencil);
+	glStencilOp(stencilFail, depthFail, depthPass);
+}
+
+void StateStencilMask(GLuint mask)
+{
+	if (Changes(GLStateCategory_DepthStencil, cache.stencilMask, mask))
+		glStencilMask(mask);
+}
+
+void StateViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	if (cache.viewport[0] == x && cache.viewport[1] == y && cache.viewport[2] == width && cache.viewport[3] == height)
+	{
+		cache.frameCounters.skipped[GLStateCategory_Viewport]++;
+		return;
+	}
+
+	cache.viewport[0] = x;
+	cache.viewport[1] = y;
+	cache.viewport[2] = width;
+	cache.viewport[3] = height;
+	Issued(GLStateCategory_Viewport);
+	glViewport(x, y, width, height);
+}
+
+// Deletion -----------------------------------------------------------------------------------------------------------
+
+void StateDeleteBuffer(GLuint buffer)
+{
+	for (u32 target = 0; target < CachedBufferTarget_Count; ++target)
+		if (cache.buffers[target] == buffer)
+			cache.buffers[target] = GL_STATE_UNKNOWN;
+
+	for (u32 index = 0; index < GL_STATE_BUFFER_BINDINGS; ++index)
+	{
+		if (cache.uniformRanges[index].buffer == buffer)
+			cache.uniformRanges[index].buffer = GL_STATE_UNKNOWN;
+		if (cache.storageRanges[index].buffer == buffer)
+			cache.storageRanges[index].buffer = GL_STATE_UNKNOWN;
+	}
+
+	glDeleteBuffers(1, &buffer);
+}
+
+void StateDeleteVertexArray(GLuint vertexArray)
+{
+	if (cache.vertexArray == vertexArray)
+		cache.vertexArray = GL_STATE_UNKNOWN;
+
+	glDeleteVertexArrays(1, &vertexArray);
+}
+
+void StateDeleteTexture(GLuint texture)
+{
+	for (u32 unit = 0; unit < GL_STATE_TEXTURE_UNITS; ++unit)
+		for (u32 target = 0; target < CachedTextureTarget_Count; ++target)
+			if (cache.textures[unit][target] == texture)
+				cache.textures[unit][target] = GL_STATE_UNKNOWN;
+
+	glDeleteTextures(1, &texture);
+}
+
+void StateDeleteProgram(GLuint program)
+{
+	if (cache.program == program)
+		cache.program = GL_STATE_UNKNOWN;
+
+	glDeleteProgram(program);
+}
+
+void StateDeleteFramebuffer(GLuint framebuffer)
+{
+	if (cache.readFramebuffer == framebuffer)
+		cache.readFramebuffer = GL_STATE_UNKNOWN;
+	if (cache.drawFramebuffer == framebuffer)
+		cache.drawFramebuffer = GL_STATE_UNKNOWN;
+
+	glDeleteFramebuffers(1, &framebuffer);
+}
\ No newline at end of file
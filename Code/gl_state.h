@@ -0,0 +1,71 @@
+//
+// gl_state.h: Thin layer over the GL state setters. It remembers what is bound and skips the calls
+// that would not change anything. Every engine bind should go through here, otherwise the cache
+// gets out of sync with the context.
+//
+
+#pragma once
+
+#include "engine.h"
+
+enum GLStateCategory
+{
+	GLStateCategory_Program,
+	GLStateCategory_VertexArray,
+	GLStateCategory_Texture,
+	GLStateCategory_Buffer,
+	GLStateCategory_Framebuffer,
+	GLStateCategory_Capability,
+	GLStateCategory_Viewport,
+	GLStateCategory_DepthStencil,
+	GLStateCategory_Count
+};
+
+struct GLStateCounters
+{
+	u32 issued[GLStateCategory_Count];
+	u32 skipped[GLStateCategory_Count];
+};
+
+//Forgets everything, for when something outside the engine (ImGui) may have touched the context
+void InvalidateGLState();
+
+//Invalidates the cache and starts counting a new frame
+void BeginGLStateFrame();
+
+//Counters of the last complete frame
+const GLStateCounters& GetGLStateCounters();
+const char* GetGLStateCategoryName(GLStateCategory category);
+
+void StateUseProgram(GLuint program);
+void StateBindVertexArray(GLuint vertexArray);
+
+void StateActiveTexture(GLenum unit);
+void StateBindTexture(GLenum target, GLuint texture);
+
+void StateBindBuffer(GLenum target, GLuint buffer);
+void StateBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+void StateBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+void StateBindFramebuffer(GLenum target, GLuint framebuffer);
+
+void StateEnable(GLenum capability);
+void StateDisable(GLenum capability);
+void StateBlendFunc(GLenum src, GLenum dst);
+
+//Depth and stencil tests, and the write masks. The masks also apply to glClear.
+void StateDepthFunc(GLenum func);
+void StateDepthMask(GLboolean enabled);
+void StateColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha);
+void StateStencilFunc(GLenum func, GLint ref, GLuint mask);
+void StateStencilOp(GLenum stencilFail, GLenum depthFail, GLenum depthPass);
+void StateStencilMask(GLuint mask);
+
+void StateViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+//Deleted names are unbound by GL and may be reused, so they have to be dropped from the cache
+void StateDeleteBuffer(GLuint buffer);
+void StateDeleteVertexArray(GLuint vertexArray);
+void StateDeleteTexture(GLuint texture);
+void StateDeleteProgram(GLuint program);
+void StateDeleteFramebuffer(GLuint framebuffer);
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include "gpu_culling.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+#include "resource_management.h"
+
+#define GPU_CULLING_GROUP_SIZE 64
+#define HIZ_GROUP_SIZE 8
+
+static u32 FloorPowerOf2(u32 value)
+{
+	u32 power = 1;
+	while (power * 2 <= value)
+		power *= 2;
+	return power;
+}
+
+//The pyramid only stands for the current view while the camera stays close to where it was
+static bool IsHiZUsable(const App* app)
+{
+	const HiZPyramid& hiZ = app->hiZ;
+	if (!hiZ.enabled || !hiZ.valid)
+		return false;
+
+	const vec3 cameraPosition = vec3(app->camera.transformation[3]);
+	const vec3 cameraForward = -vec3(app->camera.transformation[2]);
+
+	const f32 turnCosine = glm::dot(glm::normalize(cameraForward), glm::normalize(hiZ.cameraForward));
+	return glm::distance(cameraPosition, hiZ.cameraPosition) <= hiZ.maxCameraMove && turnCosine >= cosf(glm::radians(hiZ.maxCameraTurnDegrees));
+}
+
+void InitGpuCulling(App* app)
+{
+	GpuCuller& culler = app->gpuCuller;
+
+	culler.programIdx = LoadComputeProgram(app, "gpu_culling.glsl", "FRUSTUM_CULL_INSTANCES");
+	Program& program = app->programs[culler.programIdx];
+
+	culler.planesLocation = glGetUniformLocation(program.handle, "uPlanes");
+	culler.instanceCountLocation = glGetUniformLocation(program.handle, "uInstanceCount");
+	culler.occlusionEnabledLocation = glGetUniformLocation(program.handle, "uOcclusionEnabled");
+	culler.hiZLocation = glGetUniformLocation(program.handle, "uHiZ");
+	culler.hiZLevelCountLocation = glGetUniformLocation(program.handle, "uHiZLevelCount");
+	culler.hiZViewProjectionLocation = glGetUniformLocation(program.handle, "uHiZViewProjection");
+
+	//Grown in CullDrawsOnGpu if the scene gets bigger
+	culler.instancesBuffer = CreateBuffer(KB(64), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+
+	HiZPyramid& hiZ = app->hiZ;
+
+	hiZ.reduceProgramIdx = LoadComputeProgram(app, "gpu_culling.glsl", "HIZ_REDUCE");
+	Program& reduceProgram = app->programs[hiZ.reduceProgramIdx];
+
+	hiZ.sourceLocation = glGetUniformLocation(reduceProgram.handle, "uSource");
+	hiZ.sourceLevelLocation = glGetUniformLocation(reduceProgram.handle, "uSourceLevel");
+	hiZ.sourceIsDepthLocation = glGetUniformLocation(reduceProgram.handle, "uSourceIsDepth");
+	hiZ.sourceSizeLocation = glGetUniformLocation(reduceProgram.handle, "uSourceSize");
+
+	hiZ.enabled = true;
+	hiZ.maxCameraMove = 0.5f;
+	hiZ.maxCameraTurnDegrees = 5.0f;
+}
+
+void BuildHiZPyramid(App* app)
+{
+	HiZPyramid& hiZ = app->hiZ;
+
+	// Storage, recreated when the framebuffers are resized ---------------------------------------------------------
+	const ivec2 renderSize = app->frameBufferResize.renderSize;
+	const ivec2 size = ivec2(FloorPowerOf2(renderSize.x), FloorPowerOf2(renderSize.y));
+
+	if (hiZ.texture == 0 || size != hiZ.size)
+	{
+		if (hiZ.texture != 0)
+			StateDeleteTexture(hiZ.texture);
+
+		hiZ.size = size;
+		hiZ.levelCount = 1;
+		while ((1 << hiZ.levelCount) <= glm::max(size.x, size.y))
+			hiZ.levelCount++;
+
+		glGenTextures(1, &hiZ.texture);
+		StateBindTexture(GL_TEXTURE_2D, hiZ.texture);
+		glTexStorage2D(GL_TEXTURE_2D, hiZ.levelCount, GL_RG32F, size.x, size.y);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	// Reduce, each level from the one above, level 0 from the depth buffer -----------------------------------------
+	Program& program = app->programs[hiZ.reduceProgramIdx];
+	StateUseProgram(program.handle);
+
+	StateActiveTexture(GL_TEXTURE0);
+	glUniform1i(hiZ.sourceLocation, 0);
+
+	ivec2 sourceSize = renderSize;
+	ivec2 levelSize = size;
+	for (u32 level = 0; level < hiZ.levelCount; ++level)
+	{
+		glUniform2i(hiZ.sourceSizeLocation, sourceSize.x, sourceSize.y);
+		StateBindTexture(GL_TEXTURE_2D, level == 0 ? app->depthAttachmentHandle : hiZ.texture);
+		glUniform1i(hiZ.sourceLevelLocation, level == 0 ? 0 : level - 1);
+		glUniform1i(hiZ.sourceIsDepthLocation, level == 0);
+
+		glBindImageTexture(0, hiZ.texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+		glDispatchCompute((levelSize.x + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (levelSize.y + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+
+		//The next level reads this one
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		sourceSize = levelSize;
+		levelSize = glm::max(levelSize / 2, ivec2(1));
+	}
+
+	hiZ.viewProjection = app->viewProjection;
+	hiZ.cameraPosition = vec3(app->camera.transformation[3]);
+	hiZ.cameraForward = -vec3(app->camera.transformation[2]);
+	hiZ.valid = true;
+}
+
+u32 CullDrawsOnGpu(App* app, u32 drawCount)
+{
+	GpuCuller& culler = app->gpuCuller;
+	const std::vector<IndirectDraw>& draws = app->indirectDraws;
+
+	// Commands start empty, the compute shader counts the instances ------------------------------------------------
+	app->indirectCommands.clear();
+	culler.commandDraws.clear();
+	culler.instances.resize(drawCount);
+
+	for (u32 i = 0; i < drawCount; ++i)
+	{
+		const IndirectDraw& draw = draws[i];
+
+		if (i == 0 || draw.submesh != draws[i - 1].submesh || draw.materialIdx != draws[i - 1].materialIdx)
+		{
+			const Submesh& submesh = *draw.submesh;
+
+			//The instances of a command get the slots [baseInstance, baseInstance + draws of the command)
+			DrawElementsIndirectCommand command = {};
+			command.count = submesh.indexCount;
+			command.instanceCount = 0;
+			command.firstIndex = submesh.firstIndex;
+			command.baseVertex = submesh.baseVertex;
+			command.baseInstance = i;
+
+			app->indirectCommands.push_back(command);
+			culler.commandDraws.push_back(i);
+		}
+
+		GpuCullInstance& instance = culler.instances[i];
+		instance.localSphere = draw.submesh->boundingSphere;
+		instance.commandIdx = (u32)app->indirectCommands.size() - 1;
+		instance.instanceParamIdx = app->entityList[draw.entityIdx].instanceIdx;
+	}
+
+	const u32 commandCount = (u32)app->indirectCommands.size();
+
+	// Upload, orphaning so the previous frame can still read the old contents --------------------------------------
+	u32 commandsSize = commandCount * sizeof(DrawElementsIndirectCommand);
+	app->indirectBuffer.size = glm::max(app->indirectBuffer.size, commandsSize);
+	StateBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.handle);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, app->indirectBuffer.size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commandsSize, app->indirectCommands.data());
+
+	u32 instancesSize = drawCount * sizeof(GpuCullInstance);
+	if (instancesSize > culler.instancesBuffer.size)
+	{
+		StateDeleteBuffer(culler.instancesBuffer.handle);
+		culler.instancesBuffer = CreateBuffer(instancesSize * 2, GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+	}
+
+	StateBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.instancesBuffer.handle);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, culler.instancesBuffer.size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instancesSize, culler.instances.data());
+
+	Buffer& instanceIndices = app->geometryHeap.instanceIndices;
+	StateBindBuffer(GL_ARRAY_BUFFER, instanceIndices.handle);
+	glBufferData(GL_ARRAY_BUFFER, instanceIndices.size, NULL, GL_STREAM_DRAW);
+
+	if (drawCount == 0)
+		return 0;
+
+	// Cull -----------------------------------------------------------------------------------------------------------
+	Program& program = app->programs[culler.programIdx];
+	StateUseProgram(program.handle);
+
+	//Planes that every sphere is in front of, so nothing gets culled
+	vec4 planes[6];
+	for (u32 i = 0; i < 6; ++i)
+	{
+		planes[i] = app->frustumCuller.enabled ? app->frustumCuller.planes[i] : vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	glUniform4fv(culler.planesLocation, 6, &planes[0][0]);
+	glUniform1ui(culler.instanceCountLocation, drawCount);
+
+	//Previous frame depth, the test is skipped until there is one and when the camera moved too much since
+	HiZPyramid& hiZ = app->hiZ;
+	hiZ.usedThisFrame = IsHiZUsable(app);
+
+	glUniform1i(culler.occlusionEnabledLocation, hiZ.usedThisFrame);
+	if (hiZ.usedThisFrame)
+	{
+		StateActiveTexture(GL_TEXTURE0);
+		StateBindTexture(GL_TEXTURE_2D, hiZ.texture);
+		glUniform1i(culler.hiZLocation, 0);
+		glUniform1i(culler.hiZLevelCountLocation, hiZ.levelCount);
+		glUniformMatrix4fv(culler.hiZViewProjectionLocation, 1, GL_FALSE, &hiZ.viewProjection[0][0]);
+	}
+
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, app->instanceParamsBuffer.handle);
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culler.instancesBuffer.handle);
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, app->indirectBuffer.handle);
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, instanceIndices.handle);
+
+	glDispatchCompute((drawCount + GPU_CULLING_GROUP_SIZE - 1) / GPU_CULLING_GROUP_SIZE, 1, 1);
+
+	//The draws read the counts as indirect commands and the remap table as a vertex attribute
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+	return commandCount;
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "engine.h"
+
+//Loads the culling and Hi-Z compute shaders and creates the culling input buffer
+void InitGpuCulling(App* app);
+
+//Turns the first drawCount sorted draws into one indirect command per submesh and material, with no instances,
+//then runs the compute shader that frustum and occlusion culls every draw and fills the instance counts and the instance remap
+//table on the GPU. Returns the number of commands written to the indirect buffer.
+u32 CullDrawsOnGpu(App* app, u32 drawCount);
+
+//Reduces the depth buffer of the G-buffer pass into the Hi-Z pyramid the next frame culls against
+void BuildHiZPyramid(App* app);
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "light_buffer.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+
+#define LIGHTS_BUFFER_INITIAL_COUNT 64
+
+static GpuLight ToGpuLight(const Light& light)
+{
+	GpuLight gpuLight = {};
+	gpuLight.position = light.position;
+	gpuLight.radius = light.radius;
+	gpuLight.color = light.color;
+	gpuLight.strength = (f32)light.strength;
+	gpuLight.direction = light.direction;
+	gpuLight.type = light.type;
+	return gpuLight;
+}
+
+void InitLightBuffer(App* app)
+{
+	LightBuffer& lightBuffer = app->lightBuffer;
+
+	lightBuffer.lights = CreateBuffer(LIGHTS_BUFFER_HEADER_SIZE + LIGHTS_BUFFER_INITIAL_COUNT * sizeof(GpuLight), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+	lightBuffer.directionalLights = CreateBuffer((1 + LIGHTS_BUFFER_INITIAL_COUNT) * sizeof(u32), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+
+	//Empty until the first upload
+	u32 zero = 0;
+	StateBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer.lights.handle);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+	StateBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer.directionalLights.handle);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+}
+
+#pragma region Upload
+
+//Only the runs of entries that differ from the mirror are sent, most frames nothing moves
+static void UploadChangedLights(App* app)
+{
+	LightBuffer& lightBuffer = app->lightBuffer;
+	const u32 lightCount = (u32)app->lightList.size();
+
+	//A bigger buffer starts empty, everything has to be sent again
+	u32 lightsSize = LIGHTS_BUFFER_HEADER_SIZE + lightCount * sizeof(GpuLight);
+	if (lightsSize > lightBuffer.lights.size)
+	{
+		StateDeleteBuffer(lightBuffer.lights.handle);
+		lightBuffer.lights = CreateBuffer(lightsSize * 2, GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+		lightBuffer.uploaded.clear();
+	}
+
+	//Bound after the grow, CreateBuffer leaves the target unbound
+	StateBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer.lights.handle);
+
+	const bool countChanged = lightBuffer.uploaded.size() != lightCount;
+	const u32 keptCount = (u32)lightBuffer.uploaded.size();
+	lightBuffer.uploaded.resize(lightCount);
+
+	u32 i = 0;
+	while (i < lightCount)
+	{
+		GpuLight gpuLight = ToGpuLight(app->lightList[i]);
+		if (i < keptCount && memcmp(&gpuLight, &lightBuffer.uploaded[i], sizeof(GpuLight)) == 0)
+		{
+			++i;
+			continue;
+		}
+
+		//Extend the run until an entry that is already on the GPU
+		u32 runStart = i;
+		lightBuffer.uploaded[i++] = gpuLight;
+		while (i < lightCount)
+		{
+			gpuLight = ToGpuLight(app->lightList[i]);
+			if (i < keptCount && memcmp(&gpuLight, &lightBuffer.uploaded[i], sizeof(GpuLight)) == 0)
+				break;
+
+			lightBuffer.uploaded[i++] = gpuLight;
+		}
+
+		u32 runSize = (i - runStart) * sizeof(GpuLight);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, LIGHTS_BUFFER_HEADER_SIZE + runStart * sizeof(GpuLight), runSize, &lightBuffer.uploaded[runStart]);
+
+		lightBuffer.uploadedLights += i - runStart;
+		lightBuffer.uploadedBytes += runSize;
+	}
+
+	if (countChanged)
+	{
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(lightCount), &lightCount);
+		lightBuffer.uploadedBytes += sizeof(lightCount);
+	}
+}
+
+//Lets the shaders that only want the directional lights skip the point lights without reading them
+static void UploadDirectionalLights(App* app)
+{
+	LightBuffer& lightBuffer = app->lightBuffer;
+
+	std::vector<u32> directionalIndices;
+	for (u32 i = 0; i < (u32)app->lightList.size(); ++i)
+	{
+		if (app->lightList[i].type == LightType_Directional)
+			directionalIndices.push_back(i);
+	}
+
+	if (directionalIndices == lightBuffer.directionalIndices)
+		return;
+
+	u32 directionalSize = (1 + (u32)directionalIndices.size()) * sizeof(u32);
+	if (directionalSize > lightBuffer.directionalLights.size)
+	{
+		StateDeleteBuffer(lightBuffer.directionalLights.handle);
+		lightBuffer.directionalLights = CreateBuffer(directionalSize * 2, GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+	}
+
+	u32 directionalCount = (u32)directionalIndices.size();
+	StateBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer.directionalLights.handle);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(directionalCount), &directionalCount);
+	if (directionalCount > 0)
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(directionalCount), directionalCount * sizeof(u32), directionalIndices.data());
+
+	lightBuffer.directionalIndices.swap(directionalIndices);
+	lightBuffer.uploadedBytes += directionalSize;
+}
+
+void UploadLights(App* app)
+{
+	LightBuffer& lightBuffer = app->lightBuffer;
+	lightBuffer.uploadedLights = 0;
+	lightBuffer.uploadedBytes = 0;
+
+	UploadChangedLights(app);
+	UploadDirectionalLights(app);
+
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_BUFFER_BINDING, lightBuffer.lights.handle);
+	StateBindBufferBase(GL_SHADER_STORAGE_BUFFER, DIRECTIONAL_LIGHTS_BUFFER_BINDING, lightBuffer.directionalLights.handle);
+}
+
+#pragma endregion
\ No newline at end of file
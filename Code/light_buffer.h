@@ -0,0 +1,10 @@
+#pragma once
+
+#include "engine.h"
+
+//Creates the lights and directional lights storage buffers, both grow when there are more lights
+void InitLightBuffer(App* app);
+
+//Sends the entries of lightList that changed since the last upload and binds both buffers
+//at LIGHTS_BUFFER_BINDING and DIRECTIONAL_LIGHTS_BUFFER_BINDING for every lighting shader
+void UploadLights(App* app);
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "light_volumes.h"
+#include "clustered_lighting.h"
+#include "gl_state.h"
+#include "resource_management.h"
+
+//Distance from the center to the closest face plane, the mesh reaches the unit sphere only at its vertices
+static f32 GetInscribedRadius(const VertexV3V2 vertices[], const u16 indices[], u32 indexCount)
+{
+	f32 inscribedRadius = 1.0f;
+	for (u32 i = 0; i + 2 < indexCount; i += 3)
+	{
+		const vec3& a = vertices[indices[i]].pos;
+		const vec3& b = vertices[indices[i + 1]].pos;
+		const vec3& c = vertices[indices[i + 2]].pos;
+
+		vec3 normal = glm::normalize(glm::cross(b - a, c - a));
+		inscribedRadius = glm::min(inscribedRadius, glm::abs(glm::dot(normal, a)));
+	}
+	return inscribedRadius;
+}
+
+void InitLightVolumes(App* app, const VertexV3V2 sphereVertices[], const u16 sphereIndices[], u32 sphereIndexCount)
+{
+	LightVolumes& volumes = app->lightVolumes;
+
+	volumes.stencilProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "LIGHT_VOLUME_STENCIL");
+	Program& stencilProgram = app->programs[volumes.stencilProgramIdx];
+
+	volumes.stencilViewProjectionLocation = glGetUniformLocation(stencilProgram.handle, "uViewProjection");
+	volumes.stencilLightPositionRadiusLocation = glGetUniformLocation(stencilProgram.handle, "uLightPositionRadius");
+	volumes.stencilVolumeScaleLocation = glGetUniformLocation(stencilProgram.handle, "uVolumeScale");
+
+	volumes.shadingProgramIdx = LoadProgram(app, "render_textures_shader.glsl", "LIGHT_VOLUME_PASS");
+	Program& shadingProgram = app->programs[volumes.shadingProgramIdx];
+
+	volumes.shadingViewProjectionLocation = glGetUniformLocation(shadingProgram.handle, "uViewProjection");
+	volumes.shadingLightPositionRadiusLocation = glGetUniformLocation(shadingProgram.handle, "uLightPositionRadius");
+	volumes.shadingVolumeScaleLocation = glGetUniformLocation(shadingProgram.handle, "uVolumeScale");
+	volumes.shadingLightColorLocation = glGetUniformLocation(shadingProgram.handle, "uLightColor");
+	volumes.shadingDepthTextureLocation = glGetUniformLocation(shadingProgram.handle, "depthTexture");
+	volumes.shadingNormalTextureLocation = glGetUniformLocation(shadingProgram.handle, "normalTexture");
+	volumes.shadingAlbedoTextureLocation = glGetUniformLocation(shadingProgram.handle, "albedoTexture");
+	volumes.shadingInverseViewProjectionLocation = glGetUniformLocation(shadingProgram.handle, "uInverseViewProjection");
+	volumes.shadingInverseViewportSizeLocation = glGetUniformLocation(shadingProgram.handle, "uInverseViewportSize");
+	volumes.shadingUvScaleLocation = glGetUniformLocation(shadingProgram.handle, "uUvScale");
+
+	volumes.volumeScale = 1.0f / GetInscribedRadius(sphereVertices, sphereIndices, sphereIndexCount);
+	volumes.sphereIndexCount = sphereIndexCount;
+
+	glGenFramebuffers(1, &volumes.depthCopyFramebuffer);
+	StateBindFramebuffer(GL_READ_FRAMEBUFFER, volumes.depthCopyFramebuffer);
+	glReadBuffer(GL_NONE);
+	StateBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+static bool IsSphereOutsideFrustum(const vec4 planes[6], vec3 center, f32 radius)
+{
+	for (u32 i = 0; i < 6; ++i)
+	{
+		if (glm::dot(vec3(planes[i]), center) + planes[i].w < -radius)
+			return true;
+	}
+	return false;
+}
+
+void LightVolumesPass(App* app)
+{
+	LightVolumes& volumes = app->lightVolumes;
+
+	BeginLightingTimer(app);
+
+	ivec2 viewportSize = GetRenderViewportSize(app, 1.0f);
+	StateViewport(0, 0, viewportSize.x, viewportSize.y);
+
+	// Scene depth into the depth stencil target of the pass, the G-buffer depth is sampled so it can't be attached ---
+	StateBindFramebuffer(GL_READ_FRAMEBUFFER, volumes.depthCopyFramebuffer);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, app->depthAttachmentHandle, 0);
+	glBlitFramebuffer(0, 0, viewportSize.x, viewportSize.y, 0, 0, viewportSize.x, viewportSize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+	//Detached so the pool can recycle the texture
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	StateStencilMask(0xFF);
+	glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	// Directional lights light every pixel -------------------------------------------------------------------------
+	StateDisable(GL_DEPTH_TEST);
+	DrawFullScreenLighting(app, true);
+
+	// Point lights, each one added on top of the others ------------------------------------------------------------
+	mat4 inverseViewProjection = glm::inverse(app->viewProjection);
+	vec2 inverseViewportSize = vec2(1.0f) / vec2(viewportSize);
+	vec2 uvScale = GetRenderTargetUvScale(app);
+
+	Program& stencilProgram = app->programs[volumes.stencilProgramIdx];
+	StateUseProgram(stencilProgram.handle);
+	glUniformMatrix4fv(volumes.stencilViewProjectionLocation, 1, GL_FALSE, &app->viewProjection[0][0]);
+	glUniform1f(volumes.stencilVolumeScaleLocation, volumes.volumeScale);
+
+	Program& shadingProgram = app->programs[volumes.shadingProgramIdx];
+	StateUseProgram(shadingProgram.handle);
+	glUniformMatrix4fv(volumes.shadingViewProjectionLocation, 1, GL_FALSE, &app->viewProjection[0][0]);
+	glUniformMatrix4fv(volumes.shadingInverseViewProjectionLocation, 1, GL_FALSE, &inverseViewProjection[0][0]);
+	glUniform1f(volumes.shadingVolumeScaleLocation, volumes.volumeScale);
+	glUniform2fv(volumes.shadingInverseViewportSizeLocation, 1, &inverseViewportSize[0]);
+	glUniform2fv(volumes.shadingUvScaleLocation, 1, &uvScale[0]);
+
+	StateBindBufferRange(GL_UNIFORM_BUFFER, 0, app->uniformsBuffer.handle, 0, app->globalParamsSize);
+
+	glUniform1i(volumes.shadingDepthTextureLocation, 0);
+	StateActiveTexture(GL_TEXTURE0);
+	StateBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+
+	glUniform1i(volumes.shadingNormalTextureLocation, 1);
+	StateActiveTexture(GL_TEXTURE1);
+	StateBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+
+	glUniform1i(volumes.shadingAlbedoTextureLocation, 2);
+	StateActiveTexture(GL_TEXTURE2);
+	StateBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
+
+	StateBindVertexArray(app->sphere_vao);
+	StateEnable(GL_STENCIL_TEST);
+	StateEnable(GL_BLEND);
+	StateBlendFunc(GL_ONE, GL_ONE);
+	StateDepthMask(GL_FALSE);
+	StateStencilMask(1);
+
+	volumes.drawnLights = 0;
+	volumes.culledLights = 0;
+
+	for (const Light& light : app->lightList)
+	{
+		if (light.type != LightType_Point)
+			continue;
+
+		if (IsSphereOutsideFrustum(app->frustumCuller.planes, light.position, light.radius))
+		{
+			volumes.culledLights++;
+			continue;
+		}
+
+		vec4 positionRadius = vec4(light.position, light.radius);
+
+		//Every face behind the scene flips the bit, only the pixels inside the sphere have one of them behind.
+		//Works with the camera inside the sphere and whatever the winding of the mesh.
+		StateUseProgram(stencilProgram.handle);
+		glUniform4fv(volumes.stencilLightPositionRadiusLocation, 1, &positionRadius[0]);
+
+		StateEnable(GL_DEPTH_TEST);
+		StateColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		StateStencilFunc(GL_ALWAYS, 0, 1);
+		StateStencilOp(GL_KEEP, GL_INVERT, GL_KEEP);
+		glDrawElements(GL_TRIANGLES, volumes.sphereIndexCount, GL_UNSIGNED_SHORT, 0);
+
+		//Shades the marked pixels once, clearing the bit for the next light
+		StateUseProgram(shadingProgram.handle);
+		glUniform4fv(volumes.shadingLightPositionRadiusLocation, 1, &positionRadius[0]);
+		vec3 color = light.color * (f32)light.strength;
+		glUniform3fv(volumes.shadingLightColorLocation, 1, &color[0]);
+
+		StateDisable(GL_DEPTH_TEST);
+		StateColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		StateStencilFunc(GL_EQUAL, 1, 1);
+		StateStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+		glDrawElements(GL_TRIANGLES, volumes.sphereIndexCount, GL_UNSIGNED_SHORT, 0);
+
+		volumes.drawnLights++;
+	}
+
+	StateStencilMask(0xFF);
+	StateDepthMask(GL_TRUE);
+	StateDisable(GL_BLEND);
+	StateDisable(GL_STENCIL_TEST);
+
+	EndLightingTimer(app);
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "engine.h"
+#include "resource_management.h"
+
+//Loads the stencil and shading programs. The sphere mesh is the one of sphere_vao, its faces are
+//measured to know how much it has to be scaled to contain the whole light radius.
+void InitLightVolumes(App* app, const VertexV3V2 sphereVertices[], const u16 sphereIndices[], u32 sphereIndexCount);
+
+//Directional lights in one full screen pass, then each point light on the pixels inside its sphere only
+void LightVolumesPass(App* app);
\ No newline at end of file
@@ -110,9 +110,7 @@ void OnGlfwCharEvent(GLFWwindow* window, unsigned int character)
 void OnGlfwResizeFramebuffer(GLFWwindow* window, int width, int height)
 {
 	App* app = (App*)glfwGetWindowUserPointer(window);
-	app->displaySize = vec2(width, height);
-
-	GenFrameBuffers(app);
+	OnFrameBufferResized(app, ivec2(width, height));
 }
 
 void OnGlfwCloseWindow(GLFWwindow* window)
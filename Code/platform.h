@@ -13,7 +13,9 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
+#include <deque>
 #include <string>
+#include <mutex>
 
 #pragma warning(disable : 4267) // conversion from X to Y, possible loss of data
 
@@ -0,0 +1,360 @@
+#include "render_graph.h"
+#include "gl_state.h"
+#include "render_target_pool.h"
+#include <algorithm>
+
+#pragma region Declaration
+
+void InitRenderGraph(RenderGraph& graph)
+{
+	RenderGraphResource backbuffer = {};
+	backbuffer.name = "Backbuffer";
+	backbuffer.imported = true;
+	graph.resources.push_back(backbuffer);
+}
+
+u32 AddRenderGraphResource(RenderGraph& graph, const char* name, const RenderTargetDesc& desc)
+{
+	RenderGraphResource resource = {};
+	resource.name = name;
+	resource.desc = desc;
+	graph.resources.push_back(resource);
+	return (u32)graph.resources.size() - 1;
+}
+
+void BeginRenderGraph(RenderGraph& graph)
+{
+	graph.passes.clear();
+}
+
+u32 AddRenderGraphPass(RenderGraph& graph, const char* name, RenderGraphExecute execute)
+{
+	RenderGraphPass pass = {};
+	pass.name = name;
+	pass.execute = execute;
+	pass.depth = RENDER_GRAPH_NONE;
+	graph.passes.push_back(pass);
+	return (u32)graph.passes.size() - 1;
+}
+
+void ReadRenderGraphResource(RenderGraph& graph, u32 pass, u32 resource)
+{
+	RenderGraphPass& graphPass = graph.passes[pass];
+	ASSERT(graphPass.readCount < RENDER_GRAPH_MAX_READS, "Too many reads in a render graph pass");
+	graphPass.reads[graphPass.readCount++] = resource;
+}
+
+void WriteRenderGraphResource(RenderGraph& graph, u32 pass, u32 resource)
+{
+	RenderGraphPass& graphPass = graph.passes[pass];
+	ASSERT(graphPass.colorWriteCount < RENDER_GRAPH_MAX_COLOR_WRITES, "Too many color writes in a render graph pass");
+	graphPass.colorWrites[graphPass.colorWriteCount++] = resource;
+}
+
+void SetRenderGraphDepth(RenderGraph& graph, u32 pass, u32 resource)
+{
+	graph.passes[pass].depth = resource;
+}
+
+void SetRenderGraphSideEffects(RenderGraph& graph, u32 pass)
+{
+	graph.passes[pass].sideEffects = true;
+}
+
+#pragma endregion
+
+#pragma region Compilation
+
+//Every resource a pass touches, once
+static u32 GetPassResources(const RenderGraphPass& pass, u32 (&resources)[RENDER_GRAPH_MAX_READS + RENDER_GRAPH_MAX_COLOR_WRITES + 1])
+{
+	u32 count = 0;
+	auto add = [&](u32 resource)
+	{
+		for (u32 i = 0; i < count; ++i)
+			if (resources[i] == resource)
+				return;
+		resources[count++] = resource;
+	};
+
+	for (u32 i = 0; i < pass.readCount; ++i)
+		add(pass.reads[i]);
+	for (u32 i = 0; i < pass.colorWriteCount; ++i)
+		add(pass.colorWrites[i]);
+	if (pass.depth != RENDER_GRAPH_NONE)
+		add(pass.depth);
+
+	return count;
+}
+
+void CompileRenderGraph(RenderGraph& graph)
+{
+	std::vector<bool> needed(graph.resources.size(), false);
+	needed[RenderResource_Backbuffer] = true;
+
+	// Cull, backwards from the backbuffer ------------------------------------------------------------------------------
+	graph.culledPassCount = 0;
+	for (u32 i = (u32)graph.passes.size(); i-- > 0;)
+	{
+		RenderGraphPass& pass = graph.passes[i];
+
+		bool used = pass.sideEffects;
+		for (u32 w = 0; w < pass.colorWriteCount; ++w)
+			used = used || needed[pass.colorWrites[w]];
+		if (pass.depth != RENDER_GRAPH_NONE)
+			used = used || needed[pass.depth];
+
+		pass.culled = !used;
+		if (pass.culled)
+		{
+			graph.culledPassCount++;
+			continue;
+		}
+
+		//The depth attachment is loaded, so it counts as a read too
+		for (u32 r = 0; r < pass.readCount; ++r)
+			needed[pass.reads[r]] = true;
+		if (pass.depth != RENDER_GRAPH_NONE)
+			needed[pass.depth] = true;
+	}
+
+	// Lifetimes of the resources over the passes that run --------------------------------------------------------------
+	for (RenderGraphResource& resource : graph.resources)
+	{
+		resource.firstPass = RENDER_GRAPH_NONE;
+		resource.lastPass = RENDER_GRAPH_NONE;
+		resource.aliased = false;
+	}
+
+	for (u32 i = 0; i < graph.passes.size(); ++i)
+	{
+		const RenderGraphPass& pass = graph.passes[i];
+		if (pass.culled)
+			continue;
+
+		u32 resources[RENDER_GRAPH_MAX_READS + RENDER_GRAPH_MAX_COLOR_WRITES + 1];
+		u32 resourceCount = GetPassResources(pass, resources);
+
+		for (u32 r = 0; r < resourceCount; ++r)
+		{
+			RenderGraphResource& resource = graph.resources[resources[r]];
+			if (resource.firstPass == RENDER_GRAPH_NONE)
+				resource.firstPass = i;
+			resource.lastPass = i;
+		}
+	}
+}
+
+#pragma endregion
+
+#pragma region Execution
+
+//Depth stencil targets are attached with their stencil
+static GLenum GetDepthAttachment(const RenderGraphResource& resource)
+{
+	return resource.desc.internalFormat == GL_DEPTH24_STENCIL8 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+}
+
+static GLuint GetFramebuffer(RenderGraph& graph, const GLuint* colors, u32 colorCount, GLuint depth, GLenum depthAttachment)
+{
+	for (RenderGraphFramebuffer& framebuffer : graph.framebuffers)
+	{
+		if (framebuffer.colorCount == colorCount && framebuffer.depth == depth &&
+			std::equal(colors, colors + colorCount, framebuffer.colors))
+		{
+			framebuffer.lastUsedFrame = graph.frame;
+			return framebuffer.handle;
+		}
+	}
+
+	RenderGraphFramebuffer framebuffer = {};
+	std::copy(colors, colors + colorCount, framebuffer.colors);
+	framebuffer.colorCount = colorCount;
+	framebuffer.depth = depth;
+	framebuffer.lastUsedFrame = graph.frame;
+
+	glGenFramebuffers(1, &framebuffer.handle);
+	StateBindFramebuffer(GL_FRAMEBUFFER, framebuffer.handle);
+
+	GLenum drawBuffers[RENDER_GRAPH_MAX_COLOR_WRITES];
+	for (u32 i = 0; i < colorCount; ++i)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, colors[i], 0);
+		drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	if (depth != 0)
+		glFramebufferTexture2D(GL_FRAMEBUFFER, depthAttachment, GL_TEXTURE_2D, depth, 0);
+
+	if (colorCount > 0)
+	{
+		glDrawBuffers(colorCount, drawBuffers);
+	}
+	else
+	{
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+	}
+
+	CheckFramebufferStatus("render graph");
+
+	graph.framebuffers.push_back(framebuffer);
+	return framebuffer.handle;
+}
+
+//Binds the attachments of the pass, the backbuffer is the default framebuffer and can't be mixed with the others
+static GLuint BindPassFramebuffer(RenderGraph& graph, const RenderGraphPass& pass)
+{
+	GLuint colors[RENDER_GRAPH_MAX_COLOR_WRITES];
+	u32 colorCount = 0;
+	bool writesBackbuffer = false;
+
+	for (u32 i = 0; i < pass.colorWriteCount; ++i)
+	{
+		const RenderGraphResource& resource = graph.resources[pass.colorWrites[i]];
+		if (resource.imported)
+			writesBackbuffer = true;
+		else
+			colors[colorCount++] = *resource.desc.handle;
+	}
+
+	GLuint depth = 0;
+	GLenum depthAttachment = GL_NONE;
+	if (pass.depth != RENDER_GRAPH_NONE)
+	{
+		depth = *graph.resources[pass.depth].desc.handle;
+		depthAttachment = GetDepthAttachment(graph.resources[pass.depth]);
+	}
+
+	//Compute and copy passes bind what they need themselves
+	if (colorCount == 0 && depth == 0)
+	{
+		if (writesBackbuffer)
+			StateBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return 0;
+	}
+
+	GLuint framebuffer = GetFramebuffer(graph, colors, colorCount, depth, depthAttachment);
+
+	if (writesBackbuffer)
+	{
+		ASSERT(colorCount == 0, "A pass can't draw to the backbuffer and to its own targets");
+		StateBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		StateBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	}
+	else
+	{
+		StateBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	}
+
+	return framebuffer;
+}
+
+void ExecuteRenderGraph(App* app, RenderGraph& graph)
+{
+	RenderTargetPool& pool = app->renderTargetPool;
+
+	std::vector<GLuint> usedTextures;
+	graph.aliasedCount = 0;
+
+	for (u32 i = 0; i < graph.passes.size(); ++i)
+	{
+		const RenderGraphPass& pass = graph.passes[i];
+		if (pass.culled)
+			continue;
+
+		u32 resources[RENDER_GRAPH_MAX_READS + RENDER_GRAPH_MAX_COLOR_WRITES + 1];
+		u32 resourceCount = GetPassResources(pass, resources);
+
+		// Targets first used here --------------------------------------------------------------------------------------
+		for (u32 r = 0; r < resourceCount; ++r)
+		{
+			RenderGraphResource& resource = graph.resources[resources[r]];
+			if (resource.imported || resource.firstPass != i)
+				continue;
+
+			const RenderTargetDesc& desc = resource.desc;
+			GLuint texture = AcquireRenderTarget(pool, desc.internalFormat, GetRenderTargetSize(app, desc.scale), desc.filter);
+			*desc.handle = texture;
+
+			resource.aliased = std::find(usedTextures.begin(), usedTextures.end(), texture) != usedTextures.end();
+			if (resource.aliased)
+				graph.aliasedCount++;
+			else
+				usedTextures.push_back(texture);
+		}
+
+		GLuint framebuffer = BindPassFramebuffer(graph, pass);
+
+		pass.execute(app);
+
+		// Targets last used here, their contents are dead ----------------------------------------------------------------
+		GLenum deadAttachments[RENDER_GRAPH_MAX_COLOR_WRITES + 1];
+		u32 deadAttachmentCount = 0;
+
+		for (u32 r = 0; r < resourceCount; ++r)
+		{
+			RenderGraphResource& resource = graph.resources[resources[r]];
+			if (resource.imported || resource.lastPass != i)
+				continue;
+
+			GLuint texture = *resource.desc.handle;
+
+			GLenum attachment = GL_NONE;
+			for (u32 w = 0, color = 0; w < pass.colorWriteCount; ++w)
+			{
+				if (graph.resources[pass.colorWrites[w]].imported)
+					continue;
+				if (pass.colorWrites[w] == resources[r])
+					attachment = GL_COLOR_ATTACHMENT0 + color;
+				color++;
+			}
+			if (pass.depth == resources[r])
+				attachment = GetDepthAttachment(resource);
+
+			//Attached ones through the framebuffer, sampled ones through the texture
+			if (attachment != GL_NONE && framebuffer != 0)
+				deadAttachments[deadAttachmentCount++] = attachment;
+			else
+				glInvalidateTexImage(texture, 0);
+
+			ReleaseRenderTarget(pool, texture);
+			*resource.desc.handle = 0;
+		}
+
+		if (deadAttachmentCount > 0)
+		{
+			//The framebuffer of the pass is still bound, as the read one when the pass drew to the backbuffer
+			GLenum target = GL_DRAW_FRAMEBUFFER;
+			for (u32 w = 0; w < pass.colorWriteCount; ++w)
+				if (graph.resources[pass.colorWrites[w]].imported)
+					target = GL_READ_FRAMEBUFFER;
+
+			StateBindFramebuffer(target, framebuffer);
+			glInvalidateFramebuffer(target, deadAttachmentCount, deadAttachments);
+		}
+	}
+
+	graph.textureCount = (u32)usedTextures.size();
+	StateBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void TrimRenderGraph(RenderGraph& graph)
+{
+	graph.frame++;
+
+	for (u32 i = 0; i < graph.framebuffers.size();)
+	{
+		RenderGraphFramebuffer& framebuffer = graph.framebuffers[i];
+		if (graph.frame - framebuffer.lastUsedFrame <= RENDER_GRAPH_FRAMEBUFFER_MAX_IDLE_FRAMES)
+		{
+			++i;
+			continue;
+		}
+
+		StateDeleteFramebuffer(framebuffer.handle);
+		framebuffer = graph.framebuffers.back();
+		graph.framebuffers.pop_back();
+	}
+}
+
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "engine.h"
+
+//Registers the backbuffer as resource 0 (RenderResource_Backbuffer)
+void InitRenderGraph(RenderGraph& graph);
+
+//Transient target allocated from the render target pool while a pass that runs uses it
+u32 AddRenderGraphResource(RenderGraph& graph, const char* name, const RenderTargetDesc& desc);
+
+// Declaration, every frame -------------------------------------------------------------------------------------------
+
+void BeginRenderGraph(RenderGraph& graph);
+
+//Passes run in the order they are added
+u32 AddRenderGraphPass(RenderGraph& graph, const char* name, RenderGraphExecute execute);
+
+void ReadRenderGraphResource(RenderGraph& graph, u32 pass, u32 resource);
+void WriteRenderGraphResource(RenderGraph& graph, u32 pass, u32 resource);
+void SetRenderGraphDepth(RenderGraph& graph, u32 pass, u32 resource);
+void SetRenderGraphSideEffects(RenderGraph& graph, u32 pass);
+
+// Compilation and execution ------------------------------------------------------------------------------------------
+
+//Culls the passes nothing reads from and computes the lifetime of every resource
+void CompileRenderGraph(RenderGraph& graph);
+
+//Runs the passes that were not culled. Targets are acquired at their first use and released after their last one, so
+//targets with the same format and size and no overlap share a texture. Dead contents are invalidated.
+//Passes that write the backbuffer draw to the default framebuffer and read from their other attachments.
+void ExecuteRenderGraph(App* app, RenderGraph& graph);
+
+//Once per frame, deletes the framebuffers that were not used for a while
+void TrimRenderGraph(RenderGraph& graph);
\ No newline at end of file
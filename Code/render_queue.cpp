@@ -0,0 +1,86 @@
+#include "render_queue.h"
+
+static u64 PackSortKeyField(u64 key, u32 value, u32 bits)
+{
+	const u64 mask = (1ull << bits) - 1;
+	return (key << bits) | (value & mask);
+}
+
+u64 MakeSortKey(QueuePass pass, u32 programIdx, GLuint vao, u32 materialIdx, f32 depth)
+{
+	const u32 maxDepth = (1u << SORT_KEY_DEPTH_BITS) - 1;
+	f32 clampedDepth = glm::clamp(depth, 0.0f, 1.0f);
+
+	//Fields that don't fit only lose sorting quality, the submission compares the real state
+	u64 key = 0;
+	key = PackSortKeyField(key, (u32)pass, SORT_KEY_PASS_BITS);
+	key = PackSortKeyField(key, programIdx, SORT_KEY_PROGRAM_BITS);
+	key = PackSortKeyField(key, vao, SORT_KEY_VAO_BITS);
+	key = PackSortKeyField(key, materialIdx, SORT_KEY_MATERIAL_BITS);
+	key = PackSortKeyField(key, (u32)(clampedDepth * maxDepth), SORT_KEY_DEPTH_BITS);
+
+	return key;
+}
+
+void ClearRenderQueue(RenderQueue& queue)
+{
+	queue.items.clear();
+	queue.entries.clear();
+}
+
+void PushToRenderQueue(RenderQueue& queue, u64 key, const RenderQueueItem& item)
+{
+	RenderQueueEntry entry = { key, (u32)queue.items.size() };
+	queue.entries.push_back(entry);
+	queue.items.push_back(item);
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+	const u32 count = (u32)queue.entries.size();
+	if (count < 2)
+		return;
+
+	queue.scratch.resize(count);
+
+	//All the histograms in one go
+	u32 histograms[8][256] = {};
+	for (u32 i = 0; i < count; ++i)
+	{
+		u64 key = queue.entries[i].key;
+		for (u32 digit = 0; digit < 8; ++digit)
+		{
+			histograms[digit][(key >> (digit * 8)) & 0xFF]++;
+		}
+	}
+
+	RenderQueueEntry* src = queue.entries.data();
+	RenderQueueEntry* dst = queue.scratch.data();
+
+	for (u32 digit = 0; digit < 8; ++digit)
+	{
+		u32* histogram = histograms[digit];
+
+		//Every key has the same byte here, nothing to do (common for the pass and program bytes)
+		if (histogram[(src[0].key >> (digit * 8)) & 0xFF] == count)
+			continue;
+
+		u32 offsets[256];
+		u32 sum = 0;
+		for (u32 bucket = 0; bucket < 256; ++bucket)
+		{
+			offsets[bucket] = sum;
+			sum += histogram[bucket];
+		}
+
+		for (u32 i = 0; i < count; ++i)
+		{
+			dst[offsets[(src[i].key >> (digit * 8)) & 0xFF]++] = src[i];
+		}
+
+		std::swap(src, dst);
+	}
+
+	if (src != queue.entries.data())
+		queue.entries.swap(queue.scratch);
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "engine.h"
+
+//depth is in [0, 1], front to back
+u64 MakeSortKey(QueuePass pass, u32 programIdx, GLuint vao, u32 materialIdx, f32 depth);
+
+void ClearRenderQueue(RenderQueue& queue);
+
+void PushToRenderQueue(RenderQueue& queue, u64 key, const RenderQueueItem& item);
+
+//LSD radix sort on the keys, 8 bits per pass, the order of equal keys is kept
+void SortRenderQueue(RenderQueue& queue);
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "render_target_pool.h"
+#include "gl_state.h"
+
+#pragma region Pool
+
+static u32 GetBytesPerPixel(GLint internalFormat)
+{
+	switch (internalFormat)
+	{
+	case GL_RG16:
+	case GL_RGBA8:
+	case GL_R11F_G11F_B10F:
+	case GL_DEPTH24_STENCIL8:
+	case GL_DEPTH_COMPONENT24: return 4; //Depth 24 is padded to 32 bits by every driver we know of
+	case GL_RGBA16F:
+	case GL_RG32F:             return 8;
+	default:                   return 4;
+	}
+}
+
+GLuint AcquireRenderTarget(RenderTargetPool& pool, GLint internalFormat, ivec2 size, GLint filter)
+{
+	for (PooledRenderTarget& target : pool.targets)
+	{
+		if (!target.inUse && target.internalFormat == internalFormat && target.size == size && target.filter == filter)
+		{
+			target.inUse = true;
+			target.idleFrames = 0;
+			pool.reusedCount++;
+			return target.handle;
+		}
+	}
+
+	PooledRenderTarget target = {};
+	target.internalFormat = internalFormat;
+	target.size = size;
+	target.filter = filter;
+	target.inUse = true;
+
+	glGenTextures(1, &target.handle);
+	StateBindTexture(GL_TEXTURE_2D, target.handle);
+
+	//Immutable storage, the format alone describes the texture
+	glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, size.x, size.y);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	StateBindTexture(GL_TEXTURE_2D, 0);
+
+	pool.targets.push_back(target);
+	pool.createdCount++;
+	return target.handle;
+}
+
+void ReleaseRenderTarget(RenderTargetPool& pool, GLuint handle)
+{
+	for (PooledRenderTarget& target : pool.targets)
+	{
+		if (target.handle == handle)
+		{
+			ASSERT(target.inUse, "The render target was released twice");
+			target.inUse = false;
+			target.idleFrames = 0;
+			return;
+		}
+	}
+
+	ASSERT(false, "The render target does not belong to the pool");
+}
+
+void TrimRenderTargetPool(RenderTargetPool& pool)
+{
+	for (u32 i = 0; i < pool.targets.size();)
+	{
+		PooledRenderTarget& target = pool.targets[i];
+
+		if (target.inUse || ++target.idleFrames <= RENDER_TARGET_POOL_MAX_IDLE_FRAMES)
+		{
+			++i;
+			continue;
+		}
+
+		StateDeleteTexture(target.handle);
+		pool.destroyedCount++;
+
+		target = pool.targets.back();
+		pool.targets.pop_back();
+	}
+}
+
+void GetRenderTargetPoolStats(const RenderTargetPool& pool, u32& targetCount, u32& inUseCount, u64& bytes)
+{
+	targetCount = (u32)pool.targets.size();
+	inUseCount = 0;
+	bytes = 0;
+
+	for (const PooledRenderTarget& target : pool.targets)
+	{
+		inUseCount += target.inUse ? 1 : 0;
+		bytes += (u64)target.size.x * target.size.y * GetBytesPerPixel(target.internalFormat);
+	}
+}
+
+#pragma endregion
+
+#pragma region Resize
+
+ivec2 ChooseRenderTargetSize(const FrameBufferResize& resize, ivec2 displaySize)
+{
+	const ivec2 allocated = resize.allocatedSize;
+	displaySize = glm::max(displaySize, ivec2(1));
+
+	//Nothing allocated yet, the first targets match the display
+	if (allocated.x == 0 || allocated.y == 0)
+		return displaySize;
+
+	//Small enough changes are drawn into the current targets
+	const bool fits = displaySize.x <= allocated.x && displaySize.y <= allocated.y;
+	const f32 usedArea = (f32)displaySize.x * displaySize.y / ((f32)allocated.x * allocated.y);
+	if (fits && usedArea >= resize.shrinkThreshold)
+		return allocated;
+
+	//Leave some room to grow, aligned so a slow drag crosses few allocation sizes
+	const vec2 grown = vec2(displaySize) * (1.0f + resize.growMargin);
+	const ivec2 aligned = ((ivec2(glm::ceil(grown)) + RENDER_TARGET_SIZE_ALIGNMENT - 1) / RENDER_TARGET_SIZE_ALIGNMENT) * RENDER_TARGET_SIZE_ALIGNMENT;
+	return glm::max(aligned, displaySize);
+}
+
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "engine.h"
+
+// Pool ------------------------------------------------------------------------------------------------------------------
+
+//Returns an idle texture with the same format, size and filter, or creates one
+GLuint AcquireRenderTarget(RenderTargetPool& pool, GLint internalFormat, ivec2 size, GLint filter);
+
+//The texture stays alive in the pool until it is acquired again or has been idle for too long
+void ReleaseRenderTarget(RenderTargetPool& pool, GLuint handle);
+
+//Once per frame, deletes the textures idle for more than RENDER_TARGET_POOL_MAX_IDLE_FRAMES frames
+void TrimRenderTargetPool(RenderTargetPool& pool);
+
+void GetRenderTargetPoolStats(const RenderTargetPool& pool, u32& targetCount, u32& inUseCount, u64& bytes);
+
+// Resize ----------------------------------------------------------------------------------------------------------------
+
+//Size of the full resolution targets for the display size, the current allocation if the display still fits in it
+ivec2 ChooseRenderTargetSize(const FrameBufferResize& resize, ivec2 displaySize);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "resource_management.h"
+#include "gl_state.h"
 #include "stb_image.h"
 
 GLuint CreateProgramFromSource(String programSource, const char* shaderName)
@@ -70,7 +71,7 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 		ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
 	}
 
-	glUseProgram(0);
+	StateUseProgram(0);
 
 	glDetachShader(programHandle, vshader);
 	glDetachShader(programHandle, fshader);
@@ -80,6 +81,72 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 	return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName)
+{
+	GLchar  infoLogBuffer[1024] = {};
+	GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+	GLsizei infoLogSize;
+	GLint   success;
+
+	char versionString[] = "#version 430\n";
+	char shaderNameDefine[128];
+	sprintf(shaderNameDefine, "#define %s\n", shaderName);
+	char computeShaderDefine[] = "#define COMPUTE\n";
+
+	const GLchar* computeShaderSource[] = {
+		versionString,
+		shaderNameDefine,
+		computeShaderDefine,
+		programSource.str
+	};
+	const GLint computeShaderLengths[] = {
+		(GLint)strlen(versionString),
+		(GLint)strlen(shaderNameDefine),
+		(GLint)strlen(computeShaderDefine),
+		(GLint)programSource.len
+	};
+
+	GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+	glCompileShader(cshader);
+	glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+	if (!success)
+	{
+		glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+		ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+	}
+
+	GLuint programHandle = glCreateProgram();
+	glAttachShader(programHandle, cshader);
+	glLinkProgram(programHandle);
+	glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+	if (!success)
+	{
+		glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+		ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+	}
+
+	glDetachShader(programHandle, cshader);
+	glDeleteShader(cshader);
+
+	return programHandle;
+}
+
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName)
+{
+	String programSource = ReadTextFile(filepath);
+
+	Program program = {};
+	program.handle = CreateComputeProgramFromSource(programSource, programName);
+	program.filepath = filepath;
+	program.programName = programName;
+	program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+	program.isCompute = true;
+	app->programs.push_back(program);
+
+	return app->programs.size() - 1;
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
 {
 	String programSource = ReadTextFile(filepath);
@@ -118,6 +185,51 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
 	return app->programs.size() - 1;
 }
 
+bool ValidateUniformBlockLayout(const Program& program, const UniformBlockLayout& layout)
+{
+	GLuint blockIndex = glGetUniformBlockIndex(program.handle, layout.blockName);
+	if (blockIndex == GL_INVALID_INDEX)
+		return true; //The program does not use this block
+
+	bool layoutMatches = true;
+
+	GLint blockSize = 0;
+	glGetActiveUniformBlockiv(program.handle, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+	if ((u32)blockSize > layout.size)
+	{
+		ELOG("Uniform block %s in program %s needs %d bytes but the engine only writes %u", layout.blockName, program.programName.c_str(), blockSize, layout.size);
+		layoutMatches = false;
+	}
+
+	for (u32 i = 0; i < layout.fieldCount; ++i)
+	{
+		const UniformFieldLayout& field = layout.fields[i];
+
+		GLuint uniformIndex = GL_INVALID_INDEX;
+		glGetUniformIndices(program.handle, 1, &field.name, &uniformIndex);
+		if (uniformIndex == GL_INVALID_INDEX)
+			continue; //Not declared or optimized out, nothing to check
+
+		GLint offset = 0;
+		glGetActiveUniformsiv(program.handle, 1, &uniformIndex, GL_UNIFORM_OFFSET, &offset);
+		if ((u32)offset != field.offset)
+		{
+			ELOG("Uniform block %s in program %s: %s is at offset %d but the engine writes it at %u", layout.blockName, program.programName.c_str(), field.name, offset, field.offset);
+			layoutMatches = false;
+		}
+	}
+
+	return layoutMatches;
+}
+
+void ExpectUniformBlock(App* app, u32 programIdx, const UniformBlockLayout& layout)
+{
+	Program& program = app->programs[programIdx];
+	program.uniformBlockLayouts.push_back(&layout);
+
+	ValidateUniformBlockLayout(program, layout);
+}
+
 Image LoadImage(const char* filename)
 {
 	Image img = {};
@@ -154,7 +266,7 @@ GLuint CreateTexture2DFromImage(Image image, GLint texParam)
 
 	GLuint texHandle;
 	glGenTextures(1, &texHandle);
-	glBindTexture(GL_TEXTURE_2D, texHandle);
+	StateBindTexture(GL_TEXTURE_2D, texHandle);
 
 	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
 
@@ -173,7 +285,7 @@ GLuint CreateTexture2DFromImage(Image image, GLint texParam)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	StateBindTexture(GL_TEXTURE_2D, 0);
 
 	return texHandle;
 }
@@ -204,40 +316,65 @@ u32 LoadTexture2D(App* app, const char* filepath, GLuint texParams)
 	}
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+static bool SameVertexBufferLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
 {
-	Submesh& submesh = mesh.submeshes[submeshIndex];
+	if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+		return false;
 
-	//Try finding a vao for this submesh/program
-	for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
+	for (u32 i = 0; i < a.attributes.size(); ++i)
 	{
-		if (submesh.vaos[i].programHandle == program.handle)
-			return submesh.vaos[i].handle;
+		if (a.attributes[i].location != b.attributes[i].location ||
+			a.attributes[i].componentCount != b.attributes[i].componentCount ||
+			a.attributes[i].offset != b.attributes[i].offset)
+			return false;
+	}
+
+	return true;
+}
+
+GLuint FindVAO(GeometryHeap& heap, const VertexBufferLayout& layout, const Program& program)
+{
+	//Try finding a vao for this vertex format/program
+	for (u32 i = 0; i < (u32)heap.vaos.size(); ++i)
+	{
+		if (heap.vaos[i].programHandle == program.handle && SameVertexBufferLayout(heap.vaos[i].vertexBufferLayout, layout))
+			return heap.vaos[i].handle;
 	}
 
 	GLuint vaoHandle = 0;
 
-	//Create a new vao for this submesh/program
+	//Create a new vao for this vertex format/program
 	{
 		glGenVertexArrays(1, &vaoHandle);
-		glBindVertexArray(vaoHandle);
+		StateBindVertexArray(vaoHandle);
 
-		glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+		StateBindBuffer(GL_ARRAY_BUFFER, heap.vertices.buffer.handle);
+		StateBindBuffer(GL_ELEMENT_ARRAY_BUFFER, heap.indices.buffer.handle);
 
 		//We have to link all vertex input attributes to attributes in the vertex buffer
 		for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
 		{
 			bool attributeWasLinked = false;
 
-			for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
+			//Not part of the mesh, one value per instance
+			if (program.vertexInputLayout.attributes[i].location == INSTANCE_INDEX_LOCATION)
+			{
+				StateBindBuffer(GL_ARRAY_BUFFER, heap.instanceIndices.handle);
+				glVertexAttribIPointer(INSTANCE_INDEX_LOCATION, 1, GL_UNSIGNED_INT, sizeof(u32), (void*)0);
+				glVertexAttribDivisor(INSTANCE_INDEX_LOCATION, 1);
+				glEnableVertexAttribArray(INSTANCE_INDEX_LOCATION);
+				StateBindBuffer(GL_ARRAY_BUFFER, heap.vertices.buffer.handle);
+				continue;
+			}
+
+			for (u32 j = 0; j < layout.attributes.size(); ++j)
 			{
-				if (program.vertexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
+				if (program.vertexInputLayout.attributes[i].location == layout.attributes[j].location)
 				{
-					const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-					const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-					const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset; //attribute offset + vertex offset
-					const u32 stride = submesh.vertexBufferLayout.stride;
+					const u32 index = layout.attributes[j].location;
+					const u32 ncomp = layout.attributes[j].componentCount;
+					const u32 offset = layout.attributes[j].offset; //the submesh start is given by the base vertex of each draw
+					const u32 stride = layout.stride;
 					glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
 					glEnableVertexAttribArray(index);
 
@@ -249,12 +386,12 @@ GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
 			assert(attributeWasLinked); //The submesh should provide an attribute for each vertex inputs
 		}
 
-		glBindVertexArray(0);
+		StateBindVertexArray(0);
 	}
 
-	//Store it in the list of vaos for this submesh
-	Vao vao = { vaoHandle, program.handle };
-	submesh.vaos.push_back(vao);
+	//Store it in the list of vaos of the heap
+	Vao vao = { vaoHandle, program.handle, layout };
+	heap.vaos.push_back(vao);
 
 	return vaoHandle;
 }
\ No newline at end of file
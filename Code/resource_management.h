@@ -12,6 +12,17 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName);
 
 u32 LoadProgram(App* app, const char* filepath, const char* programName);
 
+//Same file convention, the stage is compiled with COMPUTE defined
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName);
+
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName);
+
+//Returns false (and logs every mismatch) if the program declares the block with a different layout
+bool ValidateUniformBlockLayout(const Program& program, const UniformBlockLayout& layout);
+
+//Registers a block the engine fills for this program and validates it right away
+void ExpectUniformBlock(App* app, u32 programIdx, const UniformBlockLayout& layout);
+
 Image LoadImage(const char* filename);
 
 void FreeImage(Image image);
@@ -20,4 +31,4 @@ GLuint CreateTexture2DFromImage(Image image, GLint texParam);
 
 u32 LoadTexture2D(App* app, const char* filepath, GLuint texParams = GL_LINEAR);
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program);
\ No newline at end of file
+GLuint FindVAO(GeometryHeap& heap, const VertexBufferLayout& layout, const Program& program);
\ No newline at end of file
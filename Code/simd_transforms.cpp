@@ -0,0 +1,227 @@
+#include "simd_transforms.h"
+#include <chrono>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+#pragma region Kernels
+
+static void TransformMatricesScalar(const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count)
+{
+	for (u32 i = 0; i < count; ++i)
+	{
+		out[i] = viewProjection * worlds[i];
+	}
+}
+
+#if SIMD_X86
+
+//Column major, so each column of the result is a linear combination of the columns of the view projection
+static void TransformMatricesSSE(const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count)
+{
+	const __m128 a0 = _mm_loadu_ps(&viewProjection[0][0]);
+	const __m128 a1 = _mm_loadu_ps(&viewProjection[1][0]);
+	const __m128 a2 = _mm_loadu_ps(&viewProjection[2][0]);
+	const __m128 a3 = _mm_loadu_ps(&viewProjection[3][0]);
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const float* src = &worlds[i][0][0];
+		float* dst = &out[i][0][0];
+
+		for (u32 col = 0; col < 4; ++col)
+		{
+			const __m128 b = _mm_loadu_ps(src + col * 4);
+
+			__m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0)));
+			r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1))));
+			r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2))));
+			r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 3, 3))));
+
+			_mm_storeu_ps(dst + col * 4, r);
+		}
+	}
+}
+
+//Same idea as the SSE kernel but two columns per register, the view projection columns are duplicated in both lanes
+TARGET_AVX2 static void TransformMatricesAVX2(const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count)
+{
+	const __m256 a0 = _mm256_broadcast_ps((const __m128*)&viewProjection[0][0]);
+	const __m256 a1 = _mm256_broadcast_ps((const __m128*)&viewProjection[1][0]);
+	const __m256 a2 = _mm256_broadcast_ps((const __m128*)&viewProjection[2][0]);
+	const __m256 a3 = _mm256_broadcast_ps((const __m128*)&viewProjection[3][0]);
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const float* src = &worlds[i][0][0];
+		float* dst = &out[i][0][0];
+
+		for (u32 col = 0; col < 4; col += 2)
+		{
+			const __m256 b = _mm256_loadu_ps(src + col * 4);
+
+			__m256 r = _mm256_mul_ps(a0, _mm256_permute_ps(b, _MM_SHUFFLE(0, 0, 0, 0)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_permute_ps(b, _MM_SHUFFLE(1, 1, 1, 1))));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_permute_ps(b, _MM_SHUFFLE(2, 2, 2, 2))));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_permute_ps(b, _MM_SHUFFLE(3, 3, 3, 3))));
+
+			_mm256_storeu_ps(dst + col * 4, r);
+		}
+	}
+}
+
+static void Cpuid(int info[4], int leaf, int subleaf)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+static u64 ReadXCR0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	u32 eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((u64)edx << 32) | eax;
+#endif
+}
+
+#endif
+
+#pragma endregion
+
+SimdLevel DetectSimdLevel()
+{
+	static SimdLevel detectedLevel = SimdLevel_Count;
+	if (detectedLevel != SimdLevel_Count)
+		return detectedLevel;
+
+	detectedLevel = SimdLevel_Scalar;
+
+#if SIMD_X86
+	int info[4] = {};
+	Cpuid(info, 0, 0);
+	const int maxLeaf = info[0];
+
+	Cpuid(info, 1, 0);
+	const bool hasSSE2 = (info[3] & (1 << 26)) != 0;
+	const bool hasOSXSave = (info[2] & (1 << 27)) != 0;
+	const bool hasAVX = (info[2] & (1 << 28)) != 0;
+
+	if (hasSSE2)
+		detectedLevel = SimdLevel_SSE;
+
+	//The OS also has to save the YMM registers on context switches, otherwise AVX is unusable
+	if (hasSSE2 && hasOSXSave && hasAVX && (ReadXCR0() & 0x6) == 0x6 && maxLeaf >= 7)
+	{
+		Cpuid(info, 7, 0);
+		if (info[1] & (1 << 5))
+			detectedLevel = SimdLevel_AVX2;
+	}
+#endif
+
+	return detectedLevel;
+}
+
+const char* GetSimdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SimdLevel_Scalar: return "Scalar";
+	case SimdLevel_SSE:    return "SSE";
+	case SimdLevel_AVX2:   return "AVX2";
+	default:               return "Unknown";
+	}
+}
+
+void BatchTransformMatrices(SimdLevel level, const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count)
+{
+	ASSERT(level <= DetectSimdLevel(), "The requested instruction set is not supported by this CPU");
+
+	switch (level)
+	{
+#if SIMD_X86
+	case SimdLevel_AVX2: TransformMatricesAVX2(viewProjection, worlds, out, count); break;
+	case SimdLevel_SSE:  TransformMatricesSSE(viewProjection, worlds, out, count); break;
+#endif
+	default:             TransformMatricesScalar(viewProjection, worlds, out, count); break;
+	}
+}
+
+void BatchTransformMatrices(const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count)
+{
+	BatchTransformMatrices(DetectSimdLevel(), viewProjection, worlds, out, count);
+}
+
+void RunTransformBenchmark(TransformBenchmark& benchmark, const mat4& projection, const mat4& view)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const u32 count = benchmark.entityCount > 0 ? benchmark.entityCount : 1;
+
+	std::vector<mat4> worlds(count);
+	std::vector<mat4> results(count);
+
+	srand(1234);
+	for (u32 i = 0; i < count; ++i)
+	{
+		vec3 position = vec3(rand() % 200 - 100, rand() % 20, rand() % 200 - 100);
+		float angle = (float)(rand() % 360);
+		worlds[i] = glm::scale(glm::rotate(glm::translate(position), glm::radians(angle), vec3(0, 1, 0)), vec3(0.5f));
+	}
+
+	//Current path, two full matrix multiplies for each entity
+	{
+		Clock::time_point start = Clock::now();
+		for (u32 i = 0; i < count; ++i)
+		{
+			results[i] = projection * view * worlds[i];
+		}
+		Clock::time_point end = Clock::now();
+
+		f64 ms = std::chrono::duration<f64, std::milli>(end - start).count();
+		benchmark.entitiesPerMs[SimdLevel_Count] = ms > 0.0 ? (f32)(count / ms) : 0.0f;
+	}
+
+	//Batch kernels, view projection computed once
+	for (u32 level = 0; level < SimdLevel_Count; ++level)
+	{
+		if (level > (u32)DetectSimdLevel())
+		{
+			benchmark.entitiesPerMs[level] = 0.0f;
+			continue;
+		}
+
+		Clock::time_point start = Clock::now();
+		mat4 viewProjection = projection * view;
+		BatchTransformMatrices(SimdLevel(level), viewProjection, worlds.data(), results.data(), count);
+		Clock::time_point end = Clock::now();
+
+		f64 ms = std::chrono::duration<f64, std::milli>(end - start).count();
+		benchmark.entitiesPerMs[level] = ms > 0.0 ? (f32)(count / ms) : 0.0f;
+	}
+
+	//Keep the results alive so the compiler can't drop the work
+	benchmark.checksum = 0.0f;
+	for (u32 i = 0; i < count; ++i)
+	{
+		benchmark.checksum += results[i][3][3];
+	}
+
+	benchmark.hasResults = true;
+}
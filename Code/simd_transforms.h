@@ -0,0 +1,17 @@
+#pragma once
+
+#include "engine.h"
+
+//Checks cpuid (and the OS support for the extended registers) once and caches the result
+SimdLevel DetectSimdLevel();
+
+const char* GetSimdLevelName(SimdLevel level);
+
+//out[i] = viewProjection * worlds[i], using the best instruction set available at runtime
+void BatchTransformMatrices(const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count);
+
+//Same as above but forcing a given instruction set, used by the benchmark
+void BatchTransformMatrices(SimdLevel level, const mat4& viewProjection, const mat4* worlds, mat4* out, u32 count);
+
+//Compares the per entity "projection * view * world" path against every available batch kernel
+void RunTransformBenchmark(TransformBenchmark& benchmark, const mat4& projection, const mat4& view);
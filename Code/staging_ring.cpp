@@ -0,0 +1,247 @@
+#include "staging_ring.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+
+// Ring bookkeeping -----------------------------------------------------------------------------------------------------
+
+//The ring stays mapped unsynchronized between flushes, fences tell when the GPU has finished copying a range out
+static void MapStagingRing(StagingRing& ring)
+{
+	StateBindBuffer(GL_COPY_READ_BUFFER, ring.buffer.handle);
+	ring.mapped = (u8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, ring.buffer.size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	StateBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	if (!ring.mapped)
+		ELOG("Could not map the staging ring");
+}
+
+//A buffer can't be the source of a copy while it is mapped
+static void UnmapStagingRing(StagingRing& ring)
+{
+	StateBindBuffer(GL_COPY_READ_BUFFER, ring.buffer.handle);
+	glUnmapBuffer(GL_COPY_READ_BUFFER);
+	StateBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	ring.mapped = NULL;
+}
+
+//Allocations are contiguous, if the data doesn't fit at the end of the ring that space is skipped and it wraps around
+static bool FitInRing(StagingRing& ring, u32 size, u32& offset, u32& ringBytes)
+{
+	const u32 capacity = ring.buffer.size;
+
+	if (ring.usedBytes == 0)
+	{
+		ring.head = 0;
+		ring.tail = 0;
+	}
+
+	if (ring.head > ring.tail || ring.usedBytes == 0)
+	{
+		if (capacity - ring.head >= size)
+		{
+			offset = ring.head;
+			ringBytes = size;
+		}
+		else if (ring.tail >= size)
+		{
+			offset = 0;
+			ringBytes = capacity - ring.head + size;
+		}
+		else return false;
+	}
+	else
+	{
+		if (ring.tail - ring.head < size)
+			return false;
+
+		offset = ring.head;
+		ringBytes = size;
+	}
+
+	ring.head = offset + size;
+	ring.usedBytes += ringBytes;
+	return true;
+}
+
+static void RetireStagingFences(StagingRing& ring, bool wait)
+{
+	while (!ring.fences.empty())
+	{
+		StagingFence& front = ring.fences.front();
+
+		GLenum status = glClientWaitSync(front.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		{
+			if (wait)
+				ELOG("Timed out waiting for the staging ring copies");
+			break;
+		}
+
+		glDeleteSync(front.fence);
+		ring.usedBytes -= front.releasedBytes;
+		ring.tail = front.tail;
+		ring.retiredTicket = front.ticket;
+		ring.fences.pop_front();
+	}
+}
+
+static void IssueStagingCopies(StagingRing& ring, u32 byteBudget)
+{
+	ring.bytesCopiedLastFlush = 0;
+
+	if (ring.pendingCopies.empty() || !ring.pendingCopies.front().ready)
+		return;
+
+	//Some thread is still writing into the mapping, try again next frame
+	if (ring.pendingWrites > 0)
+		return;
+
+	UnmapStagingRing(ring);
+
+	StagingFence fence = {};
+	StateBindBuffer(GL_COPY_READ_BUFFER, ring.buffer.handle);
+
+	//At least one copy goes through every flush, even if it is bigger than the budget
+	while (!ring.pendingCopies.empty())
+	{
+		const StagingCopy& copy = ring.pendingCopies.front();
+		if (!copy.ready || (ring.bytesCopiedLastFlush > 0 && ring.bytesCopiedLastFlush + copy.size > byteBudget))
+			break;
+
+		//The destination handle is read now, the geometry heap may have been reallocated since the reservation
+		StateBindBuffer(GL_COPY_WRITE_BUFFER, copy.dst->handle);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.srcOffset, copy.dstOffset, copy.size);
+
+		ring.bytesCopiedLastFlush += copy.size;
+		ring.issuedTicket = copy.ticket;
+		fence.releasedBytes += copy.ringBytes;
+		fence.tail = copy.srcOffset + copy.size;
+		fence.ticket = copy.ticket;
+		ring.pendingCopies.pop_front();
+	}
+
+	StateBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	StateBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	fence.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	ring.fences.push_back(fence);
+
+	MapStagingRing(ring);
+}
+
+// Public interface -----------------------------------------------------------------------------------------------------
+
+void InitStagingRing(StagingRing& ring, u32 capacity, u32 bytesPerFrame)
+{
+	ring.buffer = CreateBuffer(capacity, GL_COPY_READ_BUFFER, GL_STREAM_COPY);
+	ring.head = 0;
+	ring.tail = 0;
+	ring.usedBytes = 0;
+	ring.bytesPerFrame = bytesPerFrame;
+	ring.bytesCopiedLastFlush = 0;
+	ring.pendingWrites = 0;
+	ring.nextTicket = 0;
+	ring.issuedTicket = 0;
+	ring.retiredTicket = 0;
+
+	MapStagingRing(ring);
+}
+
+void* StagingReserve(StagingRing& ring, u32 size, const Buffer* dst, u32 dstOffset, u64& ticket)
+{
+	std::lock_guard<std::mutex> lock(ring.mutex);
+
+	u32 offset, ringBytes;
+	if (!ring.mapped || size == 0 || !FitInRing(ring, size, offset, ringBytes))
+		return NULL;
+
+	StagingCopy copy = {};
+	copy.srcOffset = offset;
+	copy.size = size;
+	copy.ringBytes = ringBytes;
+	copy.dst = dst;
+	copy.dstOffset = dstOffset;
+	copy.ticket = ++ring.nextTicket;
+	copy.ready = false;
+
+	ring.pendingCopies.push_back(copy);
+	ring.pendingWrites++;
+
+	ticket = copy.ticket;
+	return ring.mapped + offset;
+}
+
+void StagingCommit(StagingRing& ring, u64 ticket)
+{
+	std::lock_guard<std::mutex> lock(ring.mutex);
+
+	for (StagingCopy& copy : ring.pendingCopies)
+	{
+		if (copy.ticket == ticket)
+		{
+			ASSERT(!copy.ready, "Staging reservation committed twice");
+			copy.ready = true;
+			ring.pendingWrites--;
+			return;
+		}
+	}
+
+	ASSERT(false, "Unknown staging ticket");
+}
+
+void FlushStagingRing(StagingRing& ring, u32 byteBudget)
+{
+	std::lock_guard<std::mutex> lock(ring.mutex);
+
+	RetireStagingFences(ring, false);
+	IssueStagingCopies(ring, byteBudget);
+}
+
+void FinishStagingRing(StagingRing& ring)
+{
+	std::lock_guard<std::mutex> lock(ring.mutex);
+
+	ASSERT(ring.pendingWrites == 0, "Can't finish the staging ring while a thread is writing into it");
+
+	IssueStagingCopies(ring, UINT32_MAX);
+	RetireStagingFences(ring, true);
+}
+
+void WaitForStagingTicket(StagingRing& ring, u64 ticket)
+{
+	std::lock_guard<std::mutex> lock(ring.mutex);
+
+	if (ticket <= ring.retiredTicket)
+		return;
+
+	ASSERT(ring.pendingWrites == 0, "Can't wait for a staging copy while a thread is writing into the ring");
+
+	IssueStagingCopies(ring, UINT32_MAX);
+	RetireStagingFences(ring, true);
+}
+
+u64 StageUpload(StagingRing& ring, const Buffer* dst, u32 dstOffset, const void* data, u32 size)
+{
+	u64 ticket = 0;
+	void* staging = StagingReserve(ring, size, dst, dstOffset, ticket);
+
+	//Full, wait for the copies in flight and try again
+	if (!staging && size <= ring.buffer.size)
+	{
+		FinishStagingRing(ring);
+		staging = StagingReserve(ring, size, dst, dstOffset, ticket);
+	}
+
+	if (!staging)
+	{
+		StateBindBuffer(GL_COPY_WRITE_BUFFER, dst->handle);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, dstOffset, size, data);
+		StateBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return 0;
+	}
+
+	memcpy(staging, data, size);
+	StagingCommit(ring, ticket);
+	return ticket;
+}
\ No newline at end of file
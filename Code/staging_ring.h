@@ -0,0 +1,25 @@
+#pragma once
+
+#include "engine.h"
+
+void InitStagingRing(StagingRing& ring, u32 capacity, u32 bytesPerFrame);
+
+//Thread safe. Returns a pointer into the mapped ring, or NULL if there is no room left.
+//The data is copied to dst at dstOffset once the reservation is committed and the ring is flushed.
+void* StagingReserve(StagingRing& ring, u32 size, const Buffer* dst, u32 dstOffset, u64& ticket);
+
+//Thread safe. Marks the reserved bytes as written
+void StagingCommit(StagingRing& ring, u64 ticket);
+
+//GL thread only. Issues the committed copies, in order, up to byteBudget bytes, and reclaims the finished ones
+void FlushStagingRing(StagingRing& ring, u32 byteBudget);
+
+//GL thread only. Issues every pending copy and waits until the GPU is done with the ring
+void FinishStagingRing(StagingRing& ring);
+
+//GL thread only. Returns once the copy of the ticket is done on the GPU, issuing the pending copies if needed.
+//Ticket 0 (uploads that didn't go through the ring) never waits.
+void WaitForStagingTicket(StagingRing& ring, u64 ticket);
+
+//GL thread only. Reserve + memcpy + commit, falling back to glBufferSubData if the data doesn't fit in the ring
+u64 StageUpload(StagingRing& ring, const Buffer* dst, u32 dstOffset, const void* data, u32 size);
\ No newline at end of file
@@ -0,0 +1,163 @@
+//
+// std140_layout.h: Compile-time descriptors of std140 uniform blocks. A block is declared as the
+// list of its GLSL member types, offsets and padding are computed by the compiler, and the block
+// is filled in a CPU side copy that is sent to the uniform buffer in a single bulk copy.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+
+namespace std140
+{
+	constexpr u32 AlignUp(u32 value, u32 alignment)
+	{
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	constexpr u32 Max(u32 a, u32 b)
+	{
+		return a > b ? a : b;
+	}
+
+	template<typename T, u32 N> struct Array {};
+	template<typename... Fields> struct Struct;
+
+	// Base alignment and size of every supported GLSL type --------------------------------------------------------------
+
+	template<typename T> struct Type;
+
+	template<typename T, u32 Alignment, u32 Size>
+	struct ScalarType
+	{
+		static constexpr u32 alignment = Alignment;
+		static constexpr u32 size = Size;
+
+		static void Write(u8* dst, const T& value)
+		{
+			static_assert(sizeof(T) == Size, "The C++ type does not match the size of the GLSL type");
+			memcpy(dst, &value, Size);
+		}
+	};
+
+	template<> struct Type<u32>       : ScalarType<u32, 4, 4> {};
+	template<> struct Type<i32>       : ScalarType<i32, 4, 4> {};
+	template<> struct Type<f32>       : ScalarType<f32, 4, 4> {};
+	template<> struct Type<glm::vec2> : ScalarType<glm::vec2, 8, 8> {};
+	template<> struct Type<glm::vec3> : ScalarType<glm::vec3, 16, 12> {};
+	template<> struct Type<glm::vec4> : ScalarType<glm::vec4, 16, 16> {};
+	template<> struct Type<glm::mat4> : ScalarType<glm::mat4, 16, 64> {};
+
+	//Array elements are always padded to the size of a vec4
+	template<typename T, u32 N>
+	struct Type<Array<T, N>>
+	{
+		static constexpr u32 alignment = AlignUp(Type<T>::alignment, 16);
+		static constexpr u32 stride = AlignUp(Type<T>::size, 16);
+		static constexpr u32 size = stride * N;
+	};
+
+	// Offsets of the members of a block ------------------------------------------------------------------------------
+
+	template<typename... Fields>
+	struct Layout
+	{
+		static constexpr u32 count = sizeof...(Fields);
+
+		static constexpr u32 Offset(u32 index)
+		{
+			const u32 alignments[] = { Type<Fields>::alignment... };
+			const u32 sizes[] = { Type<Fields>::size... };
+
+			u32 head = 0;
+			for (u32 i = 0; i < index; ++i)
+			{
+				head = AlignUp(head, alignments[i]) + sizes[i];
+			}
+			return AlignUp(head, alignments[index]);
+		}
+
+		static constexpr u32 Alignment()
+		{
+			const u32 alignments[] = { Type<Fields>::alignment... };
+
+			u32 alignment = 16;
+			for (u32 i = 0; i < count; ++i)
+			{
+				alignment = Max(alignment, alignments[i]);
+			}
+			return alignment;
+		}
+
+		//Structs are padded up to their own alignment, like arrays
+		static constexpr u32 Size()
+		{
+			const u32 sizes[] = { Type<Fields>::size... };
+			return AlignUp(Offset(count - 1) + sizes[count - 1], Alignment());
+		}
+	};
+
+	// CPU side copy of a block ---------------------------------------------------------------------------------------
+
+	template<typename... Fields>
+	struct Struct
+	{
+		typedef Layout<Fields...> Desc;
+
+		template<u32 I>
+		using FieldType = typename std::tuple_element<I, std::tuple<Fields...>>::type;
+
+		static constexpr u32 Offset(u32 index) { return Desc::Offset(index); }
+
+		static constexpr u32 size = Desc::Size();
+
+		u8 data[Desc::Size()];
+
+		template<u32 I>
+		void Set(const FieldType<I>& value)
+		{
+			Type<FieldType<I>>::Write(data + Desc::Offset(I), value);
+		}
+
+		//For array members, sets one element of the array
+		template<u32 I, typename T>
+		void SetElement(u32 element, const T& value)
+		{
+			typedef Type<FieldType<I>> ArrayType;
+			static_assert(std::is_same<FieldType<I>, Array<T, ArrayType::size / ArrayType::stride>>::value, "The member is not an array of this type");
+			ASSERT(element < ArrayType::size / ArrayType::stride, "Array element out of bounds");
+			Type<T>::Write(data + Desc::Offset(I) + element * ArrayType::stride, value);
+		}
+	};
+
+	template<typename... Fields>
+	struct Type<Struct<Fields...>>
+	{
+		static constexpr u32 alignment = Layout<Fields...>::Alignment();
+		static constexpr u32 size = Layout<Fields...>::Size();
+
+		static void Write(u8* dst, const Struct<Fields...>& value)
+		{
+			memcpy(dst, value.data, size);
+		}
+	};
+}
+
+// Description of a block as seen by the shader, used to check the program reflection ----------------------------------
+
+struct UniformFieldLayout
+{
+	const char* name;
+	u32 offset;
+};
+
+struct UniformBlockLayout
+{
+	const char* blockName;
+	u32 size;
+	const UniformFieldLayout* fields;
+	u32 fieldCount;
+};
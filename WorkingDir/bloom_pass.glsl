@@ -1,4 +1,4 @@
-#ifdef BLUR_PASS
+#ifdef BLOOM_DOWNSAMPLE
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
@@ -15,38 +15,73 @@ void main()
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
 in vec2 vTexCoord;
-  
-uniform sampler2D brightColorImage;
 
-uniform float strength;
-uniform int iterations;
-uniform bool horizontal;
+uniform sampler2D uSource;
+uniform vec2 uTexelSize; //of the source, the target has half its resolution
+uniform vec2 uUvScale;   //The source can be bigger than the drawn area
+uniform bool uPrefilter; //first level, from the lit image
+uniform vec4 uThreshold; //threshold, threshold - knee, 2 * knee, 0.25 / knee
 
 layout(location = 0) out vec4 oColor;
 
+float Luminance(vec3 color)
+{
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+//Never past the drawn area, the rest of the source is left from other frames
+vec3 Tap(vec2 uv)
+{
+	return texture(uSource, clamp(uv, 0.5 * uTexelSize, uUvScale - 0.5 * uTexelSize)).rgb;
+}
+
+//Average of 4 bilinear taps. On the first level each tap is weighted down by its brightness,
+//so a single very bright pixel can't make the whole bloom flicker.
+vec3 Box(vec3 a, vec3 b, vec3 c, vec3 d)
+{
+	if (!uPrefilter)
+		return (a + b + c + d) * 0.25;
+
+	vec4 weights = 1.0 / (1.0 + vec4(Luminance(a), Luminance(b), Luminance(c), Luminance(d)));
+	return (a * weights.x + b * weights.y + c * weights.z + d * weights.w) / dot(weights, vec4(1.0));
+}
+
+//Quadratic soft knee below the threshold, linear past it
+vec3 Prefilter(vec3 color)
+{
+	float brightness = Luminance(color);
+	float soft = clamp(brightness - uThreshold.y, 0.0, uThreshold.z);
+	soft = soft * soft * uThreshold.w;
+	return color * max(soft, brightness - uThreshold.x) / max(brightness, 0.0001);
+}
+
+//13 taps, 5 overlapping boxes. Wider than a 2x2 box so the bloom doesn't shimmer when things move.
 void main()
-{             
-	vec2 tex_offset = 1.0 / textureSize(brightColorImage, 0);
-    vec3 result = texture(brightColorImage, vTexCoord).rgb * exp(-(pow(1,2)/strength));
-
-	if (horizontal)
-	{
-		for(int i = 1; i < iterations; ++i)
-		{
-			result += texture(brightColorImage, vTexCoord + vec2(tex_offset.x * i, 0.0)).rgb * exp(-(pow(i,2)/pow(strength,2)));
-			result += texture(brightColorImage, vTexCoord - vec2(tex_offset.x * i, 0.0)).rgb * exp(-(pow(i,2)/pow(strength,2)));
-		}
-	}
-	else
-	{
-		for(int i = 1; i < iterations; ++i)
-		{
-			result += texture(brightColorImage, vTexCoord + vec2(0.0, tex_offset.y * i)).rgb * exp(-(pow(i,2)/pow(strength,2)));
-			result += texture(brightColorImage, vTexCoord - vec2(0.0, tex_offset.y * i)).rgb * exp(-(pow(i,2)/pow(strength,2)));
-		}
-	}
-
-    oColor = vec4(result, 1.0);
+{
+	vec2 uv = vTexCoord * uUvScale;
+	vec2 t = uTexelSize;
+
+	vec3 a = Tap(uv + t * vec2(-2.0,  2.0));
+	vec3 b = Tap(uv + t * vec2( 0.0,  2.0));
+	vec3 c = Tap(uv + t * vec2( 2.0,  2.0));
+	vec3 d = Tap(uv + t * vec2(-2.0,  0.0));
+	vec3 e = Tap(uv);
+	vec3 f = Tap(uv + t * vec2( 2.0,  0.0));
+	vec3 g = Tap(uv + t * vec2(-2.0, -2.0));
+	vec3 h = Tap(uv + t * vec2( 0.0, -2.0));
+	vec3 i = Tap(uv + t * vec2( 2.0, -2.0));
+	vec3 j = Tap(uv + t * vec2(-1.0,  1.0));
+	vec3 k = Tap(uv + t * vec2( 1.0,  1.0));
+	vec3 l = Tap(uv + t * vec2(-1.0, -1.0));
+	vec3 m = Tap(uv + t * vec2( 1.0, -1.0));
+
+	vec3 color = Box(j, k, l, m) * 0.5;
+	color += (Box(a, b, d, e) + Box(b, c, e, f) + Box(d, e, g, h) + Box(e, f, h, i)) * 0.125;
+
+	if (uPrefilter)
+		color = Prefilter(color);
+
+	oColor = vec4(color, 1.0);
 }
 #endif
 #endif
@@ -54,7 +89,7 @@ void main()
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#ifdef MIX_BLOOM
+#ifdef BLOOM_UPSAMPLE
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
@@ -71,24 +106,30 @@ void main()
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
 in vec2 vTexCoord;
-  
-uniform sampler2D blurredImage;
-uniform sampler2D originalColor;
+
+uniform sampler2D uSource; //the level below the target
+uniform vec2 uTexelSize;   //of the source
+uniform vec2 uUvScale;
+uniform float uRadius;     //in source texels, spreads the taps without adding any
 
 layout(location = 0) out vec4 oColor;
 
+vec3 Tap(vec2 uv)
+{
+	return texture(uSource, clamp(uv, 0.5 * uTexelSize, uUvScale - 0.5 * uTexelSize)).rgb;
+}
+
+//3x3 tent, added to the target by the blending
 void main()
 {
-	float exposure = 2;
-	const float gamma = 0.4;
-    vec3 hdrColor = texture(originalColor, vTexCoord).rgb;      
-    vec3 bloomColor = texture(blurredImage, vTexCoord).rgb;
-    hdrColor += bloomColor; // additive blending
-	
-    vec3 result = vec3(1.0) - exp(-hdrColor * exposure);
-	   
-    result = pow(result, vec3(1.0 / gamma));
-    oColor = vec4(result, 1.0);
+	vec2 uv = vTexCoord * uUvScale;
+	vec2 t = uTexelSize * uRadius;
+
+	vec3 color = Tap(uv) * 4.0;
+	color += (Tap(uv + vec2(-t.x, 0.0)) + Tap(uv + vec2(t.x, 0.0)) + Tap(uv + vec2(0.0, -t.y)) + Tap(uv + vec2(0.0, t.y))) * 2.0;
+	color += Tap(uv + vec2(-t.x, -t.y)) + Tap(uv + vec2(t.x, -t.y)) + Tap(uv + vec2(-t.x, t.y)) + Tap(uv + vec2(t.x, t.y));
+
+	oColor = vec4(color / 16.0, 1.0);
 }
 #endif
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifdef BUILD_LIGHT_CLUSTERS
+
+#if defined(COMPUTE) ///////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+//Same layout as GpuLight, the scalars fill the padding after the vec3s
+struct Light
+{
+	vec3 position;
+	float radius; //Point lights only
+	vec3 color;
+	float strength;
+	vec3 direction;
+	uint type; //0 directional, 1 point
+};
+
+//Every light of the scene, the count is padded to the alignment of the array
+layout(binding = 4, std430) readonly buffer Lights
+{
+	uint uLightCount;
+	Light uLights[];
+};
+
+//Point light count of every cluster, then uClusterMaxLights light indices per cluster
+layout(binding = 1, std430) writeonly buffer LightClusters
+{
+	uint uClusters[];
+};
+
+uniform mat4 uView;
+uniform mat4 uInverseProjection;
+uniform vec2 uDepthRange; //near and far distances
+uniform uvec3 uClusterGrid;
+uniform uint uClusterMaxLights;
+
+//View space spheres of a batch of lights, loaded once for the whole group. The directional lights get a negative radius.
+shared vec4 sLights[64];
+
+//View space point at a depth on the ray through a point of the near plane
+vec3 PointAtDepth(vec2 ndc, float viewDepth)
+{
+	vec4 nearPoint = uInverseProjection * vec4(ndc, -1.0, 1.0);
+	nearPoint.xyz /= nearPoint.w;
+	return nearPoint.xyz * (viewDepth / -nearPoint.z);
+}
+
+void main()
+{
+	uint clusterCount = uClusterGrid.x * uClusterGrid.y * uClusterGrid.z;
+	uint clusterIdx = gl_GlobalInvocationID.x;
+	bool active = clusterIdx < clusterCount;
+
+	//Box around the tile between the two depths of its slice, slices get thicker exponentially
+	uvec3 cell = uvec3(clusterIdx % uClusterGrid.x, (clusterIdx / uClusterGrid.x) % uClusterGrid.y, clusterIdx / (uClusterGrid.x * uClusterGrid.y));
+	vec2 ndcMin = vec2(cell.xy) / vec2(uClusterGrid.xy) * 2.0 - 1.0;
+	vec2 ndcMax = vec2(cell.xy + 1u) / vec2(uClusterGrid.xy) * 2.0 - 1.0;
+
+	float depthRatio = uDepthRange.y / uDepthRange.x;
+	float sliceNear = uDepthRange.x * pow(depthRatio, float(cell.z) / float(uClusterGrid.z));
+	float sliceFar = uDepthRange.x * pow(depthRatio, float(cell.z + 1u) / float(uClusterGrid.z));
+
+	vec3 boxMin = vec3(1e30);
+	vec3 boxMax = vec3(-1e30);
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		vec2 ndc = vec2((corner & 1) != 0 ? ndcMax.x : ndcMin.x, (corner & 2) != 0 ? ndcMax.y : ndcMin.y);
+		vec3 point = PointAtDepth(ndc, (corner & 4) != 0 ? sliceFar : sliceNear);
+		boxMin = min(boxMin, point);
+		boxMax = max(boxMax, point);
+	}
+
+	uint count = 0u;
+	uint firstIndex = clusterCount + clusterIdx * uClusterMaxLights;
+
+	//Every invocation goes through the batches, even the ones past the last cluster, so the barriers are reached by the whole group
+	for (uint batchStart = 0u; batchStart < uLightCount; batchStart += 64u)
+	{
+		uint lightIdx = batchStart + gl_LocalInvocationIndex;
+		if (lightIdx < uLightCount)
+		{
+			Light light = uLights[lightIdx];
+			float radius = light.type == 1u ? light.radius : -1.0;
+			sLights[gl_LocalInvocationIndex] = vec4((uView * vec4(light.position, 1.0)).xyz, radius);
+		}
+
+		barrier();
+
+		uint batchSize = min(64u, uLightCount - batchStart);
+		for (uint i = 0u; active && i < batchSize; ++i)
+		{
+			//Sphere against box, from the closest point of the box
+			vec4 light = sLights[i];
+			vec3 offset = clamp(light.xyz, boxMin, boxMax) - light.xyz;
+
+			if (light.w > 0.0 && dot(offset, offset) <= light.w * light.w && count < uClusterMaxLights)
+			{
+				uClusters[firstIndex + count] = batchStart + i;
+				count++;
+			}
+		}
+
+		barrier();
+	}
+
+	if (active)
+		uClusters[clusterIdx] = count;
+}
+
+#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifdef COMPOSITE
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+out vec2 vTexCoord;
+
+//One triangle that covers the screen, (0,0) (2,0) (0,2) in uv space, no vertex buffer needed
+void main()
+{
+	vec2 uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	vTexCoord = uv;
+	gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+uniform sampler2D uLitImage;
+uniform sampler2D uBloomImage;
+uniform vec2 uUvScale; //The targets can be bigger than the drawn area
+uniform float uBloomIntensity;
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+	const float exposure = 2.0;
+	const float gamma = 0.4;
+
+	vec2 uv = vTexCoord * uUvScale;
+	vec3 hdrColor = texture(uLitImage, uv).rgb;
+	hdrColor += texture(uBloomImage, uv).rgb * uBloomIntensity; // additive blending
+
+	vec3 result = vec3(1.0) - exp(-hdrColor * exposure);
+	result = pow(result, vec3(1.0 / gamma));
+	oColor = vec4(result, 1.0);
+}
+#endif
+#endif
\ No newline at end of file
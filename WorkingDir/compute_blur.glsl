@@ -0,0 +1,62 @@
+#if defined(SEPARABLE_BLUR_COLOR) || defined(SEPARABLE_BLUR_RED)
+
+#if defined(COMPUTE) ///////////////////////////////////////////////////
+
+//COMPUTE_BLUR_TILE and COMPUTE_BLUR_MAX_RADIUS
+#define TILE 128
+#define MAX_RADIUS 32
+
+layout(local_size_x = TILE) in;
+
+uniform sampler2D uSource;
+
+#ifdef SEPARABLE_BLUR_COLOR
+layout(binding = 0, r11f_g11f_b10f) writeonly uniform image2D uDestination;
+#else
+layout(binding = 0, r16f) writeonly uniform image2D uDestination;
+#endif
+
+uniform ivec2 uDirection; //(1, 0) or (0, 1)
+uniform ivec2 uSize;      //texels to blur, from the bottom left
+uniform int uRadius;
+uniform float uWeights[MAX_RADIUS + 1]; //center first, mirrored on both sides
+
+//The texels of the line this group writes and the radius on both sides, fetched once for the whole group
+shared vec3 sTile[TILE + 2 * MAX_RADIUS];
+
+ivec2 LineTexel(int along, int line)
+{
+	return uDirection.x != 0 ? ivec2(along, line) : ivec2(line, along);
+}
+
+void main()
+{
+	int lineLength = uDirection.x != 0 ? uSize.x : uSize.y;
+	int line = int(gl_WorkGroupID.y);
+	int first = int(gl_WorkGroupID.x) * TILE;
+	int local = int(gl_LocalInvocationIndex);
+
+	//Clamped to the edges of the blurred area
+	for (int i = local; i < TILE + 2 * uRadius; i += TILE)
+	{
+		int along = clamp(first - uRadius + i, 0, lineLength - 1);
+		sTile[i] = texelFetch(uSource, LineTexel(along, line), 0).rgb;
+	}
+
+	barrier();
+
+	if (first + local >= lineLength)
+		return;
+
+	int center = local + uRadius;
+	vec3 result = sTile[center] * uWeights[0];
+	for (int i = 1; i <= uRadius; ++i)
+	{
+		result += (sTile[center - i] + sTile[center + i]) * uWeights[i];
+	}
+
+	imageStore(uDestination, LineTexel(first + local, line), vec4(result, 1.0));
+}
+
+#endif
+#endif
\ No newline at end of file
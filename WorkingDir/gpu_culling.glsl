@@ -0,0 +1,185 @@
+#ifdef FRUSTUM_CULL_INSTANCES
+
+#if defined(COMPUTE) ///////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+//Same members as LocalParams, one entry per entity
+struct InstanceParams
+{
+	mat4 worldMatrix;
+	mat4 worldViewProjectionMatrix;
+	int reflectiveness;
+};
+
+//One per submesh of every entity
+struct CullInstance
+{
+	vec4 localSphere;
+	uint commandIdx;
+	uint instanceParamIdx;
+};
+
+//Same layout as DrawElementsIndirectCommand
+struct DrawCommand
+{
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout(binding = 0, std430) readonly buffer Instances
+{
+	InstanceParams uInstances[];
+};
+
+layout(binding = 1, std430) readonly buffer CullInstances
+{
+	CullInstance uCullInstances[];
+};
+
+layout(binding = 2, std430) buffer Commands
+{
+	DrawCommand uCommands[];
+};
+
+//Instance remap table, read by the vertex shader as the per instance aInstanceIndex attribute
+layout(binding = 3, std430) writeonly buffer InstanceIndices
+{
+	uint uInstanceIndices[];
+};
+
+//Normalized and pointing inwards
+uniform vec4 uPlanes[6];
+uniform uint uInstanceCount;
+
+//Depth pyramid of the previous frame, closest depth in r and farthest in g
+uniform bool uOcclusionEnabled;
+uniform sampler2D uHiZ;
+uniform int uHiZLevelCount;
+uniform mat4 uHiZViewProjection;
+
+//True when every pixel the sphere covers in the previous frame had something closer than the sphere
+bool IsOccluded(vec3 center, float radius)
+{
+	vec2 uvMin = vec2(1.0);
+	vec2 uvMax = vec2(0.0);
+	float closestDepth = 1.0;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+		vec4 clip = uHiZViewProjection * vec4(corner, 1.0);
+
+		//Crosses the camera plane, the projection is not bounded
+		if (clip.w <= 0.0)
+			return false;
+
+		vec3 ndc = clip.xyz / clip.w;
+		uvMin = min(uvMin, ndc.xy * 0.5 + 0.5);
+		uvMax = max(uvMax, ndc.xy * 0.5 + 0.5);
+		closestDepth = min(closestDepth, ndc.z * 0.5 + 0.5);
+	}
+
+	uvMin = clamp(uvMin, 0.0, 1.0);
+	uvMax = clamp(uvMax, 0.0, 1.0);
+
+	//Level where the bounds cover at most 2x2 texels
+	vec2 extent = (uvMax - uvMin) * vec2(textureSize(uHiZ, 0));
+	int level = int(ceil(log2(max(max(extent.x, extent.y), 1.0))));
+	if (level >= uHiZLevelCount)
+		return false;
+
+	ivec2 levelSize = textureSize(uHiZ, level);
+	ivec2 first = min(ivec2(uvMin * vec2(levelSize)), levelSize - 1);
+	ivec2 last = min(ivec2(uvMax * vec2(levelSize)), levelSize - 1);
+
+	float farthestDepth = 0.0;
+	for (int y = first.y; y <= last.y; ++y)
+	{
+		for (int x = first.x; x <= last.x; ++x)
+		{
+			farthestDepth = max(farthestDepth, texelFetch(uHiZ, ivec2(x, y), level).g);
+		}
+	}
+
+	return closestDepth > farthestDepth;
+}
+
+void main()
+{
+	uint idx = gl_GlobalInvocationID.x;
+	if (idx >= uInstanceCount)
+		return;
+
+	CullInstance instance = uCullInstances[idx];
+	mat4 worldMatrix = uInstances[instance.instanceParamIdx].worldMatrix;
+
+	vec3 center = (worldMatrix * vec4(instance.localSphere.xyz, 1.0)).xyz;
+	float scale = max(length(worldMatrix[0].xyz), max(length(worldMatrix[1].xyz), length(worldMatrix[2].xyz)));
+	float radius = instance.localSphere.w * scale;
+
+	for (int i = 0; i < 6; ++i)
+	{
+		if (dot(uPlanes[i].xyz, center) + uPlanes[i].w < -radius)
+			return;
+	}
+
+	if (uOcclusionEnabled && IsOccluded(center, radius))
+		return;
+
+	//Surviving instances are packed at the start of the range of their command
+	uint slot = atomicAdd(uCommands[instance.commandIdx].instanceCount, 1u);
+	uInstanceIndices[uCommands[instance.commandIdx].baseInstance + slot] = instance.instanceParamIdx;
+}
+
+#endif
+#endif
+
+#ifdef HIZ_REDUCE
+
+#if defined(COMPUTE) ///////////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+//Either the depth buffer or the previous level of the pyramid
+uniform sampler2D uSource;
+uniform int uSourceLevel;
+uniform bool uSourceIsDepth;
+uniform ivec2 uSourceSize; //The depth buffer can be bigger than the part that was drawn
+
+//Closest depth in r, farthest in g
+layout(rg32f) writeonly uniform image2D uDestination;
+
+void main()
+{
+	ivec2 destinationSize = imageSize(uDestination);
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(texel, destinationSize)))
+		return;
+
+	//Every source texel the destination texel overlaps, up to 3 per axis when the sizes are not a multiple of 2
+	ivec2 sourceSize = uSourceSize;
+	ivec2 first = (texel * sourceSize) / destinationSize;
+	ivec2 last = ((texel + 1) * sourceSize + destinationSize - 1) / destinationSize;
+
+	vec2 depthRange = vec2(1.0, 0.0);
+	for (int y = first.y; y < last.y; ++y)
+	{
+		for (int x = first.x; x < last.x; ++x)
+		{
+			vec4 value = texelFetch(uSource, ivec2(x, y), uSourceLevel);
+			vec2 sourceRange = uSourceIsDepth ? value.rr : value.rg;
+
+			depthRange.x = min(depthRange.x, sourceRange.x);
+			depthRange.y = max(depthRange.y, sourceRange.y);
+		}
+	}
+
+	imageStore(uDestination, texel, vec4(depthRange, 0.0, 0.0));
+}
+
+#endif
+#endif
\ No newline at end of file
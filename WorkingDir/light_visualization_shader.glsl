@@ -4,25 +4,39 @@
 
 layout(location=0) in vec3 aPosition;
 
-layout(binding = 0, std140) uniform LocalParams
+struct LightGizmo
 {
-	mat4 uWorldViewProjectionMatrix;
+	mat4 worldMatrix;
+	vec4 color;
 };
 
+//Grouped by shape, each draw reads its own range
+layout(binding = 6, std430) readonly buffer LightGizmos
+{
+	LightGizmo uGizmos[];
+};
+
+uniform mat4 uViewProjection;
+uniform uint uFirstInstance;
+
+flat out vec3 vColor;
+
 void main()
 {
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+	LightGizmo gizmo = uGizmos[uFirstInstance + uint(gl_InstanceID)];
+	vColor = gizmo.color.rgb;
+	gl_Position = uViewProjection * gizmo.worldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-uniform vec3 lightColor;
+flat in vec3 vColor;
 
 layout(location = 0) out vec4 oColor;
 
 void main()
 {
-	oColor = vec4(lightColor, 1);
+	oColor = vec4(vColor, 1);
 }
 
 #endif
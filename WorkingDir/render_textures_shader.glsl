@@ -1,13 +1,42 @@
+//Same layout as GpuLight, the scalars fill the padding after the vec3s
 struct Light
 {
-	unsigned int type;
-	unsigned int strength;
+	vec3 position;
+	float radius; //Point lights only
 	vec3 color;
+	float strength;
 	vec3 direction;
-	vec3 position;
+	uint type; //0 directional, 1 point
 };
 
-#ifdef RENDER_TEXTURES
+//Octahedral encoding, a unit vector folded into two [0, 1] channels
+vec2 EncodeNormal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+	return e * 0.5 + 0.5;
+}
+
+vec3 DecodeNormal(vec2 e)
+{
+	e = e * 2.0 - 1.0;
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+//World position of a pixel from its depth buffer value
+vec3 ReconstructPosition(vec2 uv, float depth, mat4 inverseViewProjection)
+{
+	vec4 ndc = vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	vec4 position = inverseViewProjection * ndc;
+	return position.xyz / position.w;
+}
+
+#if defined(RENDER_TEXTURES) || defined(RENDER_TEXTURES_INDIRECT)
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
@@ -20,10 +49,27 @@ layout(location=4) in vec3 aBitangent;
 layout(binding = 0, std140) uniform GlobalParams
 {
 	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
 };
 
+#ifdef RENDER_TEXTURES_INDIRECT
+
+//Same members as LocalParams, one entry per entity
+struct InstanceParams
+{
+	mat4 worldMatrix;
+	mat4 worldViewProjectionMatrix;
+	int reflectiveness;
+};
+
+layout(location=5) in uint aInstanceIndex;
+
+layout(binding = 0, std430) readonly buffer Instances
+{
+	InstanceParams uInstances[];
+};
+
+#else
+
 layout(binding = 1, std140) uniform LocalParams
 {
 	mat4 uWorldMatrix;
@@ -31,14 +77,29 @@ layout(binding = 1, std140) uniform LocalParams
 	int reflectiveness;
 };
 
+#endif
+
 out vec2 vTexCoord;
 out vec3 vPosition; //In worldspace
 out vec3 vNormal; //In worldspace
 out vec3 vViewDir;
 out float entityReflectiveness;
 
+//The depth pre-pass computes it with the same expression, both must give the exact same depth
+invariant gl_Position;
+
 void main()
 {
+#ifdef RENDER_TEXTURES_INDIRECT
+	mat4 worldMatrix = uInstances[aInstanceIndex].worldMatrix;
+	mat4 worldViewProjectionMatrix = uInstances[aInstanceIndex].worldViewProjectionMatrix;
+	int instanceReflectiveness = uInstances[aInstanceIndex].reflectiveness;
+#else
+	mat4 worldMatrix = uWorldMatrix;
+	mat4 worldViewProjectionMatrix = uWorldViewProjectionMatrix;
+	int instanceReflectiveness = reflectiveness;
+#endif
+
 	vTexCoord = aTexCoord;
 
 	// We will usually not define the clipping scale manually...
@@ -48,11 +109,11 @@ void main()
 	//float clippingScale = 5.0;
 	
 	vTexCoord = aTexCoord;
-	vPosition = vec3( uWorldMatrix * vec4(aPosition, 1.0) );
-	vNormal = vec3( uWorldMatrix * vec4(aNormal, 0.0) );
+	vPosition = vec3( worldMatrix * vec4(aPosition, 1.0) );
+	vNormal = vec3( worldMatrix * vec4(aNormal, 0.0) );
 	vViewDir = uCameraPosition - vPosition;
-	entityReflectiveness = float(reflectiveness) / 100.0f;
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+	entityReflectiveness = float(instanceReflectiveness) / 100.0f;
+	gl_Position = worldViewProjectionMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -70,14 +131,10 @@ uniform samplerCube cubeTexture;
 layout(binding = 0, std140) uniform GlobalParams
 {
 	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
 };
 
 layout(location = 0) out vec4 rt0; //Albedo
-layout(location = 1) out vec4 rt1; //Normals
-layout(location = 2) out vec4 rt2; //Position
-//layout(location = 3) out vec4 rt3; //Deferred
+layout(location = 1) out vec2 rt1; //Octahedral normal, the position comes from the depth
 
 void main()
 {
@@ -88,10 +145,68 @@ void main()
 	vec3 albedoColor = texture(uTexture, vTexCoord).rgb;
 
 	rt0 = vec4(mix(albedoColor, skyboxColor, entityReflectiveness), 1.0);
-	rt1 = vec4(normalize(vNormal), 1.0);
-	rt2 = vec4(vPosition, 1.0);
+	rt1 = EncodeNormal(normalize(vNormal));
+}
+
+#endif
+#endif
+
+////////////////////////////////////////////////////////////////////////
+//----------------------------------------------------------------------
+////////////////////////////////////////////////////////////////////////
+
+#if defined(DEPTH_PREPASS) || defined(DEPTH_PREPASS_INDIRECT)
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+#ifdef DEPTH_PREPASS_INDIRECT
+
+//Same members as LocalParams, one entry per entity
+struct InstanceParams
+{
+	mat4 worldMatrix;
+	mat4 worldViewProjectionMatrix;
+	int reflectiveness;
+};
+
+layout(location=5) in uint aInstanceIndex;
+
+layout(binding = 0, std430) readonly buffer Instances
+{
+	InstanceParams uInstances[];
+};
+
+#else
 
-	//rt3 = vec4(1.0, 1.0, 0.0, 1.0);
+layout(binding = 1, std140) uniform LocalParams
+{
+	mat4 uWorldMatrix;
+	mat4 uWorldViewProjectionMatrix;
+	int reflectiveness;
+};
+
+#endif
+
+invariant gl_Position;
+
+void main()
+{
+#ifdef DEPTH_PREPASS_INDIRECT
+	mat4 worldViewProjectionMatrix = uInstances[aInstanceIndex].worldViewProjectionMatrix;
+#else
+	mat4 worldViewProjectionMatrix = uWorldViewProjectionMatrix;
+#endif
+
+	gl_Position = worldViewProjectionMatrix * vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+//Depth only, color writes are masked
+void main()
+{
 }
 
 #endif
@@ -101,13 +216,27 @@ void main()
 //----------------------------------------------------------------------
 ////////////////////////////////////////////////////////////////////////
 
-#ifdef DEFERRED_LIGHTING_PASS
+#if defined(DEFERRED_LIGHTING_PASS) || defined(CLUSTERED_LIGHTING_PASS) || defined(LIGHT_VOLUME_PASS)
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location=0) in vec3 aPosition;
 layout(location=1) in vec2 aTexCoord;
 
+#ifdef LIGHT_VOLUME_PASS
+
+uniform mat4 uViewProjection;
+uniform vec4 uLightPositionRadius;
+uniform float uVolumeScale; //The sphere mesh is inside the unit sphere
+
+void main()
+{
+	vec3 position = uLightPositionRadius.xyz + aPosition * uLightPositionRadius.w * uVolumeScale;
+	gl_Position = uViewProjection * vec4(position, 1.0);
+}
+
+#else
+
 out vec2 vTexCoord;
 
 void main()
@@ -116,78 +245,253 @@ void main()
 	gl_Position = vec4(aPosition, 1.0);
 }
 
+#endif
+
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
+#ifdef LIGHT_VOLUME_PASS
+
+uniform vec4 uLightPositionRadius;
+uniform vec3 uLightColor; //times the strength
+uniform vec2 uInverseViewportSize;
+
+#else
+
 in vec2 vTexCoord;
 
-uniform sampler2D positionTexture;
+#endif
+
+uniform sampler2D depthTexture;
 uniform sampler2D normalTexture;
 uniform sampler2D albedoTexture;
 
+uniform mat4 uInverseViewProjection;
+uniform vec2 uUvScale; //The targets can be bigger than the drawn area
+
 layout(binding = 0, std140) uniform GlobalParams
 {
 	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
 };
 
-layout(location = 0) out vec4 oColor;
-layout(location = 1) out vec4 brightColor;
+#ifndef LIGHT_VOLUME_PASS
 
-void main()
+//Every light of the scene, the count is padded to the alignment of the array
+layout(binding = 4, std430) readonly buffer Lights
+{
+	uint uLightCount;
+	Light uLights[];
+};
+
+//Indices of the directional lights in uLights, they light every pixel
+layout(binding = 5, std430) readonly buffer DirectionalLights
+{
+	uint uDirectionalLightCount;
+	uint uDirectionalLights[];
+};
+
+#endif
+
+#ifdef CLUSTERED_LIGHTING_PASS
+
+//Point light count of every cluster, then uClusterMaxLights light indices per cluster
+layout(binding = 1, std430) readonly buffer LightClusters
 {
-	vec3 position = texture(positionTexture, vTexCoord).rgb;
-	vec3 norm = texture(normalTexture, vTexCoord).rgb;
-	vec3 texColor = texture(albedoTexture, vTexCoord).rgb;
+	uint uClusters[];
+};
 
+uniform mat4 uView;
+uniform vec2 uDepthRange; //near and far distances
+uniform uvec3 uClusterGrid;
+uniform uint uClusterMaxLights;
+
+#endif
+
+#ifdef DEFERRED_LIGHTING_PASS
+uniform bool uDirectionalOnly; //The light volumes do the point lights
+#endif
+
+layout(location = 0) out vec4 oColor; //The bloom takes the bright parts from it
+
+//Smooth falloff that reaches 0 at the radius, so the lights can be binned by it
+float LightAttenuation(float distance, float radius)
+{
+	float ratio = distance / radius;
+	float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+	return window * window;
+}
+
+//Ambient, diffuse and specular of one light, the ambient is added per light too
+vec3 ShadeLight(vec3 lightDir, vec3 lightColor, float attenuation, vec3 position, vec3 norm, vec3 texColor)
+{
 	//Ambient
 	float ambientStrength = 0.2;
 	vec3 ambientColor = vec3(1.0f);
-    vec3 ambient = ambientStrength * ambientColor;
+	vec3 ambient = ambientStrength * ambientColor;
+
+	//Diffuse
+	float diff = max(dot(norm, lightDir), 0.0);
+	vec3 diffuse = diff * lightColor;
+
+	//Specular
+	float specularStrength = 0.5f;
+	int specularShininess = 8;
+	vec3 viewDir = normalize(uCameraPosition - position);
+	vec3 reflectDir = reflect(-lightDir, norm);
+
+	float spec = pow(max(dot(viewDir, reflectDir), 0.0), pow(specularShininess, 2));
+	vec3 specular = specularStrength * spec * lightColor;
+
+	//Final
+	return (ambient + diffuse + specular) * attenuation * texColor;
+}
+
+void main()
+{
+#ifdef LIGHT_VOLUME_PASS
+	vec2 screenUv = gl_FragCoord.xy * uInverseViewportSize;
+#else
+	vec2 screenUv = vTexCoord;
+#endif
+
+	vec2 uv = screenUv * uUvScale;
+	vec3 position = ReconstructPosition(screenUv, texture(depthTexture, uv).r, uInverseViewProjection);
+	vec3 norm = DecodeNormal(texture(normalTexture, uv).rg);
+	vec3 texColor = texture(albedoTexture, uv).rgb;
 
 	vec3 result = vec3(0);
 
-	for(int i = 0; i < uLightCount; i++)
+#if defined(LIGHT_VOLUME_PASS)
+	//Only the pixels marked in the stencil get here, the ones inside the sphere
+	vec3 toLight = uLightPositionRadius.xyz - position;
+	float attenuation = LightAttenuation(length(toLight), uLightPositionRadius.w);
+	result = ShadeLight(normalize(toLight), uLightColor, attenuation, position, norm, texColor);
+#elif defined(CLUSTERED_LIGHTING_PASS)
+	//Directional lights light every cluster
+	for (uint i = 0u; i < uDirectionalLightCount; i++)
+	{
+		Light light = uLights[uDirectionalLights[i]];
+		result += ShadeLight(normalize(light.direction), light.color * light.strength, 1.0, position, norm, texColor);
+	}
+
+	//Cluster of the pixel, same exponential slices as the binning
+	float viewDepth = -(uView * vec4(position, 1.0)).z;
+	float slice = log(max(viewDepth, uDepthRange.x) / uDepthRange.x) / log(uDepthRange.y / uDepthRange.x) * float(uClusterGrid.z);
+	uvec3 cell = min(uvec3(uvec2(vTexCoord * vec2(uClusterGrid.xy)), uint(slice)), uClusterGrid - 1u);
+	uint clusterIdx = cell.x + cell.y * uClusterGrid.x + cell.z * uClusterGrid.x * uClusterGrid.y;
+
+	uint clusterCount = uClusterGrid.x * uClusterGrid.y * uClusterGrid.z;
+	uint firstIndex = clusterCount + clusterIdx * uClusterMaxLights;
+	uint lightCount = uClusters[clusterIdx];
+
+	for (uint i = 0u; i < lightCount; i++)
+	{
+		Light light = uLights[uClusters[firstIndex + i]];
+		vec3 toLight = light.position - position;
+
+		float attenuation = LightAttenuation(length(toLight), light.radius);
+		result += ShadeLight(normalize(toLight), light.color * light.strength, attenuation, position, norm, texColor);
+	}
+#else
+	//The light volumes draw the point lights, only the directional ones are left for the full screen pass
+	uint lightCount = uDirectionalOnly ? uDirectionalLightCount : uLightCount;
+	for (uint j = 0u; j < lightCount; j++)
 	{
+		uint i = uDirectionalOnly ? uDirectionalLights[j] : j;
+
 		//Check if point or dir
-		vec3 lightDir; 
-		if (uLight[i].type == 0) //Directional
+		vec3 lightDir;
+		float attenuation = 1.0;
+		if (uLights[i].type == 0) //Directional
 		{
-			lightDir = normalize(uLight[i].direction);
+			lightDir = normalize(uLights[i].direction);
 		}
-		else if (uLight[i].type == 1)
+		else if (uLights[i].type == 1)
 		{
-			lightDir = normalize(uLight[i].position - position);
+			lightDir = normalize(uLights[i].position - position);
+			attenuation = LightAttenuation(length(uLights[i].position - position), uLights[i].radius);
 		}
 
-		//Diffuse
-		float diff = max(dot(norm, lightDir), 0.0);
-		vec3 diffuse = diff * uLight[i].color * uLight[i].strength;
+		result += ShadeLight(lightDir, uLights[i].color * uLights[i].strength, attenuation, position, norm, texColor);
+	}
+#endif
+
+    oColor = vec4(result, 1.0); // FragColor
+}
 
-		//Specular
-		float specularStrength = 0.5f;
-		int specularShininess = 8;
-		vec3 viewDir = normalize(uCameraPosition - position);
-		vec3 reflectDir = reflect(-lightDir, norm);
+#endif
+#endif
 
-		float spec = pow(max(dot(viewDir, reflectDir), 0.0), pow(specularShininess, 2));
-		vec3 specular = specularStrength * spec * uLight[i].color * uLight[i].strength;
+////////////////////////////////////////////////////////////////////////
+//----------------------------------------------------------------------
+////////////////////////////////////////////////////////////////////////
 
-		//Final
-		result += (ambient + diffuse + specular) * texColor;
-	}
-	
-    oColor = vec4(result, 1.0); // FragColor
-	
-    float brightness = dot(oColor.rgb, vec3(0.2126, 0.7152, 0.0722));
-    if (brightness > 1.0) 
-	{
-        brightColor = vec4(oColor.rgb, 1.0);
-	}
-    else 
-	{
-        brightColor = vec4(0.0, 0.0, 0.0, 1.0);
-	}
+#ifdef LIGHT_VOLUME_STENCIL
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+uniform mat4 uViewProjection;
+uniform vec4 uLightPositionRadius;
+uniform float uVolumeScale;
+
+//Same position as LIGHT_VOLUME_PASS
+void main()
+{
+	vec3 position = uLightPositionRadius.xyz + aPosition * uLightPositionRadius.w * uVolumeScale;
+	gl_Position = uViewProjection * vec4(position, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+//Stencil only, color writes are masked
+void main()
+{
+}
+
+#endif
+#endif
+
+////////////////////////////////////////////////////////////////////////
+//----------------------------------------------------------------------
+////////////////////////////////////////////////////////////////////////
+
+#ifdef GBUFFER_DEBUG
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+uniform sampler2D depthTexture;
+uniform sampler2D normalTexture;
+
+uniform mat4 uInverseViewProjection;
+uniform int uView; //0 normals, 1 position
+uniform vec2 uUvScale;
+
+layout(location = 0) out vec4 oColor;
+
+//Decodes the compact G-buffer for the debug views
+void main()
+{
+	vec2 uv = vTexCoord * uUvScale;
+	if (uView == 0)
+		oColor = vec4(DecodeNormal(texture(normalTexture, uv).rg), 1.0);
+	else
+		oColor = vec4(ReconstructPosition(vTexCoord, texture(depthTexture, uv).r, uInverseViewProjection), 1.0);
 }
 
 #endif
@@ -1,13 +1,15 @@
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
+//Same layout as GpuLight, the scalars fill the padding after the vec3s
 struct Light
 {
-	unsigned int type;
-	unsigned int strength;
+	vec3 position;
+	float radius; //Point lights only
 	vec3 color;
+	float strength;
 	vec3 direction;
-	vec3 position;
+	uint type; //0 directional, 1 point
 };
 
 #ifdef TEXTURED_GEOMETRY
@@ -32,12 +34,13 @@ void main()
 in vec2 vTexCoord;
 
 uniform sampler2D uTexture;
+uniform vec2 uUvScale; //Part of the texture that was drawn
 
 layout(location = 0) out vec4 oColor;
 
 void main()
 {
-	oColor = texture(uTexture, vTexCoord);
+	oColor = texture(uTexture, vTexCoord * uUvScale);
 }
 
 #endif
@@ -62,8 +65,6 @@ layout(location=4) in vec3 aBitangent;
 layout(binding = 0, std140) uniform GlobalParams
 {
 	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
 };
 
 layout(binding = 1, std140) uniform LocalParams
@@ -107,8 +108,13 @@ uniform sampler2D uTexture;
 layout(binding = 0, std140) uniform GlobalParams
 {
 	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
+};
+
+//Every light of the scene, the count is padded to the alignment of the array
+layout(binding = 4, std430) readonly buffer Lights
+{
+	uint uLightCount;
+	Light uLights[];
 };
 
 layout(location = 0) out vec4 oColor;
@@ -126,20 +132,26 @@ void main()
 	{
 		//Check if point or dir
 		vec3 lightDir; 
-		if (uLight[i].type == 0) //Directional
+		float attenuation = 1.0;
+		if (uLights[i].type == 0) //Directional
 		{
-			lightDir = normalize(uLight[i].direction);
+			lightDir = normalize(uLights[i].direction);
 		}
-		else if (uLight[i].type == 1)
+		else if (uLights[i].type == 1)
 		{
-			lightDir = normalize(uLight[i].position - vPosition);
+			lightDir = normalize(uLights[i].position - vPosition);
+
+			//Same falloff as the deferred pass, 0 at the radius
+			float ratio = length(uLights[i].position - vPosition) / uLights[i].radius;
+			float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+			attenuation = window * window;
 		}
 
 		//Diffuse
 		vec3 norm = normalize(vNormal);
 
 		float diff = max(dot(norm, lightDir), 0.0);
-		vec3 diffuse = diff * uLight[i].color * uLight[i].strength;
+		vec3 diffuse = diff * uLights[i].color * uLights[i].strength;
 
 		//Specular
 		float specularStrength = 0.5f;
@@ -148,12 +160,12 @@ void main()
 		vec3 reflectDir = reflect(-lightDir, norm);
 
 		float spec = pow(max(dot(viewDir, reflectDir), 0.0), pow(specularShininess, 2));
-		vec3 specular = specularStrength * spec * uLight[i].color * uLight[i].strength;
+		vec3 specular = specularStrength * spec * uLights[i].color * uLights[i].strength;
 
 		//Final
 		vec3 texColor = texture(uTexture, vTexCoord).rgb;
 
-		result += (ambient + diffuse + specular) * texColor;
+		result += (ambient + diffuse + specular) * attenuation * texColor;
 	}
 
 	oColor = vec4(result, 1.0);
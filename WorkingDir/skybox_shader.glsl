@@ -2,16 +2,17 @@
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
-layout(location=0) in vec3 aPosition;
-
 out vec3 vTexCoord;
 
-uniform mat4 uWorldViewProjectionMatrix;
+uniform mat4 uInverseViewProjection; //Of the view rotation only, the sky doesn't move with the camera
 
+//Full screen triangle on the far plane, it only passes the depth test where nothing was drawn
 void main()
 {
-	vTexCoord = aPosition;
-	gl_Position = uWorldViewProjectionMatrix *  vec4(aPosition, 1.0);
+	vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) * 2.0 - 1.0;
+	vec4 direction = uInverseViewProjection * vec4(position, 1.0, 1.0);
+	vTexCoord = direction.xyz / direction.w;
+	gl_Position = vec4(position, 1.0, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////